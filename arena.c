@@ -0,0 +1,151 @@
+/* tarfs - A GNU tar filesystem for the Hurd.
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or * (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+   USA */
+
+/*
+ * A name arena: interned, immutable strings.
+ *
+ * Each distinct name is stored once, along with its hash value and length,
+ * in chunks which are carved sequentially and never freed: the names of an
+ * archive's members are few compared to its members ("Makefile", "f1",
+ * etc.), and they stay for as long as the filesystem does.  The names are
+ * hashed in a table which grows fourfold whenever it gets twice as many
+ * names as buckets.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <cthreads.h>
+
+#include "arena.h"
+
+/* Size of the chunks, and size from which a name gets a chunk of its own
+   rather than wasting the end of the current one.  Chunks are a bit
+   smaller than 64 KiB so that, along with malloc's own header, they fit in
+   the gaps left by the allocation of aligned slabs (see slab.c).  */
+#define ARENA_CHUNK_SIZE  ((64 << 10) - 64)
+#define ARENA_LARGE_SIZE  (ARENA_CHUNK_SIZE >> 4)
+
+/* Minimum number of buckets of the table */
+#define ARENA_MIN_SIZE    4096
+
+/* Alignment of the names */
+#define ARENA_ALIGN       (sizeof (void *))
+#define ARENA_ROUND(Size) (((Size) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+/* Free part of the current chunk */
+static char *chunk_next = NULL;
+static char *chunk_end = NULL;
+
+/* The table of names, its number of buckets and its number of names */
+static struct arena_name **table = NULL;
+static size_t table_size = 0;
+static size_t table_count = 0;
+
+/* Protects all of the above */
+static struct mutex arena_lock;
+
+/* Returns SIZE bytes of the arena, or NULL.  */
+static void *
+arena_alloc (size_t size)
+{
+  void *ptr;
+
+  size = ARENA_ROUND (size);
+  if (size >= ARENA_LARGE_SIZE)
+    return malloc (size);
+
+  if (chunk_next + size > chunk_end)
+  {
+    chunk_next = malloc (ARENA_CHUNK_SIZE);
+    if (!chunk_next)
+    {
+      chunk_end = NULL;
+      return NULL;
+    }
+    chunk_end = chunk_next + ARENA_CHUNK_SIZE;
+  }
+
+  ptr = chunk_next;
+  chunk_next += size;
+
+  return ptr;
+}
+
+/* Grows the table fourfold.  If memory is short, the current table, if
+   any, is kept.  */
+static void
+table_grow ()
+{
+  size_t size = table_size ? table_size << 2 : ARENA_MIN_SIZE;
+  struct arena_name **new, *name;
+  size_t i;
+
+  new = calloc (size, sizeof (struct arena_name *));
+  if (!new)
+    return;
+
+  for (i = 0; i < table_size; i++)
+    while (table[i])
+    {
+      name = table[i];
+      table[i] = name->next;
+      name->next = new[name->hash & (size - 1)];
+      new[name->hash & (size - 1)] = name;
+    }
+
+  free (table);
+  table = new;
+  table_size = size;
+}
+
+const char *
+arena_intern (const char *str, size_t len)
+{
+  unsigned int hash = arena_hash (str, len);
+  struct arena_name *name = NULL, **bucket;
+
+  mutex_lock (&arena_lock);
+
+  if (table_count >= (table_size << 1))
+    table_grow ();
+  if (!table)
+    goto out;
+
+  bucket = &table[hash & (table_size - 1)];
+  for (name = *bucket; name; name = name->next)
+    if (arena_name_is (name->str, str, len, hash))
+      goto out;
+
+  name = arena_alloc (sizeof (struct arena_name) + len + 1);
+  if (!name)
+    goto out;
+
+  name->hash = hash;
+  name->len = len;
+  memcpy (name->str, str, len);
+  name->str[len] = '\0';
+
+  name->next = *bucket;
+  *bucket = name;
+  table_count++;
+
+ out:
+  mutex_unlock (&arena_lock);
+
+  return name ? name->str : NULL;
+}
@@ -0,0 +1,90 @@
+/* tarfs - A GNU tar filesystem for the Hurd.
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or * (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+   USA */
+
+/*
+ * A name arena: interned, immutable strings.
+ */
+
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+
+/* An interned name.  Its hash value and length are kept right before the
+   string itself, which is what the arena hands out, so that interned names
+   can be used as plain strings too.  */
+struct arena_name
+{
+  struct arena_name *next;	/* next name in the same bucket */
+  unsigned int hash;
+  unsigned int len;
+  char str[];
+};
+
+/* Returns the interned name whose string is NAME.  */
+#define ARENA_NAME(Name) \
+  ((struct arena_name *) ((char *) (Name) - offsetof (struct arena_name, str)))
+
+/* Returns the hash value of the LEN bytes long string NAME, the same as the
+   one kept along with an interned name.  This is the string hash of tarfs,
+   which the other tables of names use as well.  */
+static inline unsigned int
+arena_hash (const char *name, size_t len)
+{
+  unsigned int h = 5381;
+
+  while (len--)
+    h = (h << 5) + h + (unsigned char) *name++;
+
+  return h;
+}
+
+/* Returns the hash value of interned name NAME.  */
+static inline unsigned int
+arena_name_hash (const char *name)
+{
+  return ARENA_NAME (name)->hash;
+}
+
+/* Returns the length of interned name NAME.  */
+static inline size_t
+arena_name_len (const char *name)
+{
+  return ARENA_NAME (name)->len;
+}
+
+/* Returns non-zero if interned name NAME is the LEN bytes long string STR,
+   whose hash value is HASH.  */
+static inline int
+arena_name_is (const char *name, const char *str, size_t len,
+	       unsigned int hash)
+{
+  struct arena_name *n = ARENA_NAME (name);
+
+  return (n->hash == hash) && (n->len == len)
+	 && ((name == str) || (! memcmp (name, str, len)));
+}
+
+/* Returns the interned copy of the LEN bytes long string NAME, which needs
+   not be null-terminated, or NULL if memory is short.  Interned names are
+   never freed.  */
+extern const char *arena_intern (const char *name, size_t len);
+
+#endif
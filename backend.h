@@ -24,6 +24,7 @@
 #define __FS_BACKEND__
 
 #include <hurd/netfs.h>
+#include <stddef.h>
 #include <dirent.h>
 #include <argp.h>
 #include <assert.h>
@@ -32,12 +33,23 @@
 /* Generic (fs independent) netnode structure.  */
 struct netnode
 {
-  char *name;		/* node name */
+  const char *name;	/* node name (interned, see arena.h) */
   char *symlink;	/* link's target path (in the case of a symlink) */
   struct node *hardlink;/* hard link's target or zero */
   struct node *entries;	/* directory entries (when applies) */
   struct node *dir;	/* parent directory */
 
+  /* Directory index (see fs.c) */
+  struct node **tailp;	/* where the next entry gets linked */
+  size_t nentries;	/* number of entries */
+  struct node **hash;	/* entries hashed by name (large dirs only) */
+  size_t hash_size;	/* number of buckets of HASH */
+  struct node *hash_next; /* next node in its directory's bucket */
+
+  /* Directory scans (see netfs_get_dirents ()) */
+  struct node *scan_node;	/* last entry a scan returned, or NULL */
+  int scan_entry;		/* its number */
+
   void *info;		/* fs defined data (node related info) */
 };
 
@@ -47,6 +59,24 @@ struct netnode
 //#define SUBST_LOWER '.'
 
 
+/* Size of the dirent of an entry whose name is NAMELEN bytes long: its
+   name is null-terminated and padded so that the next dirent is
+   aligned.  */
+#define DIRENT_ALIGN  (__alignof__ (struct dirent))
+#define DIRENT_SIZE(Namelen) \
+  ((offsetof (struct dirent, d_name) + (Namelen) + 1 + DIRENT_ALIGN - 1) \
+   & ~(DIRENT_ALIGN - 1))
+
+/* A directory cursor: where a scan of a directory (see
+   netfs_get_dirents ()) stands.  Each scan has its own cursor, so that
+   scans of different directories don't get in each other's way.  */
+struct dir_cursor
+{
+  struct node *dir;	/* directory being scanned */
+  struct node *node;	/* next entry, past `.' and `..' */
+  int entry;		/* number of the next entry */
+};
+
 /* Each filesystem backend should define a struct fs_backend variable with
    the appropriate functions.  */
 struct fs_backend
@@ -68,16 +98,20 @@ struct fs_backend
    * Directory scan functions (used in netfs_get_dirents ()).
    */
 
-  /* Set current directory. */
-  int (* set_curr_dir)(struct node *dir);
+  /* Set CURSOR at the beginning of directory DIR. */
+  int (* set_curr_dir)(struct dir_cursor *cursor, struct node *dir);
 
-  /* Skip N entries in current directory, returns non-zero if
+  /* Skip N entries in CURSOR's directory, returns non-zero if
      no more entries are available.  */
-  int (* skip_entries)(int n);
+  int (* skip_entries)(struct dir_cursor *cursor, int n);
   
-  /* Returns a newly-allocated entry in ENTRY. Returns non-zero when
-     no more entries are available.  */
-  int (* get_next_entry)(struct dirent **entry);
+  /* Writes the dirent of the entry at CURSOR to BUF, which is *SIZE
+     bytes long, and moves CURSOR to the next one.  *SIZE is set to the
+     size of the dirent (see DIRENT_SIZE ()): if it is larger than BUF,
+     nothing is written and CURSOR stays where it is, so that the call can
+     be made again with a larger buffer.  Returns non-zero when no more
+     entries are available.  */
+  int (* get_next_entry)(struct dir_cursor *cursor, char *buf, size_t *size);
 
   /* Reading a node */
   error_t (* lookup_node)(struct node **np, struct node* dir, const char* name);
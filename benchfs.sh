@@ -0,0 +1,188 @@
+#!/bin/sh
+# A simple benchmark of the read throughput of tarfs for various block sizes,
+# of the lookups in a large directory and of the archive scan rate
+
+TARNAME=bench-tar
+TRANSNODE=b
+DATAFILE=bench-data
+DATASIZE=32		# Size of DATAFILE, in MiB
+DIRNAME=bench-dir
+DIRSIZE=200000		# Number of entries of DIRNAME
+LOOKUPS=1000		# Number of lookups in DIRNAME
+READDIRS=10		# Number of listings of DIRNAME
+SCANDIRS=1000		# Number of directories of the scanned archive
+SCANFILES=1000		# Number of files per directory (one of 1 MiB)
+
+# Start tarfs on TRANSNODE with the given args
+function start_trans
+{
+  settrans -fgca $TRANSNODE ./tarfs $*
+  return $?
+}
+
+# Stop tarfs
+function stop_trans
+{
+  [ -f $TRANSNODE ] && settrans -g $TRANSNODE || settrans -fg $TRANSNODE
+  return $?
+}
+
+# Read DATAFILE through TRANSNODE and print the throughput in MiB/s
+function do_read
+{
+  local start end
+
+  start=`date +%s.%N`
+  cat $TRANSNODE/$DATAFILE > /dev/null || return 1
+  end=`date +%s.%N`
+
+  echo "$start $end" | awk "{ printf \"%8.1f\", $DATASIZE / (\$2 - \$1) }"
+  return 0
+}
+
+# Mount TARFILE with the given args and print the throughput of a first
+# (cold) and a second (cached) sequential read
+function do_bench
+{
+  local tarfile=$1
+  shift
+
+  printf "  %-28s" "$*"
+  start_trans -r --cache-size=64M $* $tarfile || return 1
+  do_read && echo -n " MiB/s cold" && do_read && echo " MiB/s cached"
+  stop_trans
+}
+
+# Hello world
+echo "A Small Benchmark for tarfs"
+echo
+
+# Build the test archive
+stop_trans
+rm -f $TARNAME $TARNAME.gz $TARNAME.bz2 $TARNAME.*.tarfs-seek \
+      $TARNAME*.tarfs-meta $DATAFILE $TRANSNODE
+echo -n "Building test archive ($TARNAME, $DATASIZE MiB)... "
+dd if=/dev/urandom of=$DATAFILE bs=1024k count=$DATASIZE 2> /dev/null \
+  && tar cf $TARNAME $DATAFILE && echo "done"
+[ $? -ne 0 ] && echo "failed" && exit 1
+gzip -c $TARNAME > $TARNAME.gz
+bzip2 -c $TARNAME > $TARNAME.bz2
+
+# Mount an archive holding a directory of DIRSIZE empty files, look up
+# LOOKUPS of them, list it READDIRS times, and print the time it took to
+# mount the archive, the average time of a lookup and the number of
+# entries read per second
+function do_dir_bench
+{
+  local start mounted end listed i
+
+  rm -rf $DIRNAME $TARNAME
+  mkdir $DIRNAME && (cd $DIRNAME && seq -f "f%.0f" $DIRSIZE | xargs touch) \
+    && tar cf $TARNAME $DIRNAME || return 1
+
+  start=`date +%s.%N`
+  start_trans -r $TARNAME || return 1
+  ls -d $TRANSNODE/$DIRNAME > /dev/null
+  mounted=`date +%s.%N`
+  seq -f "$TRANSNODE/$DIRNAME/f%.0f" 1 $(($DIRSIZE / $LOOKUPS)) $DIRSIZE \
+    | xargs ls -d > /dev/null
+  end=`date +%s.%N`
+  # Unsorted listings only read the directory: no stat, no lookup
+  for i in `seq $READDIRS`; do
+    ls -f $TRANSNODE/$DIRNAME > /dev/null
+  done
+  listed=`date +%s.%N`
+  stop_trans
+
+  echo "$start $mounted $end $listed" | \
+    awk "{ printf \"  mount: %.2f s, lookup: %.1f us, \" \
+		  \"readdir: %.0f entries/s\\n\", \
+	   \$2 - \$1, (\$3 - \$2) * 1000000 / $LOOKUPS, \
+	   ($DIRSIZE + 2) * $READDIRS / (\$4 - \$3) }"
+  rm -rf $DIRNAME $TARNAME
+}
+
+# Print the resident memory of the tarfs translator, in bytes
+function trans_mem
+{
+  local pid pagesize
+
+  pid=`pgrep -n -x tarfs` || return 1
+  pagesize=`getconf PAGESIZE`
+  awk "{ print \$2 * $pagesize }" /proc/$pid/statm
+}
+
+# Mount an archive of SCANDIRS directories holding SCANFILES files each,
+# all empty except for one 1 MiB file, and print the number of entries
+# parsed per second and the memory used per entry once mounted and once
+# every entry was listed
+function do_scan_bench
+{
+  local start end dir mounted listed
+
+  rm -rf $DIRNAME $TARNAME
+  mkdir $DIRNAME || return 1
+  for dir in `seq -f "d%.0f" $SCANDIRS`
+  do
+    mkdir $DIRNAME/$dir \
+      && (cd $DIRNAME/$dir && seq -f "f%.0f" $SCANFILES | xargs touch \
+          && dd if=/dev/zero of=f1 bs=1024k count=1 2> /dev/null) \
+      || return 1
+  done
+  tar cf $TARNAME $DIRNAME || return 1
+
+  start=`date +%s.%N`
+  start_trans -r $TARNAME || return 1
+  ls -d $TRANSNODE/$DIRNAME > /dev/null
+  end=`date +%s.%N`
+  mounted=`trans_mem`
+  ls -lR $TRANSNODE/$DIRNAME > /dev/null
+  listed=`trans_mem`
+  stop_trans
+
+  echo "$start $end" | \
+    awk "{ printf \"  mount: %.2f s, %.0f entries/s\\n\", \$2 - \$1, \
+	   $SCANDIRS * ($SCANFILES + 1) / (\$2 - \$1) }"
+  [ -n "$mounted" ] && [ -n "$listed" ] && echo "$mounted $listed" | \
+    awk "{ printf \"  memory: %.0f bytes/entry mounted, %.0f listed\\n\", \
+	   \$1 / ($SCANDIRS * ($SCANFILES + 1)), \
+	   \$2 / ($SCANDIRS * ($SCANFILES + 1)) }"
+  rm -rf $DIRNAME $TARNAME
+}
+
+for tarfile in "$TARNAME" "${TARNAME}.gz" "${TARNAME}.bz2"
+do
+  case "$tarfile" in
+    *.gz)  tarfs_opts="-z" ;;
+    *.bz2) tarfs_opts="-j" ;;
+    *)     tarfs_opts="" ;;
+  esac
+
+  echo
+  echo "*** File $tarfile ***"
+
+  for size in 1k 4k 16k 64k 256k
+  do
+    do_bench $tarfile $tarfs_opts --block-size=$size
+  done
+
+  if [ -n "$tarfs_opts" ]
+  then
+    for size in 4k 8k 16k 64k
+    do
+      do_bench $tarfile $tarfs_opts --zip-block-size=$size
+    done
+  fi
+done
+
+echo
+echo "*** Directory of $DIRSIZE entries ***"
+do_dir_bench
+
+echo
+echo "*** Archive of $SCANDIRS x $SCANFILES entries ***"
+do_scan_bench
+
+stop_trans
+rm -f $TARNAME $TARNAME.gz $TARNAME.bz2 $TARNAME.*.tarfs-seek \
+      $TARNAME*.tarfs-meta $DATAFILE $TRANSNODE
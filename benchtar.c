@@ -0,0 +1,109 @@
+/* tarfs - A GNU tar filesystem for the Hurd.
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or * (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+   USA */
+
+/*
+ * A microbenchmark of the archive parser: the headers of an archive held
+ * in memory are parsed and decoded (see tar.c) a number of times, without
+ * building any filesystem, and the parse rate is printed, along with the
+ * hit rate of the user and group names caches (see names.c).
+ *
+ * Usage: benchtar ARCHIVE [ROUNDS]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <error.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#include "tar.h"
+#include "names.h"
+
+/* Number of headers parsed.  */
+static unsigned long headers = 0;
+
+/* Sum of the decoded sizes, so that decoding can't be optimized away.  */
+static off_t total_size = 0;
+
+static int
+count_header (tar_header_t *header, off_t offset)
+{
+  headers++;
+  total_size += header->size;
+  return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+  int fd, round, rounds;
+  struct stat st;
+  void *data;
+  struct timeval start, end;
+  struct names_stats stats;
+  double secs;
+
+  if ((argc < 2) || (argc > 3))
+    error (1, 0, "Usage: %s ARCHIVE [ROUNDS]", argv[0]);
+  rounds = (argc > 2) ? atoi (argv[2]) : 10;
+
+  fd = open (argv[1], O_RDONLY);
+  if ((fd < 0) || fstat (fd, &st))
+    error (1, errno, "%s", argv[1]);
+
+  data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED)
+    error (1, errno, "%s", argv[1]);
+
+  /* Fault the archive in before timing anything */
+  tar_header_hook = NULL;
+  tar_parse_init ();
+  tar_parse_data (data, st.st_size);
+  tar_parse_end ();
+
+  tar_header_hook = count_header;
+  gettimeofday (&start, NULL);
+  for (round = 0; round < rounds; round++)
+    {
+      tar_parse_init ();
+      tar_parse_data (data, st.st_size);
+      if (tar_parse_end ())
+	error (1, 0, "Invalid tar archive (%s)", argv[1]);
+    }
+  gettimeofday (&end, NULL);
+
+  secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+  printf ("%lu headers (%lli bytes of data) in %.3f s: "
+	  "%.0f headers/s, %.1f ns/header\n",
+	  headers, (long long) total_size, secs, headers / secs,
+	  secs * 1e9 / headers);
+
+  names_get_stats (&stats);
+  printf ("%zu user and group name lookups: %zu hits (%.1f%%)\n",
+	  stats.lookups, stats.hits,
+	  stats.lookups ? 100. * stats.hits / stats.lookups : 0.);
+
+  munmap (data, st.st_size);
+  close (fd);
+
+  return 0;
+}
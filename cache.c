@@ -23,12 +23,16 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <fcntl.h>
 #include <sys/mman.h>
 
 #include <hurd/netfs.h>
 
 #include "tarfs.h"
 #include "cache.h"
+#include "slab.h"
+#include "radix.h"
 #include "debug.h"
 
 /* Locking/unlocking a node's cache */
@@ -40,41 +44,711 @@ static error_t (* read_file) (struct node *node,
 			      off_t offset, size_t howmuch,
 			      size_t *actually_read, void *data) = NULL;
 
-/* BLOCK_NUMBER gives the number in which Offset can be found
-   (equivalent to Offset/CACHE_BLOCK_SIZE).  */
-#define BLOCK_NUMBER(Offset) \
-  ((Offset) >> CACHE_BLOCK_SIZE_LOG2)
+/* Size of the cache blocks of Node (in bytes).  */
+#define BLOCK_SIZE(Node) \
+  ((size_t) 1 << CACHE_INFO ((Node), block_log2))
 
-/* BLOCK_RELATIVE_OFFSET gives the relative offset inside a block
-   (equivalent to AbsoluteOffset%CACHE_BLOCK_SIZE).  */
-#define BLOCK_RELATIVE_OFFSET(AbsoluteOffset) \
-  ((AbsoluteOffset) & (CACHE_BLOCK_SIZE - 1))
+/* BLOCK_NUMBER gives the number of Node's block in which Offset can be
+   found (equivalent to Offset/BLOCK_SIZE (Node)).  */
+#define BLOCK_NUMBER(Node, Offset) \
+  ((Offset) >> CACHE_INFO ((Node), block_log2))
+
+/* BLOCK_OFFSET gives the offset of Node's block number Block (equivalent
+   to Block*BLOCK_SIZE (Node)).  */
+#define BLOCK_OFFSET(Node, Block) \
+  ((Block) << CACHE_INFO ((Node), block_log2))
+
+/* BLOCK_RELATIVE_OFFSET gives the relative offset inside one of Node's
+   blocks (equivalent to AbsoluteOffset%BLOCK_SIZE (Node)).  */
+#define BLOCK_RELATIVE_OFFSET(Node, AbsoluteOffset) \
+  ((AbsoluteOffset) & (BLOCK_SIZE (Node) - 1))
 
  
+/* Default cache budget, in bytes (see cache_set_budget ()) */
+#define CACHE_BUDGET_DEFAULT  (16 << 20)
+
+/* Initial size of the cache blocks hash table */
+#define CACHE_HASH_SIZE       1024
+
+/* Nodes get blocks large enough for them to be made of about this many
+   blocks at most (see node_block_log2 ()) */
+#define CACHE_NODE_BLOCKS     16
+
+/* Initial and maximum readahead windows, in bytes */
+#define CACHE_READAHEAD_MIN   (8 << 10)
+#define CACHE_READAHEAD_MAX   (512 << 10)
+
+#ifndef MAX
+# define MAX(A,B)  ((A) < (B) ? (B) : (A))
+#endif
+#ifndef MIN
+# define MIN(A,B)  ((A) < (B) ? (A) : (B))
+#endif
+
+/* A cache block: block number BLOCK of NODE's contents.  All the cache
+   blocks are managed by the cache manager below.  */
+struct cache_block
+{
+  struct node *node;
+  size_t block;
+
+  /* Non-zero if this block was modified, or has to be kept until NODE
+     gets synced (see cache_cache ()).  Dirty blocks are never evicted.  */
+  int dirty;
+
+  /* Non-zero if this block was used since the clock hand last went past
+     it.  */
+  int referenced;
+
+  /* Non-zero if this block was read ahead and has not been used yet */
+  int prefetched;
+
+  /* Next block in the same hash bucket */
+  struct cache_block *hash_next;
+
+  /* Previous and next blocks in the clock ring */
+  struct cache_block *clock_prev;
+  struct cache_block *clock_next;
+
+  /* Previous and next blocks of NODE */
+  struct cache_block *node_prev;
+  struct cache_block *node_next;
+
+  /* BLOCK_SIZE (NODE) bytes of data */
+  char data[];
+};
+
+
+/* The cache manager.  The blocks of all the nodes are hashed by node and
+   block number, and kept in a ring swept by a clock hand which evicts the
+   clean blocks that were not used recently once the budget is exceeded.
+   This is protected by MANAGER_LOCK.  A node's cache lock, when needed,
+   must be taken *before* MANAGER_LOCK.  */
+static struct mutex manager_lock;
+
+/* Hash table of the cache blocks, and its size (a power of two) */
+static struct cache_block **hash_table = NULL;
+static size_t hash_size = 0;
+
+/* The clock hand (NULL when there are no blocks) */
+static struct cache_block *clock_hand = NULL;
+
+/* Number of cache blocks, number of dirty ones, and current and maximum
+   amounts of cache block data, in bytes, and amount of dirty data */
+static size_t blocks_count = 0;
+static size_t dirty_count = 0;
+static size_t blocks_bytes = 0;
+static size_t budget = CACHE_BUDGET_DEFAULT;
+static size_t dirty_bytes = 0;
+
+/* The spill file.  When there are more than SPILL_HIGH bytes of dirty
+   blocks, those which were not used recently are written to SPILL_FD, an
+   unlinked temporary file, and freed till there are no more than
+   SPILL_LOW bytes of them.  The file is cut into slots as large as the
+   blocks they hold, and aligned on their size.  SPILL_END is the end of
+   the last slot, and SPILL_FREE keeps the numbers of the free slots of
+   each size.  Each node maps the numbers of its spilled blocks to their
+   slot (see struct cache).  */
+static size_t spill_high = CACHE_SPILL_HIGH;
+static size_t spill_low = CACHE_SPILL_HIGH - (CACHE_SPILL_HIGH >> 2);
+static int spill_fd = -1;
+static off_t spill_end = 0;
+
+/* Numbers of free slots of the spill file, and allocated size of SLOTS */
+struct spill_slots
+{
+  off_t *slots;
+  size_t count;
+  size_t size;
+};
+static struct spill_slots spill_free[CACHE_BLOCK_MAX_LOG2
+				     - CACHE_BLOCK_MIN_LOG2 + 1];
+
+/* Slot numbers are stored in the nodes' radix trees plus one, since
+   these can't hold NULL.  */
+#define SPILL_VALUE(Slot)  ((void *) (uintptr_t) ((Slot) + 1))
+#define SPILL_SLOT(Value)  ((off_t) (uintptr_t) (Value) - 1)
+
+/* Sizes of the blocks of small and large nodes (log2), see
+   cache_set_block_size () */
+static unsigned block_small_log2 = CACHE_BLOCK_SMALL_LOG2;
+static unsigned block_large_log2 = CACHE_BLOCK_DEFAULT_LOG2;
+
+/* Readahead statistics */
+static struct cache_stats statistics;
+
+/* Where cache blocks are allocated from, one slab cache per block size */
+static struct slab_cache blocks_slab[CACHE_BLOCK_MAX_LOG2
+				     - CACHE_BLOCK_MIN_LOG2 + 1];
+
+/* Returns the slab cache of NODE's blocks.  */
+#define BLOCKS_SLAB(Node) \
+  (&blocks_slab[CACHE_INFO ((Node), block_log2) - CACHE_BLOCK_MIN_LOG2])
+
+static void read_ahead (struct work *work);
+
+/* Returns the hash table bucket for block BLOCK of NODE.  */
+static inline size_t
+hash (struct node *node, size_t block)
+{
+  return (((uintptr_t) node >> 4) ^ (block * 0x9e3779b1)) & (hash_size - 1);
+}
+
+/* Returns the cache block number BLOCK of NODE, or NULL if it is not
+   cached.  This assumes that MANAGER_LOCK is held.  */
+static struct cache_block *
+block_find (struct node *node, size_t block)
+{
+  struct cache_block *b;
+
+  if (!hash_table)
+    return NULL;
+
+  for (b = hash_table[hash (node, block)]; b; b = b->hash_next)
+    if ((b->node == node) && (b->block == block))
+      break;
+
+  return b;
+}
+
+/* Doubles the size of the hash table.  This assumes that MANAGER_LOCK is
+   held.  */
+static error_t
+hash_grow (void)
+{
+  struct cache_block **old = hash_table, *b, *next;
+  size_t old_size = hash_size, i;
+
+  hash_size = old_size ? old_size << 1 : CACHE_HASH_SIZE;
+  hash_table = calloc (hash_size, sizeof (struct cache_block *));
+  if (!hash_table)
+  {
+    hash_table = old;
+    hash_size = old_size;
+    return ENOMEM;
+  }
+
+  for (i = 0; i < old_size; i++)
+    for (b = old[i]; b; b = next)
+    {
+      size_t h = hash (b->node, b->block);
+      next = b->hash_next;
+      b->hash_next = hash_table[h];
+      hash_table[h] = b;
+    }
+
+  free (old);
+
+  return 0;
+}
+
+/* Adds B to the hash table, the clock ring and its node's blocks.  This
+   assumes that MANAGER_LOCK is held.  */
+static void
+block_link (struct cache_block *b)
+{
+  size_t h = hash (b->node, b->block);
+
+  b->hash_next = hash_table[h];
+  hash_table[h] = b;
+
+  /* Insert B right behind the clock hand so that it is looked at last */
+  if (clock_hand)
+  {
+    b->clock_next = clock_hand;
+    b->clock_prev = clock_hand->clock_prev;
+    b->clock_prev->clock_next = b;
+    clock_hand->clock_prev = b;
+  }
+  else
+    clock_hand = b->clock_next = b->clock_prev = b;
+
+  b->node_prev = NULL;
+  b->node_next = CACHE_INFO (b->node, blocks);
+  if (b->node_next)
+    b->node_next->node_prev = b;
+  CACHE_INFO (b->node, blocks) = b;
+
+  blocks_count++;
+  blocks_bytes += BLOCK_SIZE (b->node);
+  if (b->dirty)
+  {
+    dirty_count++;
+    dirty_bytes += BLOCK_SIZE (b->node);
+    CACHE_INFO (b->node, dirty)++;
+  }
+}
+
+/* Removes B from the hash table, the clock ring and its node's blocks.
+   This assumes that MANAGER_LOCK is held.  */
+static void
+block_unlink (struct cache_block *b)
+{
+  struct cache_block **p;
+
+  for (p = &hash_table[hash (b->node, b->block)]; *p != b;
+       p = &(*p)->hash_next)
+    assert (*p);
+  *p = b->hash_next;
+
+  if (clock_hand == b)
+    clock_hand = (b->clock_next == b) ? NULL : b->clock_next;
+  b->clock_prev->clock_next = b->clock_next;
+  b->clock_next->clock_prev = b->clock_prev;
+
+  if (b->node_prev)
+    b->node_prev->node_next = b->node_next;
+  else
+    CACHE_INFO (b->node, blocks) = b->node_next;
+  if (b->node_next)
+    b->node_next->node_prev = b->node_prev;
+
+  blocks_count--;
+  blocks_bytes -= BLOCK_SIZE (b->node);
+  if (b->dirty)
+  {
+    dirty_count--;
+    dirty_bytes -= BLOCK_SIZE (b->node);
+    CACHE_INFO (b->node, dirty)--;
+  }
+
+  if (b->prefetched)
+    statistics.readahead_wasted++;
+}
+
+/* Moves the clock hand till it finds a clean block which was not used
+   recently, and evicts it.  Blocks of nodes whose cache is locked, except
+   SELF whose cache is locked by the caller, are skipped.  Returns zero if
+   no block could be evicted.  This assumes that MANAGER_LOCK is held.  */
+static int
+block_evict (struct node *self)
+{
+  size_t scanned;
+
+  if (dirty_count == blocks_count)
+    /* Nothing can be evicted */
+    return 0;
+
+  for (scanned = 0; clock_hand && (scanned < (blocks_count << 1)); scanned++)
+  {
+    struct cache_block *b = clock_hand;
+    struct node *node = b->node;
+
+    clock_hand = b->clock_next;
+
+    if (b->dirty)
+      continue;
+
+    if (b->referenced)
+    {
+      /* Give it a second chance */
+      b->referenced = 0;
+      continue;
+    }
+
+    /* Nobody must be using B */
+    if ((node != self) && (!mutex_try_lock (&CACHE_INFO (node, lock))))
+      continue;
+
+    block_unlink (b);
+    slab_free (BLOCKS_SLAB (node), b);
+    if (node != self)
+      mutex_unlock (&CACHE_INFO (node, lock));
+
+    return 1;
+  }
+
+  return 0;
+}
+
+
+/* Spilling.  The functions below assume that MANAGER_LOCK is held.  */
+
+/* Returns in SLOT a free slot of the spill file for a block of 2^LOG2
+   bytes, creating the file if needed.  */
+static error_t
+spill_alloc (unsigned log2, off_t *slot)
+{
+  struct spill_slots *free_slots = &spill_free[log2 - CACHE_BLOCK_MIN_LOG2];
+
+  if (free_slots->count)
+  {
+    *slot = free_slots->slots[--free_slots->count];
+    return 0;
+  }
+
+  if (spill_fd < 0)
+  {
+    const char *dir = getenv ("TMPDIR");
+    char *name;
+
+    if (asprintf (&name, "%s/tarfs-spill.XXXXXX", dir ? dir : "/tmp") < 0)
+      return ENOMEM;
+
+    spill_fd = mkstemp (name);
+    if (spill_fd < 0)
+    {
+      error_t err = errno;
+
+      error (0, err, "Cannot create a spill file");
+      free (name);
+      return err;
+    }
+
+    /* Nobody else needs to see it */
+    unlink (name);
+    free (name);
+  }
+
+  *slot = (spill_end + ((off_t) 1 << log2) - 1) >> log2;
+  spill_end = (*slot + 1) << log2;
+
+  return 0;
+}
+
+/* Gives back SLOT, which held a block of 2^LOG2 bytes.  */
+static void
+spill_release (unsigned log2, off_t slot)
+{
+  struct spill_slots *free_slots = &spill_free[log2 - CACHE_BLOCK_MIN_LOG2];
+
+  if (free_slots->count == free_slots->size)
+  {
+    size_t size = free_slots->size ? free_slots->size << 1 : 64;
+    off_t *slots = realloc (free_slots->slots, size * sizeof (off_t));
+
+    if (!slots)
+      /* Just lose this slot */
+      return;
+
+    free_slots->slots = slots;
+    free_slots->size = size;
+  }
+
+  free_slots->slots[free_slots->count++] = slot;
+}
+
+/* Moves the clock hand till it finds a dirty block which was not used
+   recently, writes it to the spill file and frees it.  Blocks of nodes
+   whose cache is locked, except SELF whose cache is locked by the caller,
+   are skipped.  Returns zero if no block could be spilled.  */
+static int
+block_spill (struct node *self)
+{
+  size_t scanned;
+
+  for (scanned = 0; clock_hand && (scanned < (blocks_count << 1)); scanned++)
+  {
+    struct cache_block *b = clock_hand;
+    struct node *node = b->node;
+    unsigned log2 = CACHE_INFO (node, block_log2);
+    size_t size = BLOCK_SIZE (node);
+    off_t slot;
+    int spilled;
+
+    clock_hand = b->clock_next;
+
+    if (!b->dirty)
+      continue;
+
+    if (b->referenced)
+    {
+      /* Give it a second chance */
+      b->referenced = 0;
+      continue;
+    }
+
+    /* Nobody must be using B */
+    if ((node != self) && (!mutex_try_lock (&CACHE_INFO (node, lock))))
+      continue;
+
+    spilled = (!spill_alloc (log2, &slot));
+    if (spilled)
+    {
+      spilled = (pwrite (spill_fd, b->data, size, slot << log2)
+		 == (ssize_t) size)
+		&& (!radix_insert (&CACHE_INFO (node, spilled), b->block,
+				   SPILL_VALUE (slot)));
+      if (!spilled)
+	spill_release (log2, slot);
+    }
+
+    if (spilled)
+    {
+      debug (("Node %s: Spilled block %u", node->nn->name, b->block));
+      block_unlink (b);
+      slab_free (BLOCKS_SLAB (node), b);
+    }
+
+    if (node != self)
+      mutex_unlock (&CACHE_INFO (node, lock));
+
+    /* If B could not be written, don't insist */
+    return spilled;
+  }
+
+  return 0;
+}
+
+/* Returns the spill file slot of block number BLOCK of NODE, or -1 if it
+   was not spilled.  This assumes that NODE's cache is locked.  */
+static inline off_t
+spill_find (struct node *node, size_t block)
+{
+  void *value = radix_lookup (&CACHE_INFO (node, spilled), block);
+
+  return value ? SPILL_SLOT (value) : -1;
+}
+
+/* Gives back the slot VALUE of one of NODE's spilled blocks (see
+   radix_truncate ()).  */
+static void
+spill_drop_one (void *value, void *node)
+{
+  spill_release (CACHE_INFO ((struct node *) node, block_log2),
+		 SPILL_SLOT (value));
+}
+
+/* Forgets NODE's spilled blocks whose number is at least FIRST.  This
+   assumes that NODE's cache is locked, but not MANAGER_LOCK.  */
+static void
+spill_drop (struct node *node, size_t first)
+{
+  if (radix_empty (&CACHE_INFO (node, spilled)))
+    return;
+
+  mutex_lock (&manager_lock);
+  radix_truncate (&CACHE_INFO (node, spilled), first, spill_drop_one, node);
+  mutex_unlock (&manager_lock);
+}
+
+
+/* Returns block number BLOCK of NODE, or NULL if it is not cached.  This
+   assumes that NODE's cache is locked.  Unless it is dirty, the block
+   remains valid until NODE's cache is unlocked or another block is added
+   to it.  */
+static inline struct cache_block *
+cache_lookup (struct node *node, size_t block)
+{
+  struct cache_block *b;
+
+  mutex_lock (&manager_lock);
+  b = block_find (node, block);
+  if (b)
+  {
+    b->referenced = 1;
+    if (b->prefetched)
+    {
+      b->prefetched = 0;
+      statistics.readahead_hits++;
+    }
+  }
+  mutex_unlock (&manager_lock);
+
+  return b;
+}
+
+/* Adds a new block number BLOCK to NODE's cache and returns it in B.  Its
+   data is *not* initialized.  If DIRTY is non-zero, the block is pinned
+   until NODE gets synced.  Clean blocks get evicted if needed to remain
+   within the budget; if this is not possible, then a clean block is not
+   added and ENOBUFS is returned.  This assumes that NODE's cache is
+   locked.  */
+static error_t
+cache_insert (struct node *node, size_t block, int dirty,
+	      struct cache_block **b)
+{
+  error_t err = 0;
+  size_t size = BLOCK_SIZE (node);
+
+  mutex_lock (&manager_lock);
+
+  assert (!block_find (node, block));
+
+  while ((blocks_bytes + size > budget) && block_evict (node))
+    ;
+
+  if (dirty && (dirty_bytes + size > spill_high))
+    /* Make room for modified data on disk */
+    while ((dirty_bytes + size > spill_low) && block_spill (node))
+      ;
+
+  if ((!dirty) && (blocks_bytes + size > budget))
+  {
+    mutex_unlock (&manager_lock);
+    *b = NULL;
+    return ENOBUFS;
+  }
+
+  if (blocks_count >= hash_size << 1)
+    /* Keep the hash chains short; do without if this fails */
+    hash_grow ();
+
+  *b = hash_table ? slab_alloc (BLOCKS_SLAB (node)) : NULL;
+  if (*b)
+  {
+    (*b)->node = node;
+    (*b)->block = block;
+    (*b)->dirty = dirty;
+    (*b)->referenced = 1;
+    (*b)->prefetched = 0;
+    block_link (*b);
+  }
+  else
+    err = ENOMEM;
+
+  mutex_unlock (&manager_lock);
+
+  return err;
+}
+
+/* Pins B until its node gets synced.  */
+static inline void
+cache_pin (struct cache_block *b)
+{
+  mutex_lock (&manager_lock);
+  if (!b->dirty)
+  {
+    b->dirty = 1;
+    dirty_count++;
+    dirty_bytes += BLOCK_SIZE (b->node);
+    CACHE_INFO (b->node, dirty)++;
+  }
+  mutex_unlock (&manager_lock);
+}
+
+/* Removes NODE's blocks whose number is at least FIRST from the cache.
+   This assumes that NODE's cache is locked.  */
+static void
+cache_drop (struct node *node, size_t first)
+{
+  struct cache_block *b, *next;
+  void *chain = NULL;
+
+  mutex_lock (&manager_lock);
+
+  for (b = CACHE_INFO (node, blocks); b; b = next)
+  {
+    next = b->node_next;
+    if (b->block >= first)
+    {
+      block_unlink (b);
+      slab_chain (&chain, b);
+    }
+  }
+
+  mutex_unlock (&manager_lock);
+
+  /* Release them all at once */
+  slab_free_chain (BLOCKS_SLAB (node), chain);
+}
+
+
 /* Initializes the cache backend.  READ is the method that will be called
    when data needs to be read from a node.  */
 void
 cache_init (error_t (* read) (struct node *node, off_t offset, size_t howmuch,
 			      size_t *actually_read, void *data))
 {
+  unsigned log2;
+
   read_file = read;
+
+  for (log2 = CACHE_BLOCK_MIN_LOG2; log2 <= CACHE_BLOCK_MAX_LOG2; log2++)
+    slab_cache_init (&blocks_slab[log2 - CACHE_BLOCK_MIN_LOG2],
+		     sizeof (struct cache_block) + ((size_t) 1 << log2));
+  mutex_init (&manager_lock);
+  mutex_lock (&manager_lock);
+  if (!hash_table)
+    hash_grow ();
+  mutex_unlock (&manager_lock);
 }
 
-/* Create a cache for node NODE.  */
+/* Sets the maximum amount of cached data to BYTES.  */
+void
+cache_set_budget (size_t bytes)
+{
+  budget = bytes;
+}
+
+/* Sets the spill watermarks to HIGH and LOW bytes.  */
 error_t
-cache_create (struct node *node)
+cache_set_spill (size_t high, size_t low)
 {
-  size_t size, blocks;
+  if (!low)
+    low = high - (high >> 2);
 
-  size   = node->nn_stat.st_size;
-  blocks = size ? BLOCK_NUMBER (size - 1) + 1 : 1;
+  if (low >= high)
+    return EINVAL;
 
-  CACHE_INFO (node, blocks) = calloc (blocks, sizeof (char *));
-  if (!CACHE_INFO (node, blocks))
-    return ENOMEM;
+  mutex_lock (&manager_lock);
+  spill_high = high;
+  spill_low = low;
+  mutex_unlock (&manager_lock);
+
+  return 0;
+}
+
+/* Sets the size of the cache blocks of large nodes to BYTES.  */
+error_t
+cache_set_block_size (size_t bytes)
+{
+  unsigned log2;
+
+  for (log2 = CACHE_BLOCK_MIN_LOG2;
+       (log2 < CACHE_BLOCK_MAX_LOG2) && (((size_t) 1 << log2) < bytes);
+       log2++)
+    ;
+
+  if (((size_t) 1 << log2) != bytes)
+    return EINVAL;
+
+  block_large_log2 = log2;
+  block_small_log2 = MIN (log2, CACHE_BLOCK_SMALL_LOG2);
+
+  return 0;
+}
+
+/* Returns the size (log2) of the cache blocks of a node of SIZE bytes.  */
+static unsigned
+node_block_log2 (size_t size)
+{
+  unsigned log2 = block_small_log2;
 
-  CACHE_INFO (node, size) = blocks;
-  debug (("Node %s: Initial block vector size: %u", node->nn->name, blocks));
+  while ((log2 < block_large_log2) && ((size >> log2) > CACHE_NODE_BLOCKS))
+    log2++;
+
+  return log2;
+}
+
+/* Copies the readahead statistics into STATS.  */
+void
+cache_get_stats (struct cache_stats *stats)
+{
+  mutex_lock (&manager_lock);
+  *stats = statistics;
+  mutex_unlock (&manager_lock);
+}
+
+/* Create a cache for node NODE.  */
+error_t
+cache_create (struct node *node)
+{
+  size_t size;
+
+  size = node->nn_stat.st_size;
+
+  CACHE_INFO (node, block_log2) = node_block_log2 (size);
+  CACHE_INFO (node, size)   = size ? BLOCK_NUMBER (node, size - 1) + 1 : 1;
+  CACHE_INFO (node, blocks) = NULL;
+  CACHE_INFO (node, dirty)  = 0;
+  CACHE_INFO (node, extents) = NULL;
+  radix_init (&CACHE_INFO (node, spilled));
+  bzero (&CACHE_INFO (node, readahead), sizeof (struct cache_readahead));
+  CACHE_INFO (node, readahead).work.fn = read_ahead;
+  CACHE_INFO (node, readahead).node = node;
+  debug (("Node %s: Initial size: %u blocks of %u bytes", node->nn->name,
+	  CACHE_INFO (node, size), BLOCK_SIZE (node)));
 
   mutex_init (&CACHE_INFO (node, lock));
 
@@ -85,55 +759,93 @@ cache_create (struct node *node)
 error_t
 cache_free (struct node *node)
 {
-  size_t i, size;
-  char **p;
+  /* Wait for the blocks being read ahead.  */
+  work_wait (&CACHE_INFO (node, readahead).work);
 
   LOCK (node);
-  p    = CACHE_INFO (node, blocks);
-  size = CACHE_INFO (node, size);
-  debug (("Node %s: Freeing blocks (size = %u)", node->nn->name, size));
+  debug (("Node %s: Freeing blocks (size = %u)", node->nn->name,
+	  CACHE_INFO (node, size)));
 
-  if (p)
-  {
-    for (i=0; i < CACHE_INFO (node, size); i++)
-      if (p[i])
-      {
-	free (p[i]);
-	p[i] = NULL;
-      }
+  cache_drop (node, 0);
+  spill_drop (node, 0);
+  assert (!CACHE_INFO (node, blocks));
+  assert (!CACHE_INFO (node, dirty));
 
-    /* Finish it.  */
-    free (p);
-    CACHE_INFO (node, blocks) = NULL;
-    CACHE_INFO (node, size) = 0;
-  }
-  else
-    assert (CACHE_INFO (node, size) == 0);
+  cache_free_extents (CACHE_INFO (node, extents));
+  CACHE_INFO (node, extents) = NULL;
+
+  CACHE_INFO (node, size) = 0;
 
   UNLOCK (node);
   return 0;
 }
 
-/* Same as cache_synced () (assuming NODE's cache is locked).  */
-static inline int
-__cache_synced (struct node *node)
+/* Tells that NODE's contents have been written to the archive: its cache
+   blocks are now clean and may be evicted.  */
+void
+cache_mark_clean (struct node *node)
 {
-  int i, ret = 1;
-  char **blocks;
-  
-  blocks = CACHE_INFO (node, blocks);
+  struct cache_block *b;
 
-  for (i = 0; i < CACHE_INFO (node, size); i++)
-    if (blocks[i])
+  LOCK (node);
+  mutex_lock (&manager_lock);
+
+  for (b = CACHE_INFO (node, blocks); b; b = b->node_next)
+    if (b->dirty)
     {
-      ret = 0;
-      break;
+      b->dirty = 0;
+      dirty_count--;
+      dirty_bytes -= BLOCK_SIZE (node);
     }
+  CACHE_INFO (node, dirty) = 0;
 
-  return ret;
+  mutex_unlock (&manager_lock);
+
+  /* The archive holds the spilled blocks' data too */
+  spill_drop (node, 0);
+
+  cache_free_extents (CACHE_INFO (node, extents));
+  CACHE_INFO (node, extents) = NULL;
+
+  UNLOCK (node);
 }
 
-/* Returns non-zero if NODE is synchronized (ie. not cached).  */
+/* Drops NODE's clean cache blocks right away rather than waiting for them
+   to be evicted.  */
+void
+cache_release (struct node *node)
+{
+  struct cache_block *b, *next;
+  void *chain = NULL;
+
+  LOCK (node);
+  mutex_lock (&manager_lock);
+
+  for (b = CACHE_INFO (node, blocks); b; b = next)
+  {
+    next = b->node_next;
+    if (!b->dirty)
+    {
+      block_unlink (b);
+      slab_chain (&chain, b);
+    }
+  }
+
+  mutex_unlock (&manager_lock);
+
+  slab_free_chain (BLOCKS_SLAB (node), chain);
+
+  UNLOCK (node);
+}
+
+/* Same as cache_synced () (assuming NODE's cache is locked).  */
+static inline int
+__cache_synced (struct node *node)
+{
+  return (CACHE_INFO (node, extents) == NULL);
+}
+
+/* Returns non-zero if NODE is synchronized (ie. has no dirty blocks).  */
 int
 cache_synced (struct node *node)
 {
@@ -146,36 +858,129 @@ cache_synced (struct node *node)
   return ret;
 }
 
+/* Returns in EXTENTS a copy of the list of NODE's modified ranges.  */
+error_t
+cache_get_extents (struct node *node, struct cache_extent **extents)
+{
+  struct cache_extent *e, **copy = extents;
+
+  LOCK (node);
+
+  for (e = CACHE_INFO (node, extents), *copy = NULL; e; e = e->next)
+  {
+    *copy = malloc (sizeof (struct cache_extent));
+    if (!*copy)
+      break;
+    (*copy)->start = e->start;
+    (*copy)->end = e->end;
+    (*copy)->next = NULL;
+    copy = &(*copy)->next;
+  }
+
+  UNLOCK (node);
+
+  if (e)
+  {
+    cache_free_extents (*extents);
+    *extents = NULL;
+    return ENOMEM;
+  }
+
+  return 0;
+}
+
+/* Frees the list of extents EXTENTS.  */
+void
+cache_free_extents (struct cache_extent *extents)
+{
+  struct cache_extent *next;
+
+  for (; extents; extents = next)
+  {
+    next = extents->next;
+    free (extents);
+  }
+}
+
+/* Records that the range [START, END) of NODE was modified.  This assumes
+   that NODE's cache is locked.  */
+static error_t
+extent_add (struct node *node, off_t start, off_t end)
+{
+  struct cache_extent **p, *e;
+
+  /* Find the first extent which does not end before START */
+  for (p = &CACHE_INFO (node, extents); *p && ((*p)->end < start);
+       p = &(*p)->next)
+    ;
+
+  if (*p && ((*p)->start <= end))
+  {
+    /* Extend it, and merge it with the next ones it now overlaps */
+    e = *p;
+    e->start = MIN (e->start, start);
+    e->end = MAX (e->end, end);
+
+    while (e->next && (e->next->start <= e->end))
+    {
+      struct cache_extent *next = e->next;
+
+      e->end = MAX (e->end, next->end);
+      e->next = next->next;
+      free (next);
+    }
+
+    return 0;
+  }
+
+  e = malloc (sizeof (struct cache_extent));
+  if (!e)
+    return ENOMEM;
+
+  e->start = start;
+  e->end = end;
+  e->next = *p;
+  *p = e;
+
+  return 0;
+}
+
+/* Forgets the modified ranges of NODE beyond SIZE.  This assumes that
+   NODE's cache is locked.  */
+static void
+extent_truncate (struct node *node, off_t size)
+{
+  struct cache_extent **p;
+
+  for (p = &CACHE_INFO (node, extents); *p && ((*p)->start < size);
+       p = &(*p)->next)
+    if ((*p)->end > size)
+      (*p)->end = size;
+
+  cache_free_extents (*p);
+  *p = NULL;
+}
+
 
 /* A canonical way to allocate cache blocks (assumes that cache is locked
-   and that BLOCKS is at least BLOCK+1 long).  */
+   and that NODE is at least BLOCK+1 blocks long).  The new block, which is
+   dirty and whose data is not initialized, is returned in B.  */
 static inline error_t
-alloc_block (struct node *node, size_t block)
-{        
-  char *b;
-  char **blocks = CACHE_INFO (node, blocks);
-
+alloc_block (struct node *node, size_t block, struct cache_block **b)
+{
   assert (CACHE_INFO(node, size) > block);
-  assert (!blocks[block]);
 
   /* Allocate a new block */
   //debug (("Node %s: Allocating block %u", node->nn->name, block));
-  b = calloc (CACHE_BLOCK_SIZE, sizeof (char));
-  if (!b)
-    return ENOMEM;
-  
-  blocks[block] = b;
-
-  return 0;
+  return cache_insert (node, block, 1, b);
 }
 
-/* Fetches block number BLOCK of NODE.  This assumes that NODE's cache
-   is already locked.  */
+/* Fetches block number BLOCK of NODE and pins it in the cache.  The block
+   is returned in B.  This assumes that NODE's cache is already locked.  */
 static inline error_t
-fetch_block (struct node *node, int block)
+fetch_block (struct node *node, int block, struct cache_block **b)
 {
   error_t err   = 0;
-  char **blocks = CACHE_INFO(node, blocks);	/* cache blocks array */
   
   size_t read;
   size_t size = NODE_INFO (node)->tar->orig_size;
@@ -184,26 +989,38 @@ fetch_block (struct node *node, int block)
   assert (read_file);
 
   /* Don't try to go beyond the boundaries.  */
-  assert (block <= BLOCK_NUMBER (size - 1));
+  assert (block <= BLOCK_NUMBER (node, size - 1));
+
+  *b = cache_lookup (node, block);
+  if (*b)
+  {
+    /* A clean block just needs to be pinned */
+    cache_pin (*b);
+    return 0;
+  }
 
   /* Allocate a new block.  */
-  assert (!blocks[block]);
-  err = alloc_block (node, block);
+  err = alloc_block (node, block, b);
   if (err)
     return err;
 
   /* If this is the last block, then we may have less to read.  */
-  if (block == BLOCK_NUMBER (size - 1))
-    read = size % CACHE_BLOCK_SIZE;
+  if (block == BLOCK_NUMBER (node, size - 1))
+    read = size - BLOCK_OFFSET (node, block);
   else
-    read = CACHE_BLOCK_SIZE;
+    read = BLOCK_SIZE (node);
+
+  bzero (&(*b)->data[read], BLOCK_SIZE (node) - read);
 
-  err = read_file (node, (block << CACHE_BLOCK_SIZE_LOG2),
+  err = read_file (node, BLOCK_OFFSET (node, block),
 		   read, &actually_read,
-		   blocks[block]);
+		   (*b)->data);
 
   if (err)
+  {
+    bzero ((*b)->data, read);
     return err;
+  }
 
   /* We should have read everything.  */
   assert (actually_read == read);
@@ -211,6 +1028,185 @@ fetch_block (struct node *node, int block)
   return err;
 }
 
+/* Reads the run of consecutive blocks of NODE that are not cached starting
+   at block number BLOCK, but not beyond block number LAST, with a single
+   call to READ_FILE and adds them to the cache as clean blocks.  Copies
+   at most SIZE bytes from OFFSET inside BLOCK into DATA and returns the
+   amount copied in COPIED.  If DATA is NULL, the blocks are being read
+   ahead and nothing is copied.  This assumes that NODE's cache is
+   locked.  */
+static error_t
+read_blocks (struct node *node, size_t block, size_t last,
+	     size_t offset, size_t size, void *data, size_t *copied)
+{
+  error_t err = 0;
+  size_t orig_size = NODE_INFO (node)->tar->orig_size;
+  size_t count, read, actually_read, i;
+  char *buf;
+
+  assert (read_file);
+  assert (block <= last);
+
+  /* Find out how many blocks are both needed and missing.  */
+  mutex_lock (&manager_lock);
+  for (count = 1;
+       (block + count <= last)
+	 && (BLOCK_OFFSET (node, count) < offset + size)
+	 && (!block_find (node, block + count))
+	 && (spill_find (node, block + count) < 0);
+       count++)
+    ;
+  mutex_unlock (&manager_lock);
+
+  /* The last block may be shorter.  */
+  read = BLOCK_OFFSET (node, count);
+  if (BLOCK_OFFSET (node, block) + read > orig_size)
+    read = orig_size - BLOCK_OFFSET (node, block);
+
+  buf = malloc (BLOCK_OFFSET (node, count));
+  if (!buf)
+    return ENOMEM;
+
+  err = read_file (node, BLOCK_OFFSET (node, block),
+		   read, &actually_read, buf);
+  if (err)
+  {
+    free (buf);
+    return err;
+  }
+
+  /* We should have read everything.  */
+  assert (actually_read == read);
+  bzero (buf + read, BLOCK_OFFSET (node, count) - read);
+
+  /* Keep these blocks, unless the cache is full of blocks in use.  */
+  for (i = 0; i < count; i++)
+  {
+    struct cache_block *b;
+
+    if (cache_insert (node, block + i, 0, &b))
+      break;
+    memcpy (b->data, buf + BLOCK_OFFSET (node, i), BLOCK_SIZE (node));
+    b->prefetched = (data == NULL);
+  }
+
+  if (!data)
+  {
+    mutex_lock (&manager_lock);
+    statistics.readahead += i;
+    mutex_unlock (&manager_lock);
+  }
+
+  *copied = BLOCK_OFFSET (node, count) - offset;
+  if (*copied > size)
+    *copied = size;
+  if (data)
+    memcpy (data, buf + offset, *copied);
+
+  free (buf);
+
+  return 0;
+}
+
+/* Reads blocks ahead for a node being read sequentially.  This is done in
+   the background (see work_queue_background ()), since reading blocks
+   takes locks and may wait for the workers (to decompress them).  */
+static void
+read_ahead (struct work *work)
+{
+  struct cache_readahead *ra = (struct cache_readahead *) work;
+  struct node *node = ra->node;
+  struct tar_item *tar = NODE_INFO (node)->tar;
+  size_t block, last, read;
+  size_t disk_blocks;
+
+  LOCK (node);
+
+  /* NODE may have been synced in the meantime.  */
+  disk_blocks = ((tar->offset != -1) && (tar->orig_size))
+                ? BLOCK_NUMBER (node, tar->orig_size - 1) + 1
+		: 0;
+  last = ra->first + ra->count - 1;
+  if (last >= disk_blocks)
+    last = disk_blocks - 1;
+
+  for (block = ra->first;
+       (block < disk_blocks) && (block <= last);
+       block += BLOCK_NUMBER (node, read - 1) + 1)
+  {
+    struct cache_block *b;
+
+    mutex_lock (&manager_lock);
+    b = block_find (node, block);
+    mutex_unlock (&manager_lock);
+
+    if (b || (spill_find (node, block) >= 0))
+      read = BLOCK_SIZE (node);
+    else if (read_blocks (node, block, last, 0,
+			  BLOCK_OFFSET (node, last - block + 1),
+			  NULL, &read))
+      break;
+  }
+
+  ra->queued = 0;
+
+  UNLOCK (node);
+}
+
+/* Updates NODE's readahead state after a read of LEN bytes at OFFSET and
+   returns non-zero if blocks should be read ahead, in which case the
+   readahead work is ready to be queued.  DISK_BLOCKS is the number of
+   NODE's blocks available on disk.  This assumes that NODE's cache is
+   locked.  */
+static int
+readahead_update (struct node *node, off_t offset, size_t len,
+		  size_t disk_blocks)
+{
+  struct cache_readahead *ra = &CACHE_INFO (node, readahead);
+  size_t min = BLOCK_NUMBER (node, CACHE_READAHEAD_MIN);
+  size_t max = BLOCK_NUMBER (node, MIN (CACHE_READAHEAD_MAX, budget >> 2));
+  size_t next_block, end;
+
+  if ((offset != ra->next) || (!len))
+  {
+    /* Random access */
+    ra->window = 0;
+    ra->end = 0;
+    ra->next = offset + len;
+    return 0;
+  }
+
+  /* Sequential access: grow the window */
+  ra->next = offset + len;
+  ra->window = ra->window ? ra->window << 1 : MAX (min, 1);
+  if (ra->window > max)
+    ra->window = max;
+
+  if (ra->queued)
+    return 0;
+
+  /* Read ahead once the reader gets into the second half of what was
+     read ahead.  */
+  next_block = BLOCK_NUMBER (node, ra->next - 1) + 1;
+  if (ra->end > next_block + (ra->window >> 1))
+    return 0;
+
+  end = next_block + ra->window;
+  if (end > disk_blocks)
+    end = disk_blocks;
+  if (ra->end > next_block)
+    next_block = ra->end;
+  if (next_block >= end)
+    return 0;
+
+  ra->first = next_block;
+  ra->count = end - next_block;
+  ra->end = end;
+  ra->queued = 1;
+
+  return 1;
+}
+
 
 /* Read at most AMOUNT bytes from NODE at OFFSET into BUF.
    Returns the amount of data actually read in LEN.  */
@@ -221,10 +1217,13 @@ cache_read (struct node *node, off_t offset, size_t amount,
   error_t err   = 0;
   void   *datap = buf; /* current pointer */
   off_t   start = NODE_INFO(node)->tar->offset;
+  size_t  orig_size = NODE_INFO(node)->tar->orig_size;
   size_t  size  = node->nn_stat.st_size;
-  char  **blocks;
   size_t  blocks_size;
-  size_t  block  = BLOCK_NUMBER (offset);	/* 1st block to read.  */
+  size_t  disk_blocks;			/* Num. of blocks on disk */
+  size_t  block;				/* 1st block to read.  */
+  size_t  block_size;
+  int     ahead;
 
   /* If NODE is a link then redirect the call.  */
   if (node->nn->hardlink)
@@ -243,44 +1242,60 @@ cache_read (struct node *node, off_t offset, size_t amount,
 
   /* Lock the node */
   LOCK (node);
-  blocks = CACHE_INFO(node, blocks);
+  block = BLOCK_NUMBER (node, offset);
+  block_size = BLOCK_SIZE (node);
   blocks_size = CACHE_INFO(node, size);
+  disk_blocks = ((start != -1) && (orig_size))
+                ? BLOCK_NUMBER (node, orig_size - 1) + 1
+		: 0;
 
   /* Adjust SIZE and LEN to the maximum that can be read.  */
   size -= offset;
   size = (size > amount) ? amount : size;
   *len = size;
 
+  /* Find out whether we should read ahead (once this read is done).  */
+  ahead = readahead_update (node, offset, size, disk_blocks);
+
   /* Set OFFSET to be the relative offset inside cache block num. BLOCK.  */
-  offset = BLOCK_RELATIVE_OFFSET (offset);
+  offset = BLOCK_RELATIVE_OFFSET (node, offset);
 
   while (size > 0)
   {
-    size_t read = (size > CACHE_BLOCK_SIZE)
-                  ? (CACHE_BLOCK_SIZE - offset)
+    struct cache_block *b;
+    off_t slot = -1;
+    size_t read = (size + offset > block_size)
+                  ? (block_size - offset)
 		  : (size);
 
-    /* Read a block either from cache or directly.  */
-    if ((block < blocks_size) && (blocks[block]))
-      memcpy (datap, &blocks[block][offset], read);
-    else
+    /* Read a block either from cache, from the spill file or from disk.  */
+    b = (block < blocks_size) ? cache_lookup (node, block) : NULL;
+    if (b)
+      memcpy (datap, &b->data[offset], read);
+    else if ((block < blocks_size)
+	     && ((slot = spill_find (node, block)) >= 0))
     {
-      /* If NODE is available on disk, then fetch its contents.  */
-      if (start != -1)
+      /* Read it from there without bringing it back to memory.  */
+      if (pread (spill_fd, datap, read, BLOCK_OFFSET (node, slot) + offset)
+	  != (ssize_t) read)
       {
-	size_t actually_read;
-	err = read_file (node, (block << CACHE_BLOCK_SIZE_LOG2) + offset,
-			 read, &actually_read, datap);
-        if (err)
-	  break;
-
-	/* We should have read everything.  */
-	assert (actually_read == read);
+	err = EIO;
+	break;
       }
-      else
-        /* If NODE is not cached nor on disk, then zero the user's buffer.  */
-        bzero (datap, read);
     }
+    else if (block < disk_blocks)
+    {
+      /* Fetch this block along with the next missing ones.  */
+      err = read_blocks (node, block, disk_blocks - 1, offset, size,
+			 datap, &read);
+      if (err)
+	break;
+
+      block += BLOCK_NUMBER (node, offset + read - 1);
+    }
+    else
+      /* If NODE is not cached nor on disk, then zero the user's buffer.  */
+      bzero (datap, read);
 
     /* Go ahead with next block.  */
     block++;
@@ -291,6 +1306,13 @@ cache_read (struct node *node, off_t offset, size_t amount,
 
   UNLOCK (node);
 
+  if (ahead)
+  {
+    /* The previous readahead may not be completely over yet.  */
+    work_wait (&CACHE_INFO (node, readahead).work);
+    work_queue_background (&CACHE_INFO (node, readahead).work);
+  }
+
   return err;
 }
 
@@ -298,57 +1320,43 @@ cache_read (struct node *node, off_t offset, size_t amount,
 static inline error_t
 __cache_set_size (struct node *node, size_t size)
 {
-  error_t err = 0;
-  size_t  *blocks_size;
-  char ***blocks;
+  size_t newsize;
+  struct cache_readahead *ra = &CACHE_INFO (node, readahead);
 
-  /* New size of BLOCKS */
-  size_t newsize = size ? BLOCK_NUMBER (size - 1) + 1 : 0;
+  if ((size > node->nn_stat.st_size)
+      && (!CACHE_INFO (node, blocks)) && (!ra->queued)
+      && radix_empty (&CACHE_INFO (node, spilled)))
+  {
+    /* Nothing is cached: pick blocks fitting the new size */
+    CACHE_INFO (node, block_log2) = node_block_log2 (size);
+    CACHE_INFO (node, size) = 0;
+    ra->window = ra->end = 0;
+  }
 
-  blocks_size = &(CACHE_INFO (node, size));
-  blocks      = &(CACHE_INFO (node, blocks));
+  /* New number of blocks */
+  newsize = size ? BLOCK_NUMBER (node, size - 1) + 1 : 0;
 
   if (size > node->nn_stat.st_size)
   {
     /* Grow the cache.  */
-    if (newsize > *blocks_size)
+    if (newsize > CACHE_INFO (node, size))
     {
-      /* Enlarge the block vector */
-      char **newblocks;
-
-      newblocks = realloc (*blocks, newsize * sizeof (char *));
-      if (newblocks)
-      {
-	/* Zero the new blocks without actually allocating them */
-	bzero (&newblocks[*blocks_size],
-	       (newsize - *blocks_size) * sizeof (char *));
-
-	*blocks = newblocks;
-	*blocks_size = newsize;
-
-	debug (("Node %s: grown to %u blocks", node->nn->name, newsize));
-      }
-      else
-        err = ENOMEM;
+      CACHE_INFO (node, size) = newsize;
+      debug (("Node %s: grown to %u blocks", node->nn->name, newsize));
     }
   }
   else
   {
-    int i;
-
     /* Free unused cache blocks */
-    for (i = newsize; i < *blocks_size; i++)
-      free ((*blocks)[i]);
-
-    /* Reduce cache vector */
-    *blocks = realloc (*blocks, newsize * sizeof (char *));
-    *blocks_size = newsize;
+    cache_drop (node, newsize);
+    spill_drop (node, newsize);
+    CACHE_INFO (node, size) = newsize;
+    extent_truncate (node, size);
   }
 
-  if (!err)
-    node->nn_stat.st_size = size;
+  node->nn_stat.st_size = size;
 
-  return err;
+  return 0;
 }
 
 /* Sets the size of NODE and reduce/grow its cache.  */
@@ -373,9 +1381,10 @@ cache_write (struct node *node, off_t offset, void *data,
   error_t err  = 0;
   size_t  size = len;
   void  *datap = data;			/* current pointer */
-  size_t block = BLOCK_NUMBER (offset);	/* 1st block to read */
+  off_t  start = offset;
+  size_t block;				/* 1st block to read */
   size_t last_block;			/* Last block avail on disk */
-  char **blocks;			/* cache blocks array */
+  size_t block_size;
   int  ondisk;
 
   /* Links should be handled by tarfs_write_node ()).  */
@@ -385,42 +1394,61 @@ cache_write (struct node *node, off_t offset, void *data,
   LOCK (node);
 
   {
-    /* Check whether we need to create/grow NODE's cache */
+    /* Check whether we need to grow NODE's cache */
     size_t newsize = offset + len;
 
-    if (__cache_synced (node) || (newsize > node->nn_stat.st_size))
+    if (newsize > node->nn_stat.st_size)
       err = __cache_set_size (node, newsize);
   }
 
-  blocks = CACHE_INFO (node, blocks);
   ondisk = (NODE_INFO (node)->tar->offset >= 0);
-  last_block = BLOCK_NUMBER (NODE_INFO (node)->tar->orig_size - 1);
+  last_block = BLOCK_NUMBER (node, NODE_INFO (node)->tar->orig_size - 1);
+  block = BLOCK_NUMBER (node, offset);
+  block_size = BLOCK_SIZE (node);
 
   /* Set OFFSET to be the relative offset inside cache block num. BLOCK.  */
-  offset = BLOCK_RELATIVE_OFFSET (offset);
+  offset = BLOCK_RELATIVE_OFFSET (node, offset);
 
   while ((!err) && (size > 0))
   {
-    size_t write = (size + offset > CACHE_BLOCK_SIZE)
-                   ? (CACHE_BLOCK_SIZE - offset)
+    struct cache_block *b;
+    off_t slot = spill_find (node, block);
+    size_t write = (size + offset > block_size)
+                   ? (block_size - offset)
 		   : (size);
 
+    if (slot >= 0)
+    {
+      /* The block was spilled: modify it there.  */
+      if (pwrite (spill_fd, datap, write, BLOCK_OFFSET (node, slot) + offset)
+	  != (ssize_t) write)
+	err = EIO;
+    }
     /* Allocate and fetch this block if not here yet (copy-on-write).  */
-    if (!blocks[block])
+    else if (ondisk && (block <= last_block))
+      /* Fetch this block */
+      err = fetch_block (node, block, &b);
+    else
     {
-      if (ondisk && (block <= last_block))
-	/* Fetch this block */
-	err = fetch_block (node, block);
+      b = cache_lookup (node, block);
+      if (b)
+	cache_pin (b);
       else
-        /* Allocate a new block */
-        err = alloc_block (node, block);
-
-      if (err)
-	break;
+      {
+	/* Allocate a new block, which needs to be zeroed unless it is
+	   about to be entirely overwritten.  */
+	err = alloc_block (node, block, &b);
+	if ((!err) && (write < block_size))
+	  bzero (b->data, block_size);
+      }
     }
 
-    /* Copy the new data into cache.  */
-    memcpy (&blocks[block][offset], datap, write);
+    if (err)
+      break;
+
+    if (slot < 0)
+      /* Copy the new data into cache.  */
+      memcpy (&b->data[offset], datap, write);
 
     /* Go ahead with next block.  */
     block++;
@@ -429,6 +1457,14 @@ cache_write (struct node *node, off_t offset, void *data,
     datap  = datap + write;
   }
 
+  if (len > size)
+  {
+    /* Remember what was modified */
+    error_t e = extent_add (node, start, start + len - size);
+    if (!err)
+      err = e;
+  }
+
   UNLOCK (node);
 
   *amount = len - size;
@@ -442,27 +1478,32 @@ error_t
 cache_cache (struct node *node, size_t amount)
 {
   error_t err   = 0;
-  int block = BLOCK_NUMBER (amount - 1) + 1;
-  char **blocks;
+  size_t orig_size = NODE_INFO (node)->tar->orig_size;
+  int block;
   int b;
 
   assert (amount <= node->nn_stat.st_size);
 
-  LOCK (node);
+  /* Whatever lies beyond the original size was written, hence is dirty
+     already.  */
+  if (amount > orig_size)
+    amount = orig_size;
+  if (!amount)
+    return 0;
 
-  if (block >= CACHE_INFO (node, size))
-    /* Allocate a large enough cache */
-    err = __cache_set_size (node, amount);
+  LOCK (node);
+  block = BLOCK_NUMBER (node, amount - 1) + 1;
 
-  blocks = CACHE_INFO (node, blocks);
+  /* The blocks must not be evicted since they are about to be overwritten
+     in the archive: pin them.  */
+  for (b = 0; (!err) && (b < block); b++)
+  {
+    struct cache_block *cb;
 
-  for (b = 0; b < block; b++)
-    if (!blocks[b])
-    {
-      err = fetch_block (node, b);
-      if (err)
-	break;
-    }
+    /* Spilled blocks are safe already */
+    if (spill_find (node, b) < 0)
+      err = fetch_block (node, b, &cb);
+  }
 
   UNLOCK (node);
 
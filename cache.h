@@ -28,33 +28,119 @@
 #include <hurd/netfs.h>
 #include <hurd/store.h>
 
-/* Size of a cache block.  */
-#define CACHE_BLOCK_SIZE_LOG2  10
-#define CACHE_BLOCK_SIZE  (1 << CACHE_BLOCK_SIZE_LOG2)
+#include "workers.h"
+#include "radix.h"
+
+/* Sizes of the cache blocks (log2): smallest and largest ones, size of
+   the blocks of small nodes and default size of those of large nodes.
+   Each node gets blocks as large as its size calls for between the two
+   latter (see cache_set_block_size ()).  */
+#define CACHE_BLOCK_MIN_LOG2      10
+#define CACHE_BLOCK_MAX_LOG2      18
+#define CACHE_BLOCK_SMALL_LOG2    12
+#define CACHE_BLOCK_DEFAULT_LOG2  16
+
+/* Default high spill watermark (see cache_set_spill ()) */
+#define CACHE_SPILL_HIGH  (64 << 20)
 
 /* Cache data accessor */
 #define CACHE_INFO(Node, Field) \
   (NODE_INFO(Node)->cache. Field)
 
-/* Nodes contents cache */
+/* A cache block (see cache.c) */
+struct cache_block;
+
+/* Sequential readahead state of a node */
+struct cache_readahead
+{
+  /* Work reading blocks ahead (must be first) and its node */
+  struct work work;
+  struct node *node;
+
+  /* Offset at which the next read starts if reading sequentially, and
+     current readahead window, in blocks */
+  off_t  next;
+  size_t window;
+
+  /* Blocks before this one have been read ahead already */
+  size_t end;
+
+  /* Blocks to be read ahead by WORK, and non-zero when it is queued */
+  size_t first, count;
+  int queued;
+};
+
+/* A range [START, END) of a node's contents which was modified since the
+   node was last synced */
+struct cache_extent
+{
+  off_t start;
+  off_t end;
+  struct cache_extent *next;
+};
+
+/* Nodes contents cache.  The cache blocks of all the nodes are handled by a
+   single cache manager, within a global budget.  */
 struct cache
 {
-  /* Vector of cache blocks */
-  char **blocks;
+  /* Size of the node's cache blocks (log2) */
+  unsigned block_log2;
 
-  /* Size of BLOCKS */
+  /* Size of the node, in blocks */
   size_t size;
 
+  /* List of the node's cache blocks, and number of dirty ones */
+  struct cache_block *blocks;
+  size_t dirty;
+
+  /* Modified ranges of the node, sorted and disjoint */
+  struct cache_extent *extents;
+
+  /* Numbers of the blocks which were moved to the spill file, mapped to
+     their slot in it (see cache.c) */
+  struct radix_tree spilled;
+
+  /* Sequential readahead state */
+  struct cache_readahead readahead;
+
   /* Lock of this cache */
   struct mutex lock;
 };
 
+/* Readahead statistics */
+struct cache_stats
+{
+  /* Number of blocks read ahead, number of those which were then used, and
+     number of those which were evicted or dropped before being used */
+  size_t readahead;
+  size_t readahead_hits;
+  size_t readahead_wasted;
+};
+
 /* Initializes the cache backend.  READ is the method that will be called
    when data needs to be read from a node.  */
 extern void cache_init (error_t (* read) (struct node *node, off_t offset,
 					  size_t howmuch,
 					  size_t *actually_read, void *data));
 
+/* Sets the maximum amount of cached data to BYTES.  Only clean blocks
+   (ie. blocks which can be read again from the archive) are evicted to
+   remain within this budget.  */
+extern void cache_set_budget (size_t bytes);
+
+/* Sets the size of the cache blocks of large nodes to BYTES, which must be
+   a power of two.  Smaller nodes get smaller blocks, down to 4 KiB.  This
+   only applies to nodes whose cache is created, or empty and grown,
+   afterwards.  */
+extern error_t cache_set_block_size (size_t bytes);
+
+/* Sets the spill watermarks.  When more than HIGH bytes of modified data
+   are held in memory, the blocks which were not used recently are moved
+   to a temporary file till there are no more than LOW bytes left (three
+   quarters of HIGH if LOW is zero).  Returns EINVAL if LOW is not lower
+   than HIGH.  */
+extern error_t cache_set_spill (size_t high, size_t low);
+
 /* Create a cache for node NODE.  */
 extern error_t cache_create (struct node *node);
 
@@ -77,7 +163,28 @@ extern error_t cache_set_size (struct node *node, size_t size);
 /* Cache AMOUNT bytes of NODE.  */
 extern error_t cache_cache (struct node *node, size_t amount);
 
-/* Returns non-zero if NODE is synchronized (ie. not cached).  */
+/* Copies the readahead statistics into STATS.  */
+extern void cache_get_stats (struct cache_stats *stats);
+
+/* Returns non-zero if NODE is synchronized (ie. was not modified since it
+   was last synced).  */
 extern int cache_synced (struct node *node);
 
+/* Returns in EXTENTS a copy of the list of NODE's modified ranges, to be
+   freed with cache_free_extents ().  */
+extern error_t cache_get_extents (struct node *node,
+				  struct cache_extent **extents);
+
+/* Frees the list of extents EXTENTS.  */
+extern void cache_free_extents (struct cache_extent *extents);
+
+/* Tells that NODE's contents have been written to the archive: its cache
+   blocks are now clean and may be evicted, and it has no modified ranges
+   anymore.  */
+extern void cache_mark_clean (struct node *node);
+
+/* Drops NODE's clean cache blocks, e.g. once NODE was written to the
+   archive and is not going to be used anytime soon.  */
+extern void cache_release (struct node *node);
+
 #endif /* cache.h */
@@ -31,6 +31,11 @@
 #include "debug.h"
 
 
+/* Number of entries from which a directory gets a hash table (so that
+   small directories don't pay for it) and minimum number of buckets.  */
+#define DIR_HASH_THRESHOLD  32
+#define DIR_HASH_MIN_SIZE   64
+
 /* General info */
 static pid_t pid;
 static uid_t uid;
@@ -74,23 +79,126 @@ fs_dir_first_entry (struct node *dir, struct node **first)
 error_t
 fs_dir_last_entry (struct node *dir, struct node **last)
 {
-  struct node *node = dir->nn->entries;
-
   if ((!dir->nn->entries) ||
       (!S_ISDIR (dir->nn_stat.st_mode)))
     return ENOTDIR;
 
-  if (!node)
+  /* DIR's tail is the NEXT field of its last entry */
+  *last = (struct node *) ((char *) dir->nn->tailp
+			   - offsetof (struct node, next));
+
+  return 0;
+}
+
+
+/* Directory index.  Entries are kept in a list, in the order in which they
+   were added, and DIR->NN->TAILP points to the end of it so that adding
+   an entry doesn't need to walk the list.  Directories with more than
+   DIR_HASH_THRESHOLD entries also get a hash table of their named entries,
+   chained through their NN->HASH_NEXT field.  */
+
+/* Adds NODE to DIR's hash table.  */
+static inline void
+dir_hash_add (struct node *dir, struct node *node)
+{
+  struct node **bucket;
+
+  if (!node->nn->name)
+    return;
+
+  bucket = &dir->nn->hash[arena_name_hash (node->nn->name)
+			  & (dir->nn->hash_size - 1)];
+  node->nn->hash_next = *bucket;
+  *bucket = node;
+}
+
+/* Removes NODE from DIR's hash table.  */
+static inline void
+dir_hash_remove (struct node *dir, struct node *node)
+{
+  struct node **p;
+
+  if ((!dir->nn->hash) || (!node->nn->name))
+    return;
+
+  for (p = &dir->nn->hash[arena_name_hash (node->nn->name)
+			  & (dir->nn->hash_size - 1)];
+       *p;
+       p = &(*p)->nn->hash_next)
+    if (*p == node)
+    {
+      *p = node->nn->hash_next;
+      break;
+    }
+}
+
+/* (Re)builds DIR's hash table with SIZE buckets (a power of two).  If
+   memory is short, DIR keeps its current table, if any, and ENOMEM is
+   returned.  */
+static error_t
+dir_hash_build (struct node *dir, size_t size)
+{
+  struct node **hash, *node;
+
+  hash = calloc (size, sizeof (struct node *));
+  if (!hash)
+    return ENOMEM;
+
+  free (dir->nn->hash);
+  dir->nn->hash = hash;
+  dir->nn->hash_size = size;
+
+  for (node = dir->nn->entries; node; node = node->next)
+    dir_hash_add (dir, node);
+
+  return 0;
+}
+
+/* Appends NODE to DIR's entries.  */
+static void
+dir_add_entry (struct node *dir, struct node *node)
+{
+  node->next  = NULL;
+  node->prevp = dir->nn->tailp;
+  *dir->nn->tailp = node;
+  dir->nn->tailp = &node->next;
+  dir->nn->nentries++;
+
+  if (dir->nn->hash)
   {
-    *last = NULL;
-    return ENOENT;
+    /* Keep the buckets short.  If the table can't be rebuilt, NODE goes
+       into the current one, or lookups wouldn't find it.  */
+    if ((dir->nn->nentries <= (dir->nn->hash_size << 1))
+	|| dir_hash_build (dir, dir->nn->hash_size << 2))
+      dir_hash_add (dir, node);
   }
+  else if (dir->nn->nentries >= DIR_HASH_THRESHOLD)
+    dir_hash_build (dir, DIR_HASH_MIN_SIZE);
+}
 
-  for ( ; node->next; node = node->next);
+/* Removes NODE from DIR's entries.  */
+static void
+dir_remove_entry (struct node *dir, struct node *node)
+{
+  struct node *next = node->next;
 
-  *last = node;
+  dir_hash_remove (dir, node);
 
-  return 0;
+  /* The entries following NODE are renumbered */
+  dir->nn->scan_node = NULL;
+
+  /* PREVP should never be zero.  */
+  assert (node->prevp);
+
+  if (*node->prevp)
+    *node->prevp = next;
+
+  if (next)
+    next->prevp = node->prevp;
+  else
+    dir->nn->tailp = node->prevp;
+
+  dir->nn->nentries--;
 }
 
 
@@ -98,44 +206,69 @@ fs_dir_last_entry (struct node *dir, struct node **last)
    Returns NAME is no change has been made, or a pointer to a newly
    malloced buffer otherwise.  */
 char*
-filter_node_name (char* name)
+filter_node_name (const char* name)
 {
   char* newname;
-  int modified = 0;
-  char *s, *ns;
+  const char *s;
+  char *ns;
   
   if (!name)
     return NULL;
+
+  /* Most names need no change: don't copy them */
+  for (s = name; *s != '\0'; s++)
+#ifdef SUBST_LOWER
+    if ((*s == '/') || (*s < 32))
+#else
+    if (*s == '/')
+#endif
+      break;
+  if (*s == '\0')
+    return (char *) name;
+
   if (! (newname = calloc (strlen (name) + 1, sizeof (char))))
-    return name;
+    return (char *) name;
 
   for (s = name, ns = newname;
        *s != '\0';
        s++, ns++)
   {
     if (*s == '/')
-      *ns = SUBST_SLASH, modified = 1;
+      *ns = SUBST_SLASH;
 #ifdef SUBST_LOWER
     else if (*s < 32)
-      *ns = SUBST_LOWER, modified = 1;
+      *ns = SUBST_LOWER;
 #endif
     else
       *ns = *s;
   }
   *ns = *s;
 
-  if (!modified)
-  {
-    free (newname);
-    newname = name;
-  }
-
   return newname;
 }
 
-/* Returns either NULL or a pointer to a node if found.  */
+/* Returns the interned copy of node name NAME, filtered (see
+   filter_node_name ()), or NULL if memory is short.  */
+const char *
+fs_intern_name (const char *name)
+{
+  char *filtered = filter_node_name (name);
+  const char *interned;
+
+  interned = arena_intern (filtered, strlen (filtered));
+  if (filtered != name)
+    free (filtered);
+
+  return interned;
+}
+
+/* Returns either NULL or a pointer to the node named NAME, which is LEN
+   bytes long (and needs not be null-terminated) and whose hash value is
+   HASH (see arena_hash ()), if found.  Names are told apart by their hash
+   value first.  */
 static inline struct node*
-_find_node (struct node *dir, char *name)
+_find_node (struct node *dir, const char *name, size_t len,
+	    unsigned int hash)
 {
   struct node *node = NULL;
 
@@ -144,21 +277,22 @@ _find_node (struct node *dir, char *name)
     /* Looking for '.' or '..'? */
     if (name[0] == '.')
     {
-      switch (name[1])
-      {
-        case '\0':
-          node = dir;
-          break;
-        case '.':
-          if (name[2] == '\0')
-          {
-            node = dir->nn->dir;
-            break;
-          }
-      }
+      if (len == 1)
+	node = dir;
+      else if ((len == 2) && (name[1] == '.'))
+	node = dir->nn->dir;
     }
 
-    if (!node)
+    if (!node && dir->nn->hash)
+    {
+      /* Look for a "regular" node in DIR's hash table */
+      for (node = dir->nn->hash[hash & (dir->nn->hash_size - 1)];
+	   node != NULL;
+	   node = node->nn->hash_next)
+	if (arena_name_is (node->nn->name, name, len, hash))
+	  break;
+    }
+    else if (!node)
     {
       /* Look for a "regular" node */
       for (node = dir->nn->entries;
@@ -166,7 +300,7 @@ _find_node (struct node *dir, char *name)
 	   node = node->next)
       {
 	if (node->nn->name)
-	  if (! strcmp (node->nn->name, name))
+	  if (arena_name_is (node->nn->name, name, len, hash))
 	    break;
       }
     }
@@ -176,16 +310,22 @@ _find_node (struct node *dir, char *name)
 }
 
 struct node *
-fs_find_node (struct node *dir, char *name)
+fs_find_node (struct node *dir, const char *name)
 {
-  return _find_node (dir, name);
+  size_t len;
+
+  if (!name)
+    return NULL;
+
+  len = strlen (name);
+  return _find_node (dir, name, len, arena_hash (name, len));
 }
 
 /* Inserts a new node in directory DIR, with name NAME and mode M. If not NULL,
    *N points to the newly created node.
-   NAME is *not* duplicated!  */
+   NAME is an interned name, or NULL.  */
 static inline error_t
-_make_node (struct node **n, struct node *dir, char* name, mode_t m)
+_make_node (struct node **n, struct node *dir, const char* name, mode_t m)
 {
   static ino_t id = 1;
   io_statbuf_t   st;
@@ -218,8 +358,9 @@ _make_node (struct node **n, struct node *dir, char* name, mode_t m)
     /* Set st_nlink to the number of subdirs plus 2 */
     st.st_nlink = 2;
   
-  newnode->nn->name = filter_node_name (name);
+  newnode->nn->name = name;
   newnode->nn->entries = NULL;	/* ptr to the first entry of this node */
+  newnode->nn->tailp = &newnode->nn->entries;
   newnode->nn_stat = st;
   newnode->nn_translated = m;
 
@@ -228,25 +369,11 @@ _make_node (struct node **n, struct node *dir, char* name, mode_t m)
 
   if (dir)
   {
-    struct node *p;
-
     /* Add a reference to DIR */
     netfs_nref (dir);
 
     /* Insert the new node *at the end* of the linked list of DIR entries. */
-    if (dir->nn->entries)
-    {
-      for (p = dir->nn->entries;
-	   p->next;
-	   p = p->next);
-      newnode->prevp = &p->next;
-      p->next = newnode;
-    }
-    else
-    {
-      newnode->prevp = &dir->nn->entries;
-      dir->nn->entries = newnode;
-    }
+    dir_add_entry (dir, newnode);
 
 #if 0
     /* Insert the new node *at the beginning* of the linked list
@@ -278,26 +405,42 @@ _make_node (struct node **n, struct node *dir, char* name, mode_t m)
 }
 
 /* Creates a new node in directory DIR, with name NAME (actually
-   a copy of NAME) and mode M. If not NULL, *N points to the newly
+   its interned copy) and mode M. If not NULL, *N points to the newly
    created node.
    Checks whether there already exists such a node.  */
 error_t
 fs_make_node (struct node **n, struct node *dir,
-              char* name, mode_t m)
+              const char* name, mode_t m)
+{
+  if (name)
+  {
+    name = fs_intern_name (name);
+    if (!name)
+      return ENOMEM;
+  }
+
+  return fs_make_node_interned (n, dir, name, m);
+}
+
+/* Likewise, but NAME is already an interned node name (see
+   fs_intern_name ()).  */
+error_t
+fs_make_node_interned (struct node **n, struct node *dir,
+		       const char *name, mode_t m)
 {
   struct node*  newnode = NULL;
   error_t err = 0;
 
   /* DIR == NULL means that we are creating NETFS_ROOT_NODE. */
-  if (dir)
-    newnode = _find_node (dir, name);
+  if (dir && name)
+    newnode = _find_node (dir, name, arena_name_len (name),
+			  arena_name_hash (name));
 
   /* Creates a new one if not found. */
   if (!newnode)
   {
     /* Make sure the filetype bits are set */
     m = (m & S_IFMT) ? m : (m | S_IFREG);
-    name = name ? strdup (name) : NULL;
     err = _make_node (&newnode, dir, name, m);
   }
   else
@@ -323,55 +466,44 @@ fs_find_node_path (struct node **n, char **retry_name, char **notfound,
 		   const char *path)
 {
   struct node *node = NULL;
-  char *str, *pathstr;
-  char *name = NULL;
-
-  pathstr = str = strdup (path);
+  const char *name, *end = NULL;
 
-  /* Lookup nodes. */
+  /* Lookup nodes.  Components are looked up in place, not copied. */
   if (! *n)
     *n = netfs_root_node;
   node = *n;
-  name = strtok_r (pathstr, "/", &str);
 
-  while (node && name)
-  {
-    /* Lookup base node. */
-    node = _find_node (*n, name);
-    if (node)
-    {
-      name = strtok_r (NULL, "/", &str);
-      *n   = node;
-    }
-  }
+  for (name = path; *name == '/'; name++)
+    ;
 
-  /* Did we parse the whole string? */
-  if (*str == '\0')
+  while (*name)
   {
+    /* Lookup base node. */
+    end = strchrnul (name, '/');
+    node = _find_node (*n, name, end - name, arena_hash (name, end - name));
     if (!node)
-    {
-      /* Yes, but we didn't find the very last node. */
-      assert (name != NULL);
-      assert (strlen (name) != 0);
+      break;
 
-      *notfound   = strdup (name);
-      *retry_name = NULL;
-    }
-    else
-      /* Yes, and we did find it. */
-      *notfound = *retry_name = NULL;
+    *n = node;
+    for (name = end; *name == '/'; name++)
+      ;
   }
+
+  if (node)
+    /* We did find the very last node. */
+    *notfound = *retry_name = NULL;
   else
   {
-    /* No, we stopped before the end of the string. */
-    assert (name != NULL);
-    assert (strlen (name) != 0);
-    *notfound   = strdup (name);
-    *retry_name = strdup (str);
+    /* We stopped at NAME, which was not found. */
+    assert (end > name);
+    *notfound = strndup (name, end - name);
+
+    /* Did we parse the whole string? */
+    while (*end == '/')
+      end++;
+    *retry_name = *end ? strdup (end) : NULL;
   }
 
-  free (pathstr);
-
   return 0;
 }
 
@@ -417,7 +549,7 @@ fs_make_subdir (struct node **newdir, struct node *dir, char *subdirname)
   struct node *n, *p;
 
   /* Look for an existing dir */
-  n = _find_node (dir, subdirname);
+  n = fs_find_node (dir, subdirname);
 
   if (!n)
     /* Create a new sub-directory. */
@@ -600,15 +732,19 @@ fs_link_node_path (struct node *node, const char *target)
   return 0;
 }
 
-/* Creates a new node NODE, in directory DIR, with name NAME and mode
-   M, hard linked to TARGET.  */
+/* Creates a new node NODE, in directory DIR, with name NAME (actually
+   its interned copy) and mode M, hard linked to TARGET.  */
 error_t
-fs_hard_link_node (struct node **node, struct node *dir, char* name,
+fs_hard_link_node (struct node **node, struct node *dir, const char* name,
 		   const mode_t m, struct node *target)
 {
   struct netnode *nn;
   struct node*   newnode = NULL;
 
+  name = fs_intern_name (name);
+  if (!name)
+    return ENOMEM;
+
   /* Alloctes a new netnode */
   nn = (struct netnode*) calloc (1, sizeof (struct netnode));
   if (!nn)
@@ -629,6 +765,12 @@ fs_hard_link_node (struct node **node, struct node *dir, char* name,
   newnode->nn_stat.st_nlink--;  /* XXX: One less hard link?  */
   *newnode->nn      = *target->nn;
   newnode->nn->name = name;
+  newnode->nn->entries   = NULL;
+  newnode->nn->tailp     = &newnode->nn->entries;
+  newnode->nn->nentries  = 0;
+  newnode->nn->hash      = NULL;
+  newnode->nn->hash_size = 0;
+  newnode->nn->scan_node = NULL;
   newnode->next     = NULL;
   newnode->prevp    = NULL;
 
@@ -637,20 +779,10 @@ fs_hard_link_node (struct node **node, struct node *dir, char* name,
 
   if (dir)
   {
-    struct node *p;
     netfs_nref (dir);
 
     /* Insert the new node *at the end* of the linked list of DIR entries. */
-    if (dir->nn->entries)
-    {
-      for (p = dir->nn->entries;
-	   p->next;
-	   p = p->next);
-      newnode->prevp = &p;
-      p->next = newnode;
-    }
-    else
-      dir->nn->entries = newnode;
+    dir_add_entry (dir, newnode);
 
     newnode->nn->dir = dir;
 
@@ -667,12 +799,33 @@ fs_hard_link_node (struct node **node, struct node *dir, char* name,
   return 0;
 }
 
+/* Gives NODE, an anonymous (nameless) node, the name NAME (actually its
+   interned copy).  */
+error_t
+fs_name_node (struct node *node, const char *name)
+{
+  struct node *dir = node->nn->dir;
+
+  assert (!node->nn->name);
+  node->nn->name = fs_intern_name (name);
+  if (!node->nn->name)
+    return ENOMEM;
+
+  if (dir && dir->nn->hash)
+    dir_hash_add (dir, node);
+
+  /* NODE gets numbered, and so are renumbered the entries following it */
+  if (dir)
+    dir->nn->scan_node = NULL;
+
+  return 0;
+}
+
 /* Unlink NODE *without* freeing its resources.  */
 error_t
 fs_unlink_node (struct node *node)
 {
   struct node *dir  = node->nn->dir;
-  struct node *next = node->next;
 
   if (node->nn->entries)
     return ENOTEMPTY;
@@ -689,15 +842,9 @@ fs_unlink_node (struct node *node)
       return EBUSY;
   }
 
-  /* PREVP should never be zero.  */
-  assert (node->prevp);
-
   /* Unlink NODE */
-  if (*node->prevp)
-    *node->prevp = next;
-
-  if (next)
-    next->prevp = node->prevp;
+  if (dir)
+    dir_remove_entry (dir, node);
 
   /* Decrease the reference count to the hardlink targets */
   if (node->nn->hardlink)
@@ -729,10 +876,10 @@ fs_free_node (struct node *node)
 
   assert (nn);
 
-  if (nn->name)
-    free (nn->name);
+  /* NN->NAME is interned, and thus never freed */
   if (nn->symlink)
     free (nn->symlink);
+  free (nn->hash);
 
   free (nn);
   node->nn = NULL;
@@ -26,7 +26,9 @@
 #include <hurd.h>
 #include <hurd/netfs.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include "backend.h"
+#include "arena.h"
 
 /* Initialization.  */
 extern int fs_init ();
@@ -43,12 +45,23 @@ extern error_t fs_dir_first_entry (struct node *dir, struct node **first);
    right after NODE).  This has to be consistent with _make_node ()/  */
 #define fs_dir_next_entry(Node)   ((Node)->next)
 
+/* Returns the entry of directory DIR which was added right before NODE, or
+   NULL if NODE is its first entry.  */
+#define fs_dir_prev_entry(Dir, Node) \
+  (((Node)->prevp == &(Dir)->nn->entries) \
+   ? NULL \
+   : (struct node *) ((char *) (Node)->prevp - offsetof (struct node, next)))
+
 /* Return DIR's last entry.  */
 extern error_t fs_dir_last_entry (struct node *dir, struct node **last);
 
 /* Returns either NULL or a pointer to a node if found.  */
 extern struct node*
-fs_find_node (struct node *dir, char *name);
+fs_find_node (struct node *dir, const char *name);
+
+/* Returns the interned copy of node name NAME, filtered (see
+   filter_node_name ()), or NULL if memory is short.  */
+extern const char *fs_intern_name (const char *name);
 
 /* Looks for a node located at PATH, starting at directory N.
    When looking for "/foo/bar":
@@ -63,11 +76,16 @@ fs_find_node_path (struct node **n, char **retry_name, char **notfound,
 		   const char *path);
 
 /* Creates a new node in directory DIR, with name NAME (actually
-   a copy of NAME) and mode M. If not NULL, *N points to the newly
+   its interned copy) and mode M. If not NULL, *N points to the newly
    created node.
    Checks whether there already exists such a node.  */
 extern error_t fs_make_node (struct node **n, struct node *dir,
-			     char* name, mode_t m);
+			     const char* name, mode_t m);
+
+/* Likewise, but NAME is already an interned node name (see
+   fs_intern_name ()).  */
+extern error_t fs_make_node_interned (struct node **n, struct node *dir,
+				      const char *name, mode_t m);
 
 /* Tries to create a node located at PATH, starting at directory N.
    When creating "/foo/bar":
@@ -93,10 +111,10 @@ extern error_t fs_link_node (struct node *node, struct node *target);
 /* Turn NODE into a symbolic link to TARGET.  */
 extern error_t fs_link_node_path (struct node *node, const char *target);
 
-/* Creates a new node NODE, in directory DIR, with name NAME and mode
-   M, hard linked to TARGET.  */
+/* Creates a new node NODE, in directory DIR, with name NAME (actually
+   its interned copy) and mode M, hard linked to TARGET.  */
 extern error_t
-fs_hard_link_node (struct node **node, struct node *dir, char* name,
+fs_hard_link_node (struct node **node, struct node *dir, const char* name,
 		   const mode_t m, struct node *target);
 
 /* Returns the path of a given node (relatively to the given root node).  */
@@ -111,7 +129,11 @@ extern struct node* get_common_root (struct node *node1, struct node *node2);
 /* Filters a node name, that is, remove '/' and chars lower than 32.
    Returns NAME is no change has been made, or a pointer to a newly
    malloced buffer otherwise.  */
-extern char* filter_node_name (char* name);
+extern char* filter_node_name (const char* name);
+
+/* Gives NODE, an anonymous (nameless) node, the name NAME (actually its
+   interned copy).  */
+extern error_t fs_name_node (struct node *node, const char *name);
 
 /* Unlink NODE *without* freeing its resources.  */
 extern error_t fs_unlink_node (struct node *node);
@@ -25,29 +25,21 @@
  */
 
 #include <sys/types.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <cthreads.h>
 #define TAR_NAMES
 #include "tar.h"
 #include "names.h"
+#include "arena.h"
 
 #include <stdio.h>
 #include <pwd.h>
 #include <grp.h>
 
-#ifndef TUNMLEN 
-#define TUNMLEN 256
-#endif
-#ifndef TGNMLEN
-#define TGNMLEN 256
-#endif
-
-static int saveuid = -993;
-static char saveuname[TUNMLEN];
 static int my_uid = -993;
-
-static int savegid = -993;
-static char savegname[TGNMLEN];
 static int my_gid = -993;
 
 #define myuid	( my_uid < 0? (my_uid = getuid()): my_uid )
@@ -59,160 +51,327 @@ static int my_gid = -993;
    This code should also be modified for non-UNIX systems to do something
    reasonable.  */
 
-static char cached_uname[NAMSIZ] = "";
-static char cached_gname[NAMSIZ] = "";
+/*
+ * Users and groups are looked up through caches, one for users and one for
+ * groups, since archives usually have a few owners shared by all their
+ * members, and the system's lookups may be slow (NSS, parsing of
+ * /etc/passwd, etc.).  Each cache is a hash table of the names and ids
+ * that were looked up, in both directions, including those which the
+ * system doesn't know (negative entries), so that none of them is looked
+ * up twice.  The caches are shared by the parsing and the syncing of the
+ * archive, and are never flushed.
+ */
+
+/* Minimum number of buckets of a cache */
+#define NAMES_MIN_SIZE  64
+
+/* A cached lookup, either of NAME (if BY_NAME is non-zero) or of ID.
+   FOUND is zero if the system doesn't know it.  */
+struct names_entry
+{
+  struct names_entry *next;	/* next entry in the same bucket */
+  unsigned int hash;
+  int by_name;
+  int found;
+  unsigned long id;
+  char name[TUNMLEN + 1];	/* NUL-terminated */
+};
+
+/* A cache of user or group names.  */
+struct names_cache
+{
+  struct names_entry **table;
+  size_t size;
+  size_t count;
+};
+
+static struct names_cache users;
+static struct names_cache groups;
+
+/* Number of lookups, and number of those served by the caches */
+static size_t lookups = 0;
+static size_t hits = 0;
+
+/* Protects the caches and the statistics */
+static struct mutex names_lock;
+
+/* Returns the hash value of NAME if BY_NAME is non-zero, of ID
+   otherwise.  */
+static inline unsigned int
+names_hash (int by_name, const char *name, unsigned long id)
+{
+  if (!by_name)
+    return (unsigned int) id * 0x9e3779b1;
+
+  return arena_hash (name, strlen (name));
+}
+
+/* Returns the entry of CACHE for NAME (if BY_NAME is non-zero) or ID, or
+   NULL.  Assumes NAMES_LOCK is held.  */
+static struct names_entry *
+names_find (struct names_cache *cache, int by_name, const char *name,
+	    unsigned long id, unsigned int hash)
+{
+  struct names_entry *entry;
+
+  if (!cache->table)
+    return NULL;
+
+  for (entry = cache->table[hash & (cache->size - 1)];
+       entry;
+       entry = entry->next)
+    if ((entry->hash == hash) && (entry->by_name == by_name)
+	&& (by_name ? !strcmp (entry->name, name) : (entry->id == id)))
+      break;
+
+  return entry;
+}
+
+/* Adds ENTRY to CACHE, growing it if need be.  If memory is short, CACHE
+   is left as is: the lookup will just be done again next time.  Assumes
+   NAMES_LOCK is held.  */
+static void
+names_add (struct names_cache *cache, struct names_entry *entry)
+{
+  struct names_entry **bucket;
+
+  if (cache->count >= (cache->size << 1))
+  {
+    /* Grow the table */
+    size_t size = cache->size ? cache->size << 2 : NAMES_MIN_SIZE;
+    struct names_entry **table = calloc (size, sizeof (struct names_entry *));
+    size_t i;
+
+    if (table)
+    {
+      for (i = 0; i < cache->size; i++)
+	while (cache->table[i])
+	{
+	  struct names_entry *e = cache->table[i];
+	  cache->table[i] = e->next;
+	  e->next = table[e->hash & (size - 1)];
+	  table[e->hash & (size - 1)] = e;
+	}
+
+      free (cache->table);
+      cache->table = table;
+      cache->size = size;
+    }
+  }
+
+  if (!cache->table)
+  {
+    free (entry);
+    return;
+  }
+
+  bucket = &cache->table[entry->hash & (cache->size - 1)];
+  entry->next = *bucket;
+  *bucket = entry;
+  cache->count++;
+}
+
+/* Size of the buffer first passed to the system's lookups, which is
+   enlarged as long as they find it too small.  */
+#define NAMES_BUF_SIZE  1024
+
+/* Asks the system for the user (if USER is non-zero) or group named KEY
+   (if BY_NAME is non-zero) or whose id is ID, and fills in the id and
+   name of NEW if it knows it.  The reentrant lookups are used since the
+   others return static buffers, which parsing and syncing would share.  */
+static void
+names_ask (int user, int by_name, const char *key, unsigned long id,
+	   struct names_entry *new)
+{
+  char small[NAMES_BUF_SIZE], *buf = small;
+  size_t len = sizeof (small);
+  int err;
+
+  do
+  {
+    if (user)
+    {
+      struct passwd pw, *res = NULL;
+
+      err = by_name ? getpwnam_r (key, &pw, buf, len, &res)
+		    : getpwuid_r (id, &pw, buf, len, &res);
+      if (!err && res)
+      {
+	new->found = 1;
+	new->id = pw.pw_uid;
+	strncpy (new->name, pw.pw_name, TUNMLEN);
+      }
+    }
+    else
+    {
+      struct group gr, *res = NULL;
 
-static uid_t cached_uid;	/* valid only if cached_uname is not empty */
-static gid_t cached_gid;	/* valid only if cached_gname is not empty */
+      err = by_name ? getgrnam_r (key, &gr, buf, len, &res)
+		    : getgrgid_r (id, &gr, buf, len, &res);
+      if (!err && res)
+      {
+	new->found = 1;
+	new->id = gr.gr_gid;
+	strncpy (new->name, gr.gr_name, TGNMLEN);
+      }
+    }
+
+    if (err == ERANGE)
+    {
+      /* The entry doesn't fit: try again with a larger buffer */
+      if (buf != small)
+	free (buf);
+      len <<= 1;
+      buf = malloc (len);
+      if (!buf)
+	break;
+    }
+  }
+  while (err == ERANGE);
 
-#if 0
-/* These variables are valid only if nonempty.  */
-static char cached_no_such_uname[NAMSIZ] = "";
-static char cached_no_such_gname[NAMSIZ] = "";
-#endif
+  if (buf != small)
+    free (buf);
+}
 
-/* These variables are valid only if nonzero.  It's not worth optimizing
-   the case for weird systems where 0 is not a valid uid or gid.  */
-static uid_t cached_no_such_uid = 0;
-static gid_t cached_no_such_gid = 0;
+/* Looks NAME (if BY_NAME is non-zero) or ID up in CACHE, the cache of users
+   if USER is non-zero, of groups otherwise, and asks the system if it is
+   not there.  Returns non-zero if the system knows it, in which case its
+   id, or its name, is returned in ID, or NAME (TUNMLEN bytes long).  */
+static int
+names_lookup (int user, int by_name, char *name, unsigned long *id)
+{
+  struct names_cache *cache = user ? &users : &groups;
+  struct names_entry *entry, new;
+  char key[TUNMLEN + 1];
+  unsigned int hash;
+
+  if (by_name)
+  {
+    /* Header fields needn't be NUL-terminated */
+    strncpy (key, name, TUNMLEN);
+    key[TUNMLEN] = '\0';
+  }
+  else
+    key[0] = '\0';
+  hash = names_hash (by_name, key, *id);
+
+  mutex_lock (&names_lock);
+  lookups++;
+  entry = names_find (cache, by_name, key, *id, hash);
+  if (entry)
+  {
+    hits++;
+    new = *entry;
+  }
+  mutex_unlock (&names_lock);
+
+  if (!entry)
+  {
+    /* Ask the system, without holding the lock */
+    bzero (&new, sizeof (new));
+    new.hash = hash;
+    new.by_name = by_name;
+
+    names_ask (user, by_name, key, *id, &new);
+
+    /* Record the key of negative entries too */
+    if (by_name)
+      strcpy (new.name, key);
+    else
+      new.id = *id;
+
+    entry = malloc (sizeof (struct names_entry));
+    if (entry)
+    {
+      *entry = new;
+      mutex_lock (&names_lock);
+      if (names_find (cache, by_name, key, *id, hash))
+	/* Another thread was quicker */
+	free (entry);
+      else
+	names_add (cache, entry);
+      mutex_unlock (&names_lock);
+    }
+  }
+
+  if (new.found)
+  {
+    if (by_name)
+      *id = new.id;
+    else
+      strncpy (name, new.name, TUNMLEN);
+  }
+
+  return new.found;
+}
+
+/* Returns in STATS the number of lookups of user and group names and ids,
+   and how many of them were served by the caches.  */
+void
+names_get_stats (struct names_stats *stats)
+{
+  mutex_lock (&names_lock);
+  stats->lookups = lookups;
+  stats->hits = hits;
+  mutex_unlock (&names_lock);
+}
 
 
 /*
  * Look up a user or group name from a uid/gid, maintaining a cache.
- * FIXME, for now it's a one-entry cache.
- * FIXME2, the "-993" is to reduce the chance of a hit on the first lookup.
  *
  * This is ifdef'd because on Suns, it drags in about 38K of "yellow
  * pages" code, roughly doubling the program size.  Thanks guys.
  */
 void finduname (char *uname, int uid)
 {
-    struct passwd *pw;
-#ifndef HAVE_GETPWUID
-    extern struct passwd *getpwuid ();
-#endif
-
-    if (uid != saveuid) {
-	saveuid = uid;
-	saveuname[0] = '\0';
-	pw = getpwuid (uid);
-	if (pw)
-	    strncpy (saveuname, pw->pw_name, TUNMLEN);
-    }
-    strncpy (uname, saveuname, TUNMLEN);
+    unsigned long id = uid;
+
+    if (!names_lookup (1, 0, uname, &id))
+	uname[0] = '\0';
 }
 
 int finduid (char *uname)
 {
-    struct passwd *pw;
-    extern struct passwd *getpwnam ();
-    
-    if (uname[0] != saveuname[0]/* Quick test w/o proc call */
-	||0 != strncmp (uname, saveuname, TUNMLEN)) {
-	strncpy (saveuname, uname, TUNMLEN);
-	pw = getpwnam (uname);
-	if (pw) {
-	    saveuid = pw->pw_uid;
-	} else {
-	    saveuid = myuid;
-	}
-    }
-    return saveuid;
+    unsigned long id = 0;
+
+    return names_lookup (1, 1, uname, &id) ? id : myuid;
 }
 
 
 void findgname (char *gname, int gid)
 {
-    struct group *gr;
-#ifndef HAVE_GETGRGID
-    extern struct group *getgrgid ();
-#endif
-
-    if (gid != savegid) {
-	savegid = gid;
-	savegname[0] = '\0';
-	(void) setgrent ();
-	gr = getgrgid (gid);
-	if (gr)
-	    strncpy (savegname, gr->gr_name, TGNMLEN);
-    }
-    (void) strncpy (gname, savegname, TGNMLEN);
+    unsigned long id = gid;
+
+    if (!names_lookup (0, 0, gname, &id))
+	gname[0] = '\0';
 }
 
 
 int findgid (char *gname)
 {
-    struct group *gr;
-    extern struct group *getgrnam ();
-    
-    if (gname[0] != savegname[0]/* Quick test w/o proc call */
-	||0 != strncmp (gname, savegname, TUNMLEN)) {
-	strncpy (savegname, gname, TUNMLEN);
-	gr = getgrnam (gname);
-	if (gr) {
-	    savegid = gr->gr_gid;
-	} else {
-	    savegid = mygid;
-	}
-    }
-    return savegid;
+    unsigned long id = 0;
+
+    return names_lookup (0, 1, gname, &id) ? id : mygid;
 }
 
-
+
+/* UNAME and GNAME are header fields: only TUNMLEN (and TGNMLEN) bytes of
+   them are written.  */
 void
 uid_to_uname (uid_t uid, char uname[NAMSIZ])
 {
-  struct passwd *passwd;
-
-  if (uid != 0 && uid == cached_no_such_uid)
-    {
-      *uname = '\0';
-      return;
-    }
+  unsigned long id = uid;
 
-  if (!cached_uname[0] || uid != cached_uid)
-    {
-      passwd = getpwuid (uid);
-      if (passwd)
-	{
-	  cached_uid = uid;
-	  strncpy (cached_uname, passwd->pw_name, NAMSIZ);
-	}
-      else
-	{
-	  cached_no_such_uid = uid;
-	  *uname = '\0';
-	  return;
-	}
-    }
-  strncpy (uname, cached_uname, NAMSIZ);
+  if (!names_lookup (1, 0, uname, &id))
+    *uname = '\0';
 }
 
 void
 gid_to_gname (gid_t gid, char gname[NAMSIZ])
 {
-  struct group *group;
-
-  if (gid != 0 && gid == cached_no_such_gid)
-    {
-      *gname = '\0';
-      return;
-    }
+  unsigned long id = gid;
 
-  if (!cached_gname[0] || gid != cached_gid)
-    {
-      group = getgrgid (gid);
-      if (group)
-	{
-	  cached_gid = gid;
-	  strncpy (cached_gname, group->gr_name, NAMSIZ);
-	}
-      else
-	{
-	  cached_no_such_gid = gid;
-	  *gname = '\0';
-	  return;
-	}
-    }
-  strncpy (gname, cached_gname, NAMSIZ);
+  if (!names_lookup (0, 0, gname, &id))
+    *gname = '\0';
 }
@@ -30,4 +30,16 @@ extern void findgname (char *name, int gid);
 extern void uid_to_uname (uid_t uid, char uname[NAMSIZ]);
 extern void gid_to_gname (gid_t gid, char gname[NAMSIZ]);
 
+/* Statistics of the user and group names caches */
+struct names_stats
+{
+  /* Number of lookups of names and ids, and number of those which were
+     served by the caches */
+  size_t lookups;
+  size_t hits;
+};
+
+/* Returns in STATS the statistics of the names caches.  */
+extern void names_get_stats (struct names_stats *stats);
+
 #endif
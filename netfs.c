@@ -192,6 +192,53 @@ netfs_node_norefs (struct node *node)
   backend.free_node (node);
 }
 
+/* Grows the buffer *DATA of *BUFSIZE bytes, the USED first of which are
+   used, so that it is at least SIZE bytes long.  Its size is at least
+   doubled, so that filling it takes a logarithmic number of steps.  If
+   *MAPPED is non-zero, *DATA was mapped by a previous call and is extended
+   in place when the pages following it are free, which saves copying it;
+   otherwise, it belongs to the caller and is left alone.  */
+static error_t
+grow_dirents (char **data, vm_size_t *bufsize, size_t used, size_t size,
+	      int *mapped)
+{
+  vm_size_t newsize = *bufsize << 1;
+  char *newdata, *end;
+
+  if (newsize < size)
+    newsize = size;
+  newsize = (newsize + vm_page_size - 1) & ~(vm_page_size - 1);
+
+  if (*mapped)
+  {
+    /* Try to map the pages right after *DATA */
+    end = *data + *bufsize;
+    newdata = mmap (end, newsize - *bufsize, PROT_READ|PROT_WRITE,
+		    MAP_ANONYMOUS, 0, 0);
+    if (newdata == end)
+    {
+      *bufsize = newsize;
+      return 0;
+    }
+    if (newdata != MAP_FAILED)
+      munmap (newdata, newsize - *bufsize);
+  }
+
+  newdata = mmap (0, newsize, PROT_READ|PROT_WRITE, MAP_ANONYMOUS, 0, 0);
+  if (newdata == MAP_FAILED)
+    return ENOMEM;
+
+  memcpy (newdata, *data, used);
+  if (*mapped)
+    munmap (*data, *bufsize);
+
+  *data = newdata;
+  *bufsize = newsize;
+  *mapped = 1;
+
+  return 0;
+}
+
 /* The user must define this function.  Fill the array *DATA of size
    BUFSIZE slast  up to NENTRIES dirents from DIR (which is locked)
    starting with entry ENTRY for user CRED.  The number of entries in
@@ -204,84 +251,69 @@ netfs_get_dirents (struct iouser *cred, struct node *dir,
 			   mach_msg_type_number_t *datacnt,
 			   vm_size_t bufsize, int *amt)
 {
-  int           curr_entry;	/* current entry */
-  static int    curr_amt;
-  struct dirent* curr_dirent;
-  char*         curr_datap;	/* current position in DATA */
+  int           curr_amt;
+  struct dir_cursor cursor;	/* this scan's own cursor */
+  size_t        used;		/* bytes of DATA used */
+  size_t        size;		/* size of the current entry */
+  int           mapped = 0;	/* was DATA mapped here? */
   int           no_more = 0;	/* no more entries? */
+  error_t       err = 0;
 
   curr_amt = 0;
-  curr_datap = *data;
+  used = 0;
 
   /* Start with entry ENTRY */
-  backend.set_curr_dir (dir);
-  no_more = backend.skip_entries (entry);
+  backend.set_curr_dir (&cursor, dir);
+  no_more = backend.skip_entries (&cursor, entry);
 
-  for (curr_entry = entry;
-       !no_more;
-       curr_entry++)
+  /* No limitiation when NENTRIES==-1. */
+  while (!no_more && ((nentries < 0) || (curr_amt < nentries)))
   {
-    /* No limitiation when NENTRIES==-1. */
-    if ((nentries >= 0) && (curr_entry > entry+nentries))
-      no_more = 1;
-    else
-      no_more = backend.get_next_entry(&curr_dirent);
+    /* Write the entry right into DATA */
+    size = bufsize - used;
+    no_more = backend.get_next_entry (&cursor, *data + used, &size);
 
     if (!no_more)
     {
+      /* Grow the buffer pointed to by DATA if the entry didn't fit, and
+	 try again. */
+      if (size > bufsize - used)
+      {
+	err = grow_dirents (data, &bufsize, used, used + size, &mapped);
+	if (err)
+	  break;
+	continue;
+      }
+
 #ifdef HIDE_FILES_NOT_OWNED
       /* FIXME: We should do something here to avoid the ENOENT
          during a dir_lookup () after a dir_readdir ().  */
 #endif
       curr_amt++;
+      used += size;
+    }
+  }
 
-      /* Grow the buffer pointed to by DATA if necessary. */
-      if (((curr_datap - *data) + curr_dirent->d_reclen) > bufsize)
-      {
-        void* newdata;
-	size_t prev_size = bufsize;
-
-	/* Makes BUFSIZE a multiple of VM_PAGE_SIZE or double it. */
-	if (!bufsize)
-	  bufsize = vm_page_size;
-	else
-	  bufsize = (bufsize%vm_page_size) ?
-		     ((bufsize/vm_page_size)+vm_page_size):
-		     (bufsize*2);
-
-	newdata = mmap (0, bufsize, PROT_READ|PROT_WRITE,
-	    MAP_ANONYMOUS, 0, 0);
-	assert (newdata != (void*)-1);
-	assert (newdata != NULL);
-		    
-	if (newdata != *data)
-	{
-	  size_t s = curr_datap - *data;
-	  memcpy (newdata, (void*) *data, s);
-	  curr_datap = (char*)newdata + s;
-
-	  munmap (*data, prev_size);
-	  *data = (char*)newdata;
-	}
-      }
-      assert (*data != NULL);
+  /* Entries that were returned are better than none (and if there are
+     none, DATA wasn't mapped here).  */
+  if (err && curr_amt)
+    err = 0;
 
-      /* Copy CURR_DIRENT into DATA. */
-      memcpy (curr_datap, curr_dirent, curr_dirent->d_reclen);
-      curr_datap += curr_dirent->d_reclen;
-      munmap (curr_dirent, curr_dirent->d_reclen);
-    }
+  if (mapped)
+  {
+    /* Only the pages holding the entries will be deallocated along with
+       the reply: drop the others.  */
+    size = (used + vm_page_size - 1) & ~(vm_page_size - 1);
+    if (bufsize > size)
+      munmap (*data + size, bufsize - size);
   }
-  
-#if 0
-  /* Deallocate if necessary. */
-  if (bufsize > (curr_datap - *data))
-    munmap (curr_datap, bufsize - (curr_datap - *data));
-#endif
+
+  if (err)
+    return err;
 
   /* Return */
   *amt = curr_amt;
-  *datacnt = curr_datap - *data;
+  *datacnt = used;
 
   return 0;
 }
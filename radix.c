@@ -0,0 +1,240 @@
+/* tarfs - A GNU tar filesystem for the Hurd.
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or * (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+   USA */
+
+/*
+ * Sparse maps from block numbers to pointers (radix trees).
+ *
+ * Each node has RADIX_SLOTS slots, which point either to nodes of the
+ * level below or, at the lowest level, to the values.  Keys are split in
+ * groups of RADIX_BITS bits, the most significant one being used at the
+ * root.  The tree grows higher as larger keys are stored, and nodes are
+ * freed as soon as they are empty.
+ */
+
+#include <stdlib.h>
+#include <limits.h>
+#include <assert.h>
+
+#include "radix.h"
+
+/* Number of key bits per level, and number of slots per node */
+#define RADIX_BITS   6
+#define RADIX_SLOTS  (1 << RADIX_BITS)
+#define RADIX_MASK   (RADIX_SLOTS - 1)
+
+/* Maximum height of a tree */
+#define RADIX_MAX_HEIGHT \
+  ((sizeof (size_t) * CHAR_BIT + RADIX_BITS - 1) / RADIX_BITS)
+
+struct radix_node
+{
+  void *slots[RADIX_SLOTS];
+
+  /* Number of non-NULL slots */
+  unsigned count;
+};
+
+/* Returns the number of keys that a tree of height HEIGHT can hold, or 0
+   if it can hold them all.  */
+static inline size_t
+capacity (unsigned height)
+{
+  return (height * RADIX_BITS >= sizeof (size_t) * CHAR_BIT)
+	 ? 0
+	 : (size_t) 1 << (height * RADIX_BITS);
+}
+
+/* Returns the slot index of KEY at level LEVEL (counting from the lowest
+   one, which is 0).  */
+static inline unsigned
+slot_index (size_t key, unsigned level)
+{
+  return (key >> (level * RADIX_BITS)) & RADIX_MASK;
+}
+
+void *
+radix_lookup (struct radix_tree *tree, size_t key)
+{
+  struct radix_node *node = tree->root;
+  unsigned level;
+
+  if ((!node) || (capacity (tree->height) && (key >= capacity (tree->height))))
+    return NULL;
+
+  for (level = tree->height - 1; level > 0; level--)
+  {
+    node = node->slots[slot_index (key, level)];
+    if (!node)
+      return NULL;
+  }
+
+  return node->slots[slot_index (key, 0)];
+}
+
+error_t
+radix_insert (struct radix_tree *tree, size_t key, void *value)
+{
+  struct radix_node *node, **slot;
+  unsigned level;
+
+  assert (value);
+
+  if (!tree->root)
+    /* Start with the smallest tree that can hold KEY */
+    tree->height = 1;
+
+  while (capacity (tree->height) && (key >= capacity (tree->height)))
+  {
+    /* Add a level on top of the tree */
+    if (tree->root)
+    {
+      node = calloc (1, sizeof (struct radix_node));
+      if (!node)
+	return ENOMEM;
+      node->slots[0] = tree->root;
+      node->count = 1;
+      tree->root = node;
+    }
+    tree->height++;
+  }
+
+  assert (tree->height <= RADIX_MAX_HEIGHT);
+
+  if (!tree->root)
+  {
+    tree->root = calloc (1, sizeof (struct radix_node));
+    if (!tree->root)
+      return ENOMEM;
+  }
+
+  node = tree->root;
+  for (level = tree->height - 1; level > 0; level--)
+  {
+    slot = (struct radix_node **) &node->slots[slot_index (key, level)];
+    if (!*slot)
+    {
+      *slot = calloc (1, sizeof (struct radix_node));
+      if (!*slot)
+	return ENOMEM;
+      node->count++;
+    }
+    node = *slot;
+  }
+
+  if (!node->slots[slot_index (key, 0)])
+    node->count++;
+  node->slots[slot_index (key, 0)] = value;
+
+  return 0;
+}
+
+void *
+radix_remove (struct radix_tree *tree, size_t key)
+{
+  struct radix_node *path[RADIX_MAX_HEIGHT];
+  struct radix_node *node = tree->root;
+  void *value;
+  int level;
+
+  if ((!node) || (capacity (tree->height) && (key >= capacity (tree->height))))
+    return NULL;
+
+  for (level = tree->height - 1; level > 0; level--)
+  {
+    path[level] = node;
+    node = node->slots[slot_index (key, level)];
+    if (!node)
+      return NULL;
+  }
+  path[0] = node;
+
+  value = node->slots[slot_index (key, 0)];
+  if (!value)
+    return NULL;
+
+  /* Clear the slot, and free the nodes which become empty */
+  for (level = 0; level < (int) tree->height; level++)
+  {
+    path[level]->slots[slot_index (key, level)] = NULL;
+    if (--path[level]->count)
+      break;
+    free (path[level]);
+  }
+
+  if (level == (int) tree->height)
+    /* The root itself was freed */
+    radix_init (tree);
+
+  return value;
+}
+
+/* Removes the values of the subtree NODE at level LEVEL, whose first key is
+   BASE, stored at keys greater than or equal to FIRST.  Returns non-zero
+   if NODE is now empty, in which case it has been freed.  */
+static int
+truncate_node (struct radix_node *node, unsigned level, size_t base,
+	       size_t first, void (* fn) (void *value, void *arg), void *arg)
+{
+  size_t span = (size_t) 1 << (level * RADIX_BITS);
+  unsigned i;
+
+  for (i = 0; i < RADIX_SLOTS; i++, base += span)
+  {
+    if (!node->slots[i])
+      continue;
+
+    if (level == 0)
+    {
+      if (base < first)
+	continue;
+      if (fn)
+	fn (node->slots[i], arg);
+    }
+    else
+    {
+      if ((base + span - 1) < first)
+	/* Entirely before FIRST */
+	continue;
+      if (!truncate_node (node->slots[i], level - 1, base, first, fn, arg))
+	continue;
+    }
+
+    node->slots[i] = NULL;
+    node->count--;
+  }
+
+  if (node->count)
+    return 0;
+
+  free (node);
+  return 1;
+}
+
+void
+radix_truncate (struct radix_tree *tree, size_t first,
+		void (* fn) (void *value, void *arg), void *arg)
+{
+  if (!tree->root)
+    return;
+
+  if (capacity (tree->height) && (first >= capacity (tree->height)))
+    return;
+
+  if (truncate_node (tree->root, tree->height - 1, 0, first, fn, arg))
+    radix_init (tree);
+}
@@ -0,0 +1,70 @@
+/* tarfs - A GNU tar filesystem for the Hurd.
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or * (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+   USA */
+
+/*
+ * Sparse maps from block numbers to pointers (radix trees).
+ */
+
+#ifndef __RADIX_H__
+#define __RADIX_H__
+
+#include <stdlib.h>
+#include <errno.h>
+
+/* A radix tree.  Its nodes only get allocated when pointers are stored in
+   it, so that an empty tree takes no memory.  */
+struct radix_tree
+{
+  /* The root node, or NULL if the tree is empty, and the tree's height
+     (number of levels of nodes) */
+  struct radix_node *root;
+  unsigned height;
+};
+
+/* Initializes TREE as an empty tree.  */
+static inline void
+radix_init (struct radix_tree *tree)
+{
+  tree->root = NULL;
+  tree->height = 0;
+}
+
+/* Returns non-zero if TREE is empty.  */
+static inline int
+radix_empty (struct radix_tree *tree)
+{
+  return tree->root == NULL;
+}
+
+/* Returns the pointer stored in TREE at KEY, or NULL.  */
+extern void *radix_lookup (struct radix_tree *tree, size_t key);
+
+/* Stores VALUE, which must not be NULL, in TREE at KEY.  Returns ENOMEM if
+   a node could not be allocated.  */
+extern error_t radix_insert (struct radix_tree *tree, size_t key, void *value);
+
+/* Removes the pointer stored in TREE at KEY and returns it, or NULL.  */
+extern void *radix_remove (struct radix_tree *tree, size_t key);
+
+/* Removes all the pointers stored in TREE at keys greater than or equal to
+   FIRST, and calls FN on each of them, along with ARG, if FN is not NULL.
+   The tree is emptied if FIRST is zero.  */
+extern void radix_truncate (struct radix_tree *tree, size_t first,
+			    void (* fn) (void *value, void *arg), void *arg);
+
+#endif
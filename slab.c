@@ -0,0 +1,293 @@
+/* tarfs - A GNU tar filesystem for the Hurd.
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or * (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+   USA */
+
+/*
+ * A slab allocator for fixed-size objects.
+ *
+ * Objects are cut out of slabs, large chunks of memory aligned on their
+ * size so that the slab of an object is found by masking its address.
+ * Each slab keeps a list of its free objects, and a slab is given back to
+ * the system as soon as all its objects are free, except for one spare
+ * slab per cache.  On top of this, magazines hold a few free objects each
+ * which threads allocate and free without taking the cache's lock.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <cthreads.h>
+
+#include "slab.h"
+
+/* Minimum size of a slab, and minimum number of objects it holds */
+#define SLAB_MIN_SIZE     (64 << 10)
+#define SLAB_MIN_OBJECTS  8
+
+/* Alignment of the objects */
+#define SLAB_ALIGN        16
+#define SLAB_ROUND(Size)  (((Size) + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1))
+
+/* A slab's header, which is followed by its objects */
+struct slab
+{
+  /* Previous and next slabs in the cache's list of partial slabs */
+  struct slab *prev;
+  struct slab *next;
+
+  /* List of free objects (chained through their first word) and number
+     of used objects */
+  void *free;
+  size_t used;
+};
+
+/* Returns the slab which OBJECT belongs to.  */
+static inline struct slab *
+slab_of (struct slab_cache *cache, void *object)
+{
+  return (struct slab *) ((uintptr_t) object & ~(cache->slab_size - 1));
+}
+
+/* Returns the magazine of CACHE that the calling thread should use.  */
+static inline struct slab_magazine *
+magazine (struct slab_cache *cache)
+{
+  uintptr_t self = (uintptr_t) cthread_self ();
+
+  return &cache->magazines[((self * 0x9e3779b1) >> 8) % SLAB_MAGAZINES];
+}
+
+void
+slab_cache_init (struct slab_cache *cache, size_t size)
+{
+  size_t header = SLAB_ROUND (sizeof (struct slab));
+  int i;
+
+  cache->size = SLAB_ROUND (size);
+  for (cache->slab_size = SLAB_MIN_SIZE;
+       cache->slab_size < header + SLAB_MIN_OBJECTS * cache->size;
+       cache->slab_size <<= 1)
+    ;
+  cache->slab_objects = (cache->slab_size - header) / cache->size;
+
+  /* Don't let magazines hoard large objects */
+  cache->magazine_size = SLAB_MAGAZINE_BYTES / cache->size;
+  if (cache->magazine_size > SLAB_MAGAZINE_SIZE)
+    cache->magazine_size = SLAB_MAGAZINE_SIZE;
+  if (cache->magazine_size < 2)
+    cache->magazine_size = 2;
+
+  cache->partial = NULL;
+  cache->spare = NULL;
+  mutex_init (&cache->lock);
+
+  for (i = 0; i < SLAB_MAGAZINES; i++)
+  {
+    mutex_init (&cache->magazines[i].lock);
+    cache->magazines[i].count = 0;
+  }
+}
+
+
+/* Slabs management.  The functions below assume that CACHE is locked.  */
+
+static inline void
+partial_add (struct slab_cache *cache, struct slab *slab)
+{
+  slab->prev = NULL;
+  slab->next = cache->partial;
+  if (slab->next)
+    slab->next->prev = slab;
+  cache->partial = slab;
+}
+
+static inline void
+partial_remove (struct slab_cache *cache, struct slab *slab)
+{
+  if (slab->prev)
+    slab->prev->next = slab->next;
+  else
+    cache->partial = slab->next;
+  if (slab->next)
+    slab->next->prev = slab->prev;
+}
+
+/* Returns a slab whose objects are all free, or NULL.  */
+static struct slab *
+slab_new (struct slab_cache *cache)
+{
+  struct slab *slab;
+  char *object;
+  size_t i;
+
+  if (cache->spare)
+  {
+    slab = cache->spare;
+    cache->spare = NULL;
+    return slab;
+  }
+
+  if (posix_memalign ((void **) &slab, cache->slab_size, cache->slab_size))
+    return NULL;
+
+  slab->free = NULL;
+  slab->used = 0;
+
+  /* Chain the objects so that the first one gets allocated first */
+  object = (char *) slab + SLAB_ROUND (sizeof (struct slab))
+	   + (cache->slab_objects - 1) * cache->size;
+  for (i = 0; i < cache->slab_objects; i++, object -= cache->size)
+    slab_chain (&slab->free, object);
+
+  return slab;
+}
+
+/* Returns a free object from CACHE's slabs, or NULL.  */
+static void *
+depot_alloc (struct slab_cache *cache)
+{
+  struct slab *slab = cache->partial;
+  void *object;
+
+  if (!slab)
+  {
+    slab = slab_new (cache);
+    if (!slab)
+      return NULL;
+    partial_add (cache, slab);
+  }
+
+  object = slab->free;
+  slab->free = *(void **) object;
+  slab->used++;
+
+  if (!slab->free)
+    /* This slab is full */
+    partial_remove (cache, slab);
+
+  return object;
+}
+
+/* Gives OBJECT back to its slab.  */
+static void
+depot_free (struct slab_cache *cache, void *object)
+{
+  struct slab *slab = slab_of (cache, object);
+
+  assert (slab->used > 0);
+
+  if (!slab->free)
+    /* This slab was full */
+    partial_add (cache, slab);
+
+  slab_chain (&slab->free, object);
+  slab->used--;
+
+  if (!slab->used)
+  {
+    /* This slab is not used anymore */
+    partial_remove (cache, slab);
+    if (cache->spare)
+      free (slab);
+    else
+      cache->spare = slab;
+  }
+}
+
+
+void *
+slab_alloc (struct slab_cache *cache)
+{
+  struct slab_magazine *mag = magazine (cache);
+  void *object = NULL;
+
+  if (!mutex_try_lock (&mag->lock))
+  {
+    /* Another thread is using this magazine */
+    mutex_lock (&cache->lock);
+    object = depot_alloc (cache);
+    mutex_unlock (&cache->lock);
+    return object;
+  }
+
+  if (!mag->count)
+  {
+    /* Fill half of the magazine */
+    mutex_lock (&cache->lock);
+    while (mag->count < cache->magazine_size / 2)
+    {
+      object = depot_alloc (cache);
+      if (!object)
+	break;
+      mag->objects[mag->count++] = object;
+    }
+    mutex_unlock (&cache->lock);
+  }
+
+  object = mag->count ? mag->objects[--mag->count] : NULL;
+
+  mutex_unlock (&mag->lock);
+
+  return object;
+}
+
+void
+slab_free (struct slab_cache *cache, void *object)
+{
+  struct slab_magazine *mag = magazine (cache);
+
+  if (!object)
+    return;
+
+  if (!mutex_try_lock (&mag->lock))
+  {
+    /* Another thread is using this magazine */
+    mutex_lock (&cache->lock);
+    depot_free (cache, object);
+    mutex_unlock (&cache->lock);
+    return;
+  }
+
+  if (mag->count >= cache->magazine_size)
+  {
+    /* Empty half of the magazine */
+    mutex_lock (&cache->lock);
+    while (mag->count > cache->magazine_size / 2)
+      depot_free (cache, mag->objects[--mag->count]);
+    mutex_unlock (&cache->lock);
+  }
+
+  mag->objects[mag->count++] = object;
+
+  mutex_unlock (&mag->lock);
+}
+
+void
+slab_free_chain (struct slab_cache *cache, void *objects)
+{
+  void *next;
+
+  mutex_lock (&cache->lock);
+
+  for (; objects; objects = next)
+  {
+    next = *(void **) objects;
+    depot_free (cache, objects);
+  }
+
+  mutex_unlock (&cache->lock);
+}
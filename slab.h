@@ -0,0 +1,93 @@
+/* tarfs - A GNU tar filesystem for the Hurd.
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or * (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+   USA */
+
+/*
+ * A slab allocator for fixed-size objects.
+ */
+
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <stdlib.h>
+#include <cthreads.h>
+
+/* Number of magazines of a slab cache, and number of objects each of them
+   may hold, but no more than SLAB_MAGAZINE_BYTES bytes of objects.  */
+#define SLAB_MAGAZINES       8
+#define SLAB_MAGAZINE_SIZE   32
+#define SLAB_MAGAZINE_BYTES  (256 << 10)
+
+/* A slab: a large, aligned chunk of memory cut into objects (see slab.c) */
+struct slab;
+
+/* A magazine: a small stack of free objects which can be allocated, or
+   freed, without going to the slabs.  Threads pick a magazine according
+   to their identity so that they usually don't compete for it.  */
+struct slab_magazine
+{
+  struct mutex lock;
+  size_t count;
+  void *objects[SLAB_MAGAZINE_SIZE];
+};
+
+/* A cache of objects of the same size */
+struct slab_cache
+{
+  /* Size of the objects, size of the slabs and number of objects per
+     slab */
+  size_t size;
+  size_t slab_size;
+  size_t slab_objects;
+
+  /* Number of objects a magazine may hold (fewer for large objects) */
+  size_t magazine_size;
+
+  /* Slabs which have both used and free objects, and at most one slab
+     whose objects are all free, kept to avoid allocating a new one too
+     often.  These are protected by LOCK.  */
+  struct slab *partial;
+  struct slab *spare;
+  struct mutex lock;
+
+  struct slab_magazine magazines[SLAB_MAGAZINES];
+};
+
+/* Initializes CACHE which will hold objects of SIZE bytes.  */
+extern void slab_cache_init (struct slab_cache *cache, size_t size);
+
+/* Returns a new object from CACHE, or NULL if there is no memory left.  The
+   object is *not* zeroed.  */
+extern void *slab_alloc (struct slab_cache *cache);
+
+/* Gives OBJECT back to CACHE.  */
+extern void slab_free (struct slab_cache *cache, void *object);
+
+/* Gives back to CACHE all the objects of the list starting at OBJECTS at
+   once.  The objects of such a list are chained through their first word,
+   which can be done with slab_chain ().  */
+extern void slab_free_chain (struct slab_cache *cache, void *objects);
+
+/* Adds OBJECT in front of the list of objects CHAIN.  */
+static inline void
+slab_chain (void **chain, void *object)
+{
+  *(void **) object = *chain;
+  *chain = object;
+}
+
+#endif
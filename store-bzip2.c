@@ -23,7 +23,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <stdint.h>
+#include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <bzlib.h>
 #include <error.h>
 
@@ -31,12 +34,33 @@
 #include <hurd/store.h>
 
 #include "zipstores.h"
+#include "workers.h"
+#include "slab.h"
+#include "radix.h"
 
 #ifndef DEBUG_ZIP
 # undef DEBUG
 #endif
 #include "debug.h"
 
+static error_t bzip2_scan_blocks (struct store *source, store_offset_t start,
+				  store_offset_t **blocks, size_t *count);
+
+static error_t bzip2_decode_block (struct store *source,
+				   store_offset_t start, store_offset_t end,
+				   char **buf, size_t *len);
+
+struct chunk;
+
+static error_t bzip2_compress_chunk (struct chunk *chunk);
+
+static error_t bzip2_chunk_begin (error_t (* put) (const void *data,
+						   size_t bits));
+
+static error_t bzip2_chunk_end (uint32_t crc,
+				error_t (* put) (const void *data,
+						 size_t bits));
+
 
 
 /* Convert a bzlib error into a libc error.  */
@@ -96,12 +120,426 @@ bzip2_error (bz_stream *stream, int zerr)
 
 #define ZIP_COMPRESS_FINISH(Stream)  BZ2_bzCompress ((Stream), BZ_FINISH)
 
-#define ZIP_COMPRESS_INIT(Stream)    BZ2_bzCompressInit ((Stream), 4, 1, 0)
+/* Block size, in 100k units */
+#define BZIP2_BLOCK_SIZE             4
+
+#define ZIP_COMPRESS_INIT(Stream)    BZ2_bzCompressInit ((Stream), \
+							 BZIP2_BLOCK_SIZE, 1, 0)
 
 #define ZIP_COMPRESS_END(Stream)     BZ2_bzCompressEnd ((Stream))
 
+/* A bzip2 file may be made of several streams one after the other, e.g.
+   when it was written by appending (see STORE_ZIP (flush)).  */
+#define ZIP_HAS_STREAMS
+#define ZIP_STREAM_MAGIC             "BZh"
+
+/* A bzip2 stream is made of blocks which can be decompressed independently,
+   given a bit of help (see bzip2_decode_block ()).  */
+#define ZIP_HAS_BLOCKS
+#define ZIP_BLOCK_SCAN(Source, Start, Blocks, Count) \
+  bzip2_scan_blocks ((Source), (Start), (Blocks), (Count))
+#define ZIP_BLOCK_DECODE(Source, Start, End, Buf, Len) \
+  bzip2_decode_block ((Source), (Start), (End), (Buf), (Len))
+
+/* The stream can be compressed by chunks in parallel, each chunk making
+   exactly one block: bzip2 may expand its input by up to 5/4 (runs of 4
+   identical bytes) before filling a block.  The blocks are then copied one
+   after the other into a single stream, whose CRC is computed out of
+   theirs.  */
+#define ZIP_HAS_CHUNKS
+#define ZIP_CHUNK_SIZE \
+  ((((BZIP2_BLOCK_SIZE * 100000 - 19) * 4 / 5) >> CACHE_BLOCK_SIZE_LOG2) \
+   << CACHE_BLOCK_SIZE_LOG2)
+#define ZIP_CHUNK_DICT               0
+#define ZIP_CHUNK_COMPRESS(Chunk)    bzip2_compress_chunk ((Chunk))
+#define ZIP_CHUNK_CRC_COMBINE(Crc, ChunkCrc, Len) \
+  ((((Crc) << 1) | ((Crc) >> 31)) ^ (ChunkCrc))
+#define ZIP_CHUNK_BEGIN(Put)         bzip2_chunk_begin ((Put))
+#define ZIP_CHUNK_END(Crc, Size, Put) bzip2_chunk_end ((Crc), (Put))
+
 /* Constants */
 #define ZIP_STREAM                   bz_stream
 #define ZIP_STREAM_END               BZ_STREAM_END
 
 #include "zipstores.c"
+
+/* Each block starts with this 48-bit magic number, followed by the block's
+   CRC.  The stream ends with another magic number followed by the stream's
+   CRC, which is computed out of the blocks' CRCs.  None of them is
+   byte-aligned.  */
+#define BZIP2_BLOCK_MAGIC  0x314159265359ULL
+#define BZIP2_EOS_MAGIC    0x177245385090ULL
+#define BZIP2_MAGIC_MASK   0xffffffffffffULL
+
+/* Size of a bzip2 stream header ("BZh" followed by the block size) */
+#define BZIP2_HEADER_SIZE  4
+
+/* Looks for the blocks of the bzip2 stream found at offset START of
+   SOURCE.  On success, BLOCKS points to a newly allocated vector of COUNT
+   bit offsets: the beginning of each block, followed by the end of the
+   last one.  Since the magic numbers might as well appear within
+   compressed data, this checks that the CRCs of the blocks found add up
+   to the stream's CRC.  */
+static error_t
+bzip2_scan_blocks (struct store *source, store_offset_t start,
+		   store_offset_t **blocks, size_t *count)
+{
+  error_t err = 0;
+  uchar buf[ZIP_BUFSIZE];
+  uint64_t reg = 0;
+  uint32_t crc = 0, combined_crc = 0;
+  store_offset_t offs = start, bit = start << 3;
+  size_t size = 0, len, i;
+  int crc_bits = 0, eos = 0, b;
+
+  *blocks = NULL;
+  *count = 0;
+
+  err = store_simple_read (source, offs, BZIP2_HEADER_SIZE, buf, &len);
+  if (!err && ((len != BZIP2_HEADER_SIZE) || memcmp (buf, "BZh", 3)))
+    err = EINVAL;
+
+  while ((!err) && (offs < source->size) && ((!eos) || crc_bits))
+  {
+    err = store_simple_read (source, offs,
+			     MIN (source->size - offs, ZIP_BUFSIZE), buf, &len);
+    if (!err && !len)
+      err = EIO;
+    if (err)
+      break;
+
+    for (i = 0; (!err) && (i < len) && ((!eos) || crc_bits); i++)
+      for (b = 7; b >= 0; b--)
+      {
+	reg = (reg << 1) | ((buf[i] >> b) & 1);
+	bit++;
+
+	if (crc_bits)
+	{
+	  /* Read the CRC that follows a magic number */
+	  crc = (crc << 1) | (reg & 1);
+	  if (--crc_bits)
+	    continue;
+
+	  if (eos)
+	  {
+	    if (crc != combined_crc)
+	      err = EINVAL;
+	    break;
+	  }
+
+	  combined_crc = ((combined_crc << 1) | (combined_crc >> 31)) ^ crc;
+	  continue;
+	}
+
+	if (((reg & BZIP2_MAGIC_MASK) != BZIP2_BLOCK_MAGIC)
+	    && ((reg & BZIP2_MAGIC_MASK) != BZIP2_EOS_MAGIC))
+	  continue;
+
+	if (*count >= size)
+	{
+	  store_offset_t *new;
+
+	  size = size ? size << 1 : 256;
+	  new = realloc (*blocks, size * sizeof (store_offset_t));
+	  if (!new)
+	  {
+	    err = ENOMEM;
+	    break;
+	  }
+	  *blocks = new;
+	}
+
+	(*blocks)[(*count)++] = bit - 48;
+	eos = ((reg & BZIP2_MAGIC_MASK) == BZIP2_EOS_MAGIC);
+	crc_bits = 32;
+      }
+
+    offs += len;
+  }
+
+  if ((!err) && ((!eos) || crc_bits || (*count < 2)))
+    /* Truncated stream or no block at all */
+    err = EINVAL;
+
+  if ((!err) && (((bit + 7) >> 3) < source->size))
+    /* Another stream follows, which must be read sequentially */
+    err = EINVAL;
+
+  if (err)
+  {
+    free (*blocks);
+    *blocks = NULL;
+    *count = 0;
+  }
+
+  debug (("%u blocks found (%s)", *count ? *count - 1 : 0, strerror (err)));
+
+  return err;
+}
+
+/* Writes the COUNT lower bits of VALUE at bit offset *BIT of BUF (which is
+   assumed to be zeroed from there on) and updates *BIT.  */
+static inline void
+put_bits (uchar *buf, size_t *bit, uint64_t value, int count)
+{
+  while (count--)
+  {
+    if ((value >> count) & 1)
+      buf[*bit >> 3] |= 0x80 >> (*bit & 7);
+    (*bit)++;
+  }
+}
+
+/* Returns the COUNT bits found at bit offset BIT of BUF.  */
+static inline uint64_t
+get_bits (const uchar *buf, size_t bit, int count)
+{
+  uint64_t value = 0;
+
+  for (; count--; bit++)
+    value = (value << 1) | ((buf[bit >> 3] >> (7 - (bit & 7))) & 1);
+
+  return value;
+}
+
+/* Decompresses the bzip2 block of SOURCE that starts at bit offset START
+   (ie. with its magic number) and ends at bit offset END.  Like
+   bzip2recover, this makes up a bzip2 stream containing only this block.
+   The uncompressed data is returned in BUF, a newly allocated buffer of
+   LEN bytes.  This may be called from any thread.  */
+static error_t
+bzip2_decode_block (struct store *source,
+		    store_offset_t start, store_offset_t end,
+		    char **buf, size_t *len)
+{
+  error_t err;
+  int zerr;
+  bz_stream stream;
+  uchar *raw, *in;
+  char *out = NULL;
+  size_t nbits = end - start, raw_len, in_len, bit, size, read, i;
+  int shift = start & 7;
+  uint32_t crc;
+
+  *buf = NULL;
+  *len = 0;
+
+  /* The compressed bytes containing the block, and the made-up stream:
+     header, block, end of stream magic and CRC (80 bits), padding.  */
+  raw_len = (shift + nbits + 7) >> 3;
+  in_len  = BZIP2_HEADER_SIZE + ((nbits + 80 + 7) >> 3);
+  raw = calloc (raw_len + 1, 1);
+  in  = calloc (in_len, 1);
+  if (!raw || !in)
+  {
+    err = ENOMEM;
+    goto end;
+  }
+
+  err = store_simple_read (source, 0, BZIP2_HEADER_SIZE, in, &read);
+  if (!err && (read != BZIP2_HEADER_SIZE))
+    err = EIO;
+  if (!err)
+    err = store_simple_read (source, start >> 3, raw_len, raw, &read);
+  if (!err && (read != raw_len))
+    err = EIO;
+  if (err)
+    goto end;
+
+  /* Copy the block so that it is byte-aligned, and only the block */
+  for (i = 0; i < (nbits + 7) >> 3; i++)
+    in[BZIP2_HEADER_SIZE + i] = (raw[i] << shift) | (raw[i + 1] >> (8 - shift));
+  if (nbits & 7)
+    in[BZIP2_HEADER_SIZE + (nbits >> 3)] &= 0xff << (8 - (nbits & 7));
+
+  /* The stream's CRC is that of its only block, which comes right
+     after the block magic.  */
+  crc = ((uint32_t) in[BZIP2_HEADER_SIZE + 6] << 24)
+	| (in[BZIP2_HEADER_SIZE + 7] << 16)
+	| (in[BZIP2_HEADER_SIZE + 8] << 8)
+	| in[BZIP2_HEADER_SIZE + 9];
+
+  bit = nbits;
+  put_bits (&in[BZIP2_HEADER_SIZE], &bit, BZIP2_EOS_MAGIC, 48);
+  put_bits (&in[BZIP2_HEADER_SIZE], &bit, crc, 32);
+
+  /* Decompress it */
+  bzero (&stream, sizeof (stream));
+  zerr = BZ2_bzDecompressInit (&stream, 0, 0);
+  err = bzip2_error (&stream, zerr);
+  if (err)
+    goto end;
+
+  stream.next_in  = (char *) in;
+  stream.avail_in = in_len;
+  size = (in[3] - '0') * 100000;
+
+  while (1)
+  {
+    char *new = realloc (out, size);
+    if (!new)
+    {
+      err = ENOMEM;
+      break;
+    }
+    out = new;
+
+    stream.next_out  = &out[*len];
+    stream.avail_out = size - *len;
+
+    zerr = BZ2_bzDecompress (&stream);
+    *len = size - stream.avail_out;
+
+    if (zerr == BZ_STREAM_END)
+      break;
+
+    err = bzip2_error (&stream, zerr);
+    if (err)
+      break;
+
+    if (stream.avail_out)
+    {
+      /* Input exhausted before the end of stream */
+      err = EIO;
+      break;
+    }
+
+    /* Runs of identical bytes may well expand further */
+    size <<= 1;
+  }
+
+  BZ2_bzDecompressEnd (&stream);
+
+ end:
+  free (raw);
+  free (in);
+
+  if (err)
+  {
+    free (out);
+    *len = 0;
+  }
+  else
+    *buf = out;
+
+  return err;
+}
+
+/* Compresses CHUNK into a single bzip2 block, which is meant to be part of
+   a larger stream.  This is done by compressing it as a stream of its own,
+   from which the block is then extracted.  */
+static error_t
+bzip2_compress_chunk (struct chunk *chunk)
+{
+  error_t err;
+  int zerr;
+  bz_stream stream;
+  char **block;
+  uchar *out;
+  size_t size, done, len, bits = 0, end;
+  int pad;
+
+  bzero (&stream, sizeof (stream));
+  zerr = BZ2_bzCompressInit (&stream, BZIP2_BLOCK_SIZE, 0, 0);
+  err = bzip2_error (&stream, zerr);
+  if (err)
+    return err;
+
+  /* This is enough according to bzlib's documentation */
+  size = chunk->len + chunk->len / 100 + 600;
+  out = malloc (size);
+  if (!out)
+    err = ENOMEM;
+
+  stream.next_out  = (char *) out;
+  stream.avail_out = size;
+
+  for (done = 0, block = chunk->blocks;
+       (!err) && (done < chunk->len);
+       done += len, block++)
+  {
+    len = MIN (chunk->len - done, CACHE_BLOCK_SIZE);
+
+    stream.next_in  = *block;
+    stream.avail_in = len;
+
+    zerr = BZ2_bzCompress (&stream, BZ_RUN);
+    err = bzip2_error (&stream, zerr);
+    if (!err && stream.avail_in)
+      err = EIO;
+  }
+
+  if (!err)
+  {
+    zerr = BZ2_bzCompress (&stream, BZ_FINISH);
+    if (zerr != BZ_STREAM_END)
+      err = (zerr == BZ_FINISH_OK) ? EIO : bzip2_error (&stream, zerr);
+  }
+
+  /* Look for the end of stream magic number and CRC (80 bits) at the end
+     of the output, followed by up to 7 bits of padding.  A one-block
+     stream's CRC is that of its block, which helps making sure that this
+     is really the end of the block.  */
+  for (pad = 0, end = (size - stream.avail_out) << 3;
+       (!err) && (pad < 8);
+       pad++, end--)
+  {
+    if ((end < ((BZIP2_HEADER_SIZE << 3) + 80))
+	|| (get_bits (out, end - 80, 48) != BZIP2_EOS_MAGIC))
+      continue;
+
+    chunk->crc = get_bits (out, end - 32, 32);
+    bits = end - 80 - (BZIP2_HEADER_SIZE << 3);
+
+    if ((!bits)
+	|| ((bits > 80)
+	    && (get_bits (out, BZIP2_HEADER_SIZE << 3, 48) == BZIP2_BLOCK_MAGIC)
+	    && (get_bits (out, (BZIP2_HEADER_SIZE << 3) + 48, 32)
+		== chunk->crc)))
+      break;
+  }
+
+  if (!err && (pad == 8))
+    /* Not a single block */
+    err = EIO;
+
+  BZ2_bzCompressEnd (&stream);
+
+  if (err)
+  {
+    free (out);
+    return err;
+  }
+
+  /* Keep only the block, which starts right after the header */
+  memmove (out, &out[BZIP2_HEADER_SIZE], (bits + 7) >> 3);
+  chunk->data = out;
+  chunk->bits = bits;
+
+  return 0;
+}
+
+/* Writes the header of a stream compressed by chunks by calling PUT.  */
+static error_t
+bzip2_chunk_begin (error_t (* put) (const void *data, size_t bits))
+{
+  char header[BZIP2_HEADER_SIZE] = { 'B', 'Z', 'h', '0' + BZIP2_BLOCK_SIZE };
+
+  return put (header, BZIP2_HEADER_SIZE << 3);
+}
+
+/* Writes the end of a stream compressed by chunks, whose CRC is CRC, by
+   calling PUT.  */
+static error_t
+bzip2_chunk_end (uint32_t crc, error_t (* put) (const void *data, size_t bits))
+{
+  uchar buf[10];
+  size_t bit = 0;
+
+  bzero (buf, sizeof (buf));
+  put_bits (buf, &bit, BZIP2_EOS_MAGIC, 48);
+  put_bits (buf, &bit, crc, 32);
+
+  return put (buf, bit);
+}
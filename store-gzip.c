@@ -23,7 +23,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <stdint.h>
+#include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <zlib.h>
 #include <error.h>
 
@@ -31,6 +34,9 @@
 #include <hurd/store.h>
 
 #include "zipstores.h"
+#include "workers.h"
+#include "slab.h"
+#include "radix.h"
 
 #ifndef DEBUG_ZIP
 # undef DEBUG
@@ -74,12 +80,28 @@ static error_t gzip_verify_crc (z_stream *stream, uLong crc);
 static error_t gzip_write_suffix (z_stream *stream, uLong crc,
 				  error_t (* write) (char *buf, size_t amount));
 
+struct checkpoint;
+
+static error_t gzip_save_window (z_stream *stream, struct checkpoint *point);
+
+static error_t gzip_restore_checkpoint (z_stream *stream, struct store *source,
+					const struct checkpoint *point);
+
+struct chunk;
+
+static error_t gzip_compress_chunk (struct chunk *chunk);
+
+static error_t gzip_chunk_end (uLong crc, size_t size,
+			       error_t (* put) (const void *data, size_t bits));
+
 
 /* The following macros are defined to be then used by the zip store generic
    code included below.  */
 #define ZIP_TYPE  gzip
 
-#define ZIP_DECOMPRESS(Stream)       inflate ((Stream), Z_SYNC_FLUSH)
+/* Z_BLOCK makes inflate () return at the end of each deflate block so
+   that decompression checkpoints can be recorded (see below).  */
+#define ZIP_DECOMPRESS(Stream)       inflate ((Stream), Z_BLOCK)
 
 /* windowBits is passed < 0 to tell that there is no zlib header.
    Note that in this case inflate *requires* an extra "dummy" byte
@@ -96,6 +118,9 @@ static error_t gzip_write_suffix (z_stream *stream, uLong crc,
 
 #define ZIP_COMPRESS_FINISH(Stream)  deflate ((Stream), Z_FINISH)
 
+/* Used to make checkpoints while compressing (see ZIP (stream_write)) */
+#define ZIP_COMPRESS_FLUSH(Stream)   deflate ((Stream), Z_FULL_FLUSH)
+
 /* windowBits is passed < 0 to suppress zlib header */
 #define ZIP_COMPRESS_INIT(Stream)    deflateInit2 ((Stream), \
 						    Z_DEFAULT_COMPRESSION, \
@@ -110,6 +135,34 @@ static error_t gzip_write_suffix (z_stream *stream, uLong crc,
 
 #define ZIP_CRC_VERIFY(Stream, Crc)   gzip_verify_crc (Stream, Crc)
 
+/* Decompression checkpoints can be recorded at deflate block boundaries
+   (except within the last block), as explained in zlib's examples/zran.c.
+   The number of bits of the last byte read which belong to the next block
+   is given by the lower bits of `data_type'.  */
+#define ZIP_HAS_CHECKPOINTS
+#define ZIP_AT_CHECKPOINT(Stream)    (((Stream)->data_type & 128) \
+				      && !((Stream)->data_type & 64))
+#define ZIP_CHECKPOINT_BITS(Stream)  ((Stream)->data_type & 7)
+#define ZIP_CHECKPOINT_SAVE(Stream, Point) \
+  gzip_save_window ((Stream), (Point))
+#define ZIP_CHECKPOINT_RESTORE(Stream, Source, Point) \
+  gzip_restore_checkpoint ((Stream), (Source), (Point))
+
+/* As with pigz, the stream can be compressed by chunks in parallel: each
+   chunk is primed with the 32 KiB of data preceding it and, unless it is
+   the last one, flushed onto a byte boundary without terminating the
+   stream, so that the chunks can simply be concatenated.  Their CRCs are
+   then combined.  */
+#define ZIP_HAS_CHUNKS
+#define ZIP_CHUNK_SIZE               (128 << 10)
+#define ZIP_CHUNK_DICT               (1 << MAX_WBITS)
+#define ZIP_CHUNK_COMPRESS(Chunk)    gzip_compress_chunk ((Chunk))
+#define ZIP_CHUNK_CRC_COMBINE(Crc, ChunkCrc, Len) \
+  crc32_combine ((Crc), (ChunkCrc), (Len))
+#define ZIP_CHUNK_BEGIN(Put)         0	/* The header is already there */
+#define ZIP_CHUNK_END(Crc, Size, Put) \
+  gzip_chunk_end ((Crc), (Size), (Put))
+
 /* Zlib constants */
 #define ZIP_HAS_HEADER
 #define ZIP_STREAM                   z_stream
@@ -327,16 +380,11 @@ gzip_verify_crc (z_stream *stream, uLong crc)
   return err;
 }
 
-/* Write a gzip suffix: CRC (4 bytes) and uncompressed stream length
-   (4 bytes).  WRITE is called to actually write the suffix.  Assume that
-   STREAM is opened for compression.  */
-static error_t
-gzip_write_suffix (z_stream *stream, uLong crc,
-                   error_t (* write) (char *buf, size_t amount))
+/* Fill BUF with a gzip suffix: CRC (4 bytes) and uncompressed stream
+   length TOTAL (4 bytes).  */
+static void
+gzip_make_suffix (uLong crc, size_t total, char buf[8])
 {
-  char buf[8];
-  size_t total = stream->total_in;
-
   buf[0] = (crc & 0xff);
   buf[1] = (crc >>  8) & 0xff;
   buf[2] = (crc >> 16) & 0xff;
@@ -345,10 +393,81 @@ gzip_write_suffix (z_stream *stream, uLong crc,
   buf[5] = (total >>  8) & 0xff;
   buf[6] = (total >> 16) & 0xff;
   buf[7] = (total >> 24) & 0xff;
+}
+
+/* Write a gzip suffix.  WRITE is called to actually write the suffix.
+   Assume that STREAM is opened for compression.  */
+static error_t
+gzip_write_suffix (z_stream *stream, uLong crc,
+                   error_t (* write) (char *buf, size_t amount))
+{
+  char buf[8];
+
+  gzip_make_suffix (crc, stream->total_in, buf);
 
   return write (buf, 8);
 }
 
+/* Save STREAM's sliding window into checkpoint POINT.  */
+static error_t
+gzip_save_window (z_stream *stream, struct checkpoint *point)
+{
+  int zerr;
+  uInt len = 1 << MAX_WBITS;
+
+  point->window = malloc (len);
+  if (!point->window)
+    return ENOMEM;
+
+  zerr = inflateGetDictionary (stream, (Bytef *) point->window, &len);
+  point->window_len = len;
+
+  return gzip_error (stream, zerr);
+}
+
+/* Prepare STREAM, which has just been initialized, to resume decompression
+   at checkpoint POINT of the compressed stream contained in SOURCE.  */
+static error_t
+gzip_restore_checkpoint (z_stream *stream, struct store *source,
+			 const struct checkpoint *point)
+{
+  error_t err;
+  int zerr;
+
+  if (point->bits)
+  {
+    /* The block starts within the byte preceding POINT->FILE_OFFS:
+       feed inflate with its upper POINT->BITS bits.  */
+    unsigned char byte;
+    size_t len;
+
+    err = store_simple_read (source, point->file_offs - 1, 1, &byte, &len);
+    if (!err && (len != 1))
+      err = EIO;
+    if (err)
+      return err;
+
+    zerr = inflatePrime (stream, point->bits, byte >> (8 - point->bits));
+    err = gzip_error (stream, zerr);
+    if (err)
+      return err;
+  }
+
+  if (point->window_len)
+  {
+    zerr = inflateSetDictionary (stream, (Bytef *) point->window,
+				 point->window_len);
+    err = gzip_error (stream, zerr);
+    if (err)
+      return err;
+  }
+
+  /* Make gzip_verify_crc ()'s length check account for what we skipped */
+  stream->total_out = point->zip_offs;
+
+  return 0;
+}
+
 /* Write a simple gzip header.  WRITE is the method called to actually
    write the header.  Note: The header format being almost
    completely undocumented: FIXME.  */
@@ -364,3 +483,81 @@ gzip_write_header (error_t (* write) (char *buf, size_t amount))
 
   return write ((char *)&hdr, GZIP_HEADER_SIZE);
 }
+
+/* Compress CHUNK into a sequence of raw deflate blocks.  Unless CHUNK is
+   the last one, the output is flushed onto a byte boundary without ending
+   the stream so that the next chunk can be appended to it.  */
+static error_t
+gzip_compress_chunk (struct chunk *chunk)
+{
+  error_t err;
+  int zerr;
+  z_stream stream;
+  char **block;
+  size_t size, done, len;
+
+  bzero (&stream, sizeof (stream));
+  zerr = ZIP_COMPRESS_INIT (&stream);
+  err = gzip_error (&stream, zerr);
+  if (err)
+    return err;
+
+  if (chunk->dict_len)
+  {
+    zerr = deflateSetDictionary (&stream, (Bytef *) chunk->dict,
+				 chunk->dict_len);
+    err = gzip_error (&stream, zerr);
+  }
+
+  /* Leave room for the empty stored block written by Z_SYNC_FLUSH */
+  size = deflateBound (&stream, chunk->len) + 16;
+  chunk->data = malloc (size);
+  if (!chunk->data)
+    err = ENOMEM;
+
+  stream.next_out  = chunk->data;
+  stream.avail_out = size;
+  chunk->crc = crc32 (0, NULL, 0);
+
+  for (done = 0, block = chunk->blocks;
+       (!err) && (done < chunk->len);
+       done += len, block++)
+  {
+    len = MIN (chunk->len - done, CACHE_BLOCK_SIZE);
+    chunk->crc = crc32 (chunk->crc, (Bytef *) *block, len);
+
+    stream.next_in  = (Bytef *) *block;
+    stream.avail_in = len;
+
+    zerr = deflate (&stream, Z_NO_FLUSH);
+    err = gzip_error (&stream, zerr);
+    if (!err && stream.avail_in)
+      /* Should not happen given deflateBound () */
+      err = EIO;
+  }
+
+  if (!err)
+  {
+    zerr = deflate (&stream, chunk->last ? Z_FINISH : Z_SYNC_FLUSH);
+    if (chunk->last ? (zerr != Z_STREAM_END) : (!stream.avail_out))
+      err = zerr == Z_OK ? EIO : gzip_error (&stream, zerr);
+  }
+
+  chunk->bits = stream.total_out << 3;
+  deflateEnd (&stream);
+
+  return err;
+}
+
+/* Write the suffix of a stream compressed by chunks, of SIZE bytes and
+   whose CRC is CRC, by calling PUT.  */
+static error_t
+gzip_chunk_end (uLong crc, size_t size,
+		error_t (* put) (const void *data, size_t bits))
+{
+  char buf[8];
+
+  gzip_make_suffix (crc, size, buf);
+
+  return put (buf, sizeof (buf) << 3);
+}
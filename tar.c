@@ -32,6 +32,9 @@
 #include <string.h>
 #include <hurd/netfs.h>
 #include <hurd/store.h>
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
 
 #include "tar.h"
 #include "names.h"
@@ -39,77 +42,248 @@
 #include "debug.h"
 
 /* A hook which is called each time a header has been parsed. */
-int (*tar_header_hook) (tar_record_t *, off_t) = NULL;
+int (*tar_header_hook) (tar_header_t *, off_t) = NULL;
 
 
-#define	isodigit(c)	( ((c) >= '0') && ((c) <= '7') )
+#ifndef MIN
+# define MIN(A,B)  ((A) < (B) ? (A) : (B))
+#endif
+#ifndef MAX
+# define MAX(A,B)  ((A) > (B) ? (A) : (B))
+#endif
 
 #ifndef isspace
 # define isspace(c)      ( (c) == ' ' )
 #endif
 
 /*
- * Quick and dirty octal conversion.
+ * Quick and dirty octal conversion.  Values which don't fit are stored
+ * in base 256 by GNU tar: the high bit of the first byte is then set, the
+ * next one being the sign bit, and the field is a big-endian number.
  *
  * Result is -1 if the field is invalid (all blank, or nonoctal).
  */
-static long
+static long long
 from_oct (int digs, char *where)
 {
-  register long value;
+  register const unsigned char *p = (const unsigned char *) where;
+  register long long value;
+  register unsigned d;
+
+  if (*p & 0x80)
+    {				/* Base 256 */
+      value = (*p & 0x3f) - (*p & 0x40);
+      while (--digs > 0)
+	value = value * 256 + *++p;
+      return value;
+    }
 
-  while (isspace (*where))
+  while (isspace (*p))
     {				/* Skip spaces */
-      where++;
+      p++;
       if (--digs <= 0)
 	return -1;		/* All blank field */
     }
   value = 0;
-  while (digs > 0 && isodigit (*where))
-    {				/* Scan till nonoctal */
-      value = (value << 3) | (*where++ - '0');
-      --digs;
-    }
+  for (; digs > 0 && (d = *p - '0') < 8; digs--, p++)
+    value = (value << 3) | d;	/* Scan till nonoctal */
 
-  if (digs > 0 && *where && !isspace (*where))
+  if (digs > 0 && *p && !isspace (*p))
     return -1;			/* Ended on non-space/nul */
 
   return value;
 }
 
+/* Decode the numeric field FIELD of a header.  */
+#define FROM_OCT(field)	from_oct (sizeof (field), (field))
+
+/*
+ * Compute the checksum of RECORD, counting its "chksum" field as blanks,
+ * both the standard way (unsigned bytes) into SUM and the way some old
+ * tars do (signed bytes) into SIGNED_SUM.
+ */
+static void
+checksum (tar_record_t *record, long *sum, long *signed_sum)
+{
+  register const unsigned char *p = (const unsigned char *) record->charptr;
+  register unsigned long total, high;
+  int i;
+
+#ifdef __SSE2__
+  /* Sum 16 bytes at a time, as well as their high bits */
+  __m128i zero = _mm_setzero_si128 ();
+  __m128i mask = _mm_set1_epi8 (0x80);
+  __m128i t = zero, h = zero;
+
+  for (i = 0; i < RECORDSIZE; i += 16)
+    {
+      __m128i x = _mm_loadu_si128 ((const __m128i *) &p[i]);
+      t = _mm_add_epi64 (t, _mm_sad_epu8 (x, zero));
+      h = _mm_add_epi64 (h, _mm_sad_epu8 (_mm_and_si128 (x, mask), zero));
+    }
+
+  total = _mm_cvtsi128_si32 (t) + _mm_cvtsi128_si32 (_mm_srli_si128 (t, 8));
+  high = (_mm_cvtsi128_si32 (h) + _mm_cvtsi128_si32 (_mm_srli_si128 (h, 8)))
+	 >> 7;
+#else
+  /* Sum a word at a time: the even and odd bytes are added to 16-bit
+     lanes, which can't overflow over a record, and the high bits to byte
+     lanes.  The lanes are added up at the end.  */
+  const unsigned long even = ~0UL / 0xffff * 0xff;
+  const unsigned long ones = ~0UL / 0xff;
+  unsigned long w, lanes = 0, highs = 0;
+
+  for (i = 0; i < RECORDSIZE; i += sizeof (w))
+    {
+      memcpy (&w, &p[i], sizeof (w));
+      lanes += (w & even) + ((w >> 8) & even);
+      highs += (w >> 7) & ones;
+    }
+
+  for (total = 0; lanes; lanes >>= 16)
+    total += lanes & 0xffff;
+  for (high = 0; highs; highs >>= 8)
+    high += highs & 0xff;
+#endif
+
+  /* Adjust checksum to count the "chksum" field as blanks. */
+  p = (const unsigned char *) record->header.chksum;
+  for (i = 0; i < sizeof (record->header.chksum); i++)
+    {
+      total -= p[i];
+      high -= p[i] >> 7;
+    }
+  total += ' ' * sizeof (record->header.chksum);
+
+  /* A byte whose high bit is set counts 256 less when signed */
+  *sum = total;
+  *signed_sum = total - 256 * high;
+}
+
 /* As we open one archive at a time, it is safe to have this static */
 static store_offset_t current_tar_position = 0;
 
 static tar_record_t rec_buf;
 
+/* Records are read by windows of WINDOW_MIN to WINDOW_MAX bytes rather
+   than one at a time.  File contents are skipped by moving on to the next
+   header, so those which lie beyond the current window are never read.
+   When the end of a window gets skipped (i.e. a large file follows), the
+   next one is shrunk to the part of it which was actually used; it is
+   doubled when a window gets consumed entirely.  The
+   window is either WINDOW_BUF or the memory returned by the store, which
+   is kept as is rather than copied.  */
+#define WINDOW_MIN	(16 * RECORDSIZE)
+#define WINDOW_MAX	(1024 * 1024)
+
+static char *window_buf = NULL;
+static char *window = NULL;
+static store_offset_t window_start = 0;
+static size_t window_len = 0;
+static size_t window_size = WINDOW_MAX;
+
+/* Number of bytes of the window up to the end of the last record read.  */
+static size_t window_used = 0;
+
+/* Non-zero if the end of the archive is the end of the window.  Stores
+   may return less than they were asked for, so this is only the case
+   when a read returns nothing or reaches the end of the store.  */
+static int window_eof = 0;
+
+/* Unmap the current window if it was allocated by the store.  */
+static void
+release_window (void)
+{
+  if (window && (window != window_buf))
+    munmap (window, window_len);
+  window = NULL;
+  window_len = 0;
+}
 
-static tar_record_t *
-get_next_record (struct store *tar_file)
+/* Read a new window starting at CURRENT_TAR_POSITION.  */
+static void
+fill_window (struct store *tar_file)
 {
   error_t err;
   size_t n;
   void *buf;
 
-  debug (("Reading at offset %lli", current_tar_position));
-  buf = rec_buf.charptr;
-  err = store_read (tar_file, current_tar_position, RECORDSIZE, &buf, &n);
+  if (window_len)
+    {
+      if (current_tar_position > window_start + window_len)
+	window_size = MAX (((window_used + WINDOW_MIN - 1) / WINDOW_MIN)
+			   * WINDOW_MIN, WINDOW_MIN);
+      else
+	window_size = MIN (window_size * 2, WINDOW_MAX);
+    }
+
+  release_window ();
+
+  debug (("Reading %u bytes at offset %lli", window_size,
+	  current_tar_position));
+  buf = window_buf;
+  err = store_read (tar_file, current_tar_position, window_size, &buf, &n);
 
   if (err)
     error (1, err, "Read error (offset=%lli)", current_tar_position);
-  assert (n <= RECORDSIZE);
+  assert (n <= window_size);
+
+  window = buf;
+  window_start = current_tar_position;
+  window_len = n;
+  window_used = 0;
 
-  if (buf != rec_buf.charptr)
+  /* Make sure a short read holds a whole record, lest the rest of the
+     archive be taken for garbage.  */
+  while ((n > 0) && (window_len < RECORDSIZE)
+	 && (window_start + window_len < tar_file->size))
     {
-      memcpy (rec_buf.charptr, buf, n);
-      munmap (buf, n);
+      if (window != window_buf)
+	{
+	  memcpy (window_buf, window, window_len);
+	  munmap (window, window_len);
+	  window = window_buf;
+	}
+
+      buf = window_buf + window_len;
+      err = store_read (tar_file, window_start + window_len,
+			RECORDSIZE - window_len, &buf, &n);
+      if (err)
+	error (1, err, "Read error (offset=%lli)", window_start + window_len);
+      assert (n <= RECORDSIZE - window_len);
+
+      if (buf != window_buf + window_len)
+	{
+	  memcpy (window_buf + window_len, buf, n);
+	  munmap (buf, n);
+	}
+      window_len += n;
     }
 
-  if (n != RECORDSIZE)
-    return NULL;		/* An error has occurred */
+  window_eof = (n == 0) || (window_start + window_len >= tar_file->size);
+}
 
-  current_tar_position += n;
+static tar_record_t *
+get_next_record (struct store *tar_file)
+{
+  tar_record_t *record;
 
-  return &rec_buf;
+  if ((current_tar_position < window_start)
+      || (current_tar_position + RECORDSIZE > window_start + window_len))
+    {
+      if (window_eof && (current_tar_position >= window_start))
+	return NULL;		/* End of the archive */
+
+      fill_window (tar_file);
+      if (window_len < RECORDSIZE)
+	return NULL;		/* An error has occurred */
+    }
+
+  record = (tar_record_t *) &window[current_tar_position - window_start];
+  current_tar_position += RECORDSIZE;
+  window_used = current_tar_position - window_start;
+
+  return record;
 }
 
 static void
@@ -118,68 +292,97 @@ skip_n_records (struct store *tar_file, int n)
   current_tar_position += n * RECORDSIZE;
 }
 
+/*
+ * Decode RECORD, a header whose checksum is valid, into HEADER.
+ */
 void
-tar_header2stat (io_statbuf_t *st, tar_record_t *header)
+tar_decode_header (tar_header_t *header, tar_record_t *record)
 {
-  st->st_mode = from_oct (8, header->header.mode);
+  size_t len;
+
+  memcpy (header->name, record->header.arch_name, NAMSIZ);
+  header->name[NAMSIZ] = '\0';
+  memcpy (header->linkname, record->header.arch_linkname, NAMSIZ);
+  header->linkname[NAMSIZ] = '\0';
+
+  /*
+   * linkflag on BSDI tar (pax) always '\000'
+   */
+  header->linkflag = record->header.linkflag;
+  len = strlen (header->name);
+  if (header->linkflag == '\000' && len && header->name[len - 1] == '/')
+    header->linkflag = LF_DIR;
 
-  /* Adjust st->st_mode because there are tar-files with
+  header->mode = FROM_OCT (record->header.mode);
+
+  /* Adjust the mode because there are tar-files with
    * linkflag==LF_SYMLINK and S_ISLNK(mod)==0. I don't 
    * know about the other modes but I think I cause no new
    * problem when I adjust them, too. -- Norbert.
    */
-  if (header->header.linkflag == LF_DIR)
-    {
-      st->st_mode |= S_IFDIR;
-    }
-  else if (header->header.linkflag == LF_SYMLINK)
-    {
-      st->st_mode |= S_IFLNK;
-    }
-  else if (header->header.linkflag == LF_CHR)
-    {
-      st->st_mode |= S_IFCHR;
-    }
-  else if (header->header.linkflag == LF_BLK)
-    {
-      st->st_mode |= S_IFBLK;
-    }
-  else if (header->header.linkflag == LF_FIFO)
+  switch (header->linkflag)
     {
-      st->st_mode |= S_IFIFO;
+    case LF_DIR:
+      header->mode |= S_IFDIR;
+      break;
+    case LF_SYMLINK:
+      header->mode |= S_IFLNK;
+      break;
+    case LF_CHR:
+      header->mode |= S_IFCHR;
+      break;
+    case LF_BLK:
+      header->mode |= S_IFBLK;
+      break;
+    case LF_FIFO:
+      header->mode |= S_IFIFO;
+      break;
+    default:
+      header->mode |= S_IFREG;
     }
-  else
-    st->st_mode |= S_IFREG;
 
-  st->st_rdev = 0;
-  if (!strcmp (header->header.magic, TMAGIC))
+  header->rdev = 0;
+  if (!strcmp (record->header.magic, TMAGIC))
     {
-      st->st_uid = *header->header.uname ? finduid (header->header.uname) :
-	from_oct (8, header->header.uid);
-      st->st_gid = *header->header.gname ? findgid (header->header.gname) :
-	from_oct (8, header->header.gid);
-      switch (header->header.linkflag)
+      header->uid = *record->header.uname
+	? finduid (record->header.uname) : FROM_OCT (record->header.uid);
+      header->gid = *record->header.gname
+	? findgid (record->header.gname) : FROM_OCT (record->header.gid);
+      switch (header->linkflag)
 	{
 	case LF_BLK:
 	case LF_CHR:
-	  st->st_rdev = (from_oct (8, header->header.devmajor) << 8) |
-	    from_oct (8, header->header.devminor);
+	  header->rdev = (FROM_OCT (record->header.devmajor) << 8) |
+	    FROM_OCT (record->header.devminor);
 	}
     }
   else
     {				/* Old Unix tar */
-      st->st_uid = from_oct (8, header->header.uid);
-      st->st_gid = from_oct (8, header->header.gid);
+      header->uid = FROM_OCT (record->header.uid);
+      header->gid = FROM_OCT (record->header.gid);
     }
-  //st->st_size = hstat.st_size;
-  st->st_size  = from_oct (1 + 12, header->header.size);
+
+  header->size  = FROM_OCT (record->header.size);
+  header->mtime = FROM_OCT (record->header.mtime);
+  header->atime = FROM_OCT (record->header.atime);
+  header->ctime = FROM_OCT (record->header.ctime);
+}
+
+void
+tar_header2stat (io_statbuf_t *st, tar_header_t *header)
+{
+  st->st_mode = header->mode;
+  st->st_uid = header->uid;
+  st->st_gid = header->gid;
+  st->st_rdev = header->rdev;
+  st->st_size = header->size;
   if (st->st_size > 0)
     st->st_blocks = ((st->st_size - 1) / 512) + 1;
   else
     st->st_blocks = 0;
-  st->st_mtime = from_oct (1 + 12, header->header.mtime);
-  st->st_atime = from_oct (1 + 12, header->header.atime);
-  st->st_ctime = from_oct (1 + 12, header->header.ctime);
+  st->st_mtime = header->mtime;
+  st->st_atime = header->atime;
+  st->st_ctime = header->ctime;
 }
 
 
@@ -189,63 +392,50 @@ typedef enum
   STATUS_SUCCESS,
   STATUS_EOFMARK,
   STATUS_EOF,
+  STATUS_CONTINUE,
 }
 ReadStatus;
+
+/* Number of bytes (file contents) to skip before the next record.  */
+static store_offset_t data_to_skip = 0;
+
+/* When non-zero, the next record is a sparse file's extended header, and
+   the file contents (EXT_DATA_SIZE bytes) follow the last one.  */
+static int ext_pending = 0;
+static store_offset_t ext_data_size = 0;
+
 /*
- * Return 1 for success, 0 if the checksum is bad, EOF on eof,
- * 2 for a record full of zeros (EOF marker).
+ * Parse HEADER, the record that was just read, the next one being at
+ * CURRENT_TAR_POSITION.  Return STATUS_SUCCESS when a header has been
+ * parsed, STATUS_BADCHECKSUM if the checksum is bad, STATUS_EOFMARK for
+ * a record full of zeros (EOF marker) or STATUS_CONTINUE if more records
+ * are needed to complete the current header.  In any case, DATA_TO_SKIP
+ * is set to the number of bytes to skip before the next record.
  *
  */
 static ReadStatus
-read_header (struct store *tar_file)
+parse_record (tar_record_t *header)
 {
-  register int i;
-  register long sum, signed_sum, recsum;
-  register char *p;
-  register tar_record_t *header;
-  char *data;
-  int size, written;
-  static char *next_lonname = NULL, *next_lonlink = NULL;
-  char *current_file_name, *current_link_name;
-  struct stat hstat;		/* Stat struct corresponding */
-  char arch_name[NAMSIZ + 1];
-  char arch_linkname[NAMSIZ + 1];
-
-  memcpy (arch_name, header->header.arch_name, NAMSIZ);
-  arch_name [NAMSIZ] = '\0';
-  memcpy (arch_linkname, header->header.arch_linkname, NAMSIZ);
-  arch_linkname [NAMSIZ] = '\0';
-
+  /* The header being parsed, as passed to TAR_HEADER_HOOK */
+  static tar_header_t decoded;
+  long sum, signed_sum, recsum;
+  store_offset_t size;
 
-recurse:
+  data_to_skip = 0;
 
-  header = get_next_record (tar_file);
-  if (NULL == header)
-    return STATUS_EOF;
-
-  recsum = from_oct (8, header->header.chksum);
-
-  sum = 0;
-  signed_sum = 0;
-  p = header->charptr;
-  for (i = sizeof (*header); --i >= 0;)
+  if (ext_pending)
     {
-      /*
-       * We can't use unsigned char here because of old compilers,
-       * e.g. V7.
-       */
-      signed_sum += *p;
-      sum += 0xFF & *p++;
-    }
+      /* Sparse file map: the file contents come after the last one */
+      if (header->ext_hdr.isextended)
+	return STATUS_CONTINUE;
 
-  /* Adjust checksum to count the "chksum" field as blanks. */
-  for (i = sizeof (header->header.chksum); --i >= 0;)
-    {
-      sum -= 0xFF & header->header.chksum[i];
-      signed_sum -= (char) header->header.chksum[i];
+      ext_pending = 0;
+      data_to_skip = ext_data_size;
+      return STATUS_SUCCESS;
     }
-  sum += ' ' * sizeof header->header.chksum;
-  signed_sum += ' ' * sizeof header->header.chksum;
+
+  recsum = FROM_OCT (header->header.chksum);
+  checksum (header, &sum, &signed_sum);
 
   /*
    * This is a zeroed record...whole record is 0's except
@@ -257,93 +447,126 @@ recurse:
   if (sum != recsum && signed_sum != recsum)
     return STATUS_BADCHECKSUM;
 
-  /*
-   * linkflag on BSDI tar (pax) always '\000'
-   */
-
-  if (header->header.linkflag == '\000' &&
-      strlen (arch_name) &&
-      arch_name[strlen (arch_name) - 1] == '/')
-    header->header.linkflag = LF_DIR;
+  if (header->header.linkflag == LF_LONGNAME
+      || header->header.linkflag == LF_LONGLINK)
+    {
+      /* Long names are not supported: skip them and go on with the
+         header that follows.  */
+      size = FROM_OCT (header->header.size);
+      data_to_skip = ((size + RECORDSIZE - 1) / RECORDSIZE) * RECORDSIZE;
+      return STATUS_CONTINUE;
+    }
 
   /*
-   * Good record.  Decode file size and return.
+   * Good record.  Decode it, including the file size, and return.
    */
-  if (header->header.linkflag == LF_LINK || header->header.linkflag == LF_DIR)
-    hstat.st_size = 0;		/* Links 0 size on tape */
+  tar_decode_header (&decoded, header);
+
+  if (decoded.linkflag == LF_LINK || decoded.linkflag == LF_DIR)
+    size = 0;		/* Links 0 size on tape */
   else
-    hstat.st_size = from_oct (1 + 12, header->header.size);
+    size = decoded.size;
 
-  if (header->header.linkflag == LF_LONGNAME
-      || header->header.linkflag == LF_LONGLINK)
+  /* Round SIZE up to a number of records */
+  size = ((size + RECORDSIZE - 1) / RECORDSIZE) * RECORDSIZE;
+
+  if (tar_header_hook)
+    tar_header_hook (&decoded, current_tar_position);
+
+  if (header->header.isextended)
     {
-      for (size = hstat.st_size; size > 0; size -= written)
-	{
-	  data = get_next_record (tar_file)->charptr;
-	  if (data == NULL)
-	    {
-	      error (0, 0, "Unexpected EOF on archive file");
-	      return STATUS_BADCHECKSUM;
-	    }
-	  written = RECORDSIZE;
-	  if (written > size)
-	    written = size;
-	}
-      goto recurse;
+      ext_pending = 1;
+      ext_data_size = size;
+      return STATUS_CONTINUE;
     }
-  else
+
+  data_to_skip = size;
+  return STATUS_SUCCESS;
+}
+
+/*
+ * Read and parse the next header of TAR_FILE.
+ * Return STATUS_SUCCESS for success, STATUS_BADCHECKSUM if the checksum
+ * is bad, STATUS_EOF on eof, STATUS_EOFMARK for a record full of zeros
+ * (EOF marker).
+ *
+ */
+static ReadStatus
+read_header (struct store *tar_file)
+{
+  register tar_record_t *header;
+  ReadStatus status;
+
+  do
     {
-      long data_position;
-      char *p, *q;
-      int len;
-      int isdir = 0;
-
-      current_file_name = (next_lonname
-			   ? next_lonname
-			   : strdup (arch_name));
-      len = strlen (current_file_name);
-      if (current_file_name[len - 1] == '/')
-	{
-	  current_file_name[len - 1] = 0;
-	  isdir = 1;
-	}
+      header = get_next_record (tar_file);
+      if (NULL == header)
+	return STATUS_EOF;
 
+      status = parse_record (header);
+      skip_n_records (tar_file, data_to_skip / RECORDSIZE);
+    }
+  while (status == STATUS_CONTINUE);
 
-      current_link_name = (next_lonlink
-			   ? next_lonlink
-			   : strdup (arch_linkname));
-      len = strlen (current_link_name);
-      if (len && current_link_name[len - 1] == '/')
-	current_link_name[len - 1] = 0;
+  return status;
+}
 
-      next_lonlink = next_lonname = NULL;
+/* Status of the previous header.  */
+static ReadStatus prev_status = STATUS_SUCCESS;
 
-      data_position = current_tar_position;
+/*
+ * Take the appropriate action after a header has been read with status
+ * STATUS.  Return 1 if parsing should go on, 0 if the end of the archive
+ * has been reached, -1 on error.
+ */
+static int
+next_header (ReadStatus status)
+{
+  ReadStatus prev = prev_status;
 
-      p = strrchr (current_file_name, '/');
-      if (p == NULL)
-	{
-	  p = current_file_name;
-	  q = current_file_name + strlen (current_file_name);	/* "" */
-	}
-      else
-	{
-	  *(p++) = 0;
-	  q = current_file_name;
-	}
+  prev_status = status;
 
-      if (tar_header_hook)
-	tar_header_hook (header, current_tar_position);
+  switch (status)
+    {
 
-      free (current_file_name);
+    case STATUS_SUCCESS:
+      return 1;
 
-/*    done: */
-      if (header->header.isextended)
+      /*
+       * Invalid header:
+       *
+       * If the previous header was good, tell them
+       * that we are skipping bad ones.
+       */
+    case STATUS_BADCHECKSUM:
+      switch (prev)
 	{
-	  while (get_next_record (tar_file)->ext_hdr.isextended);
+
+	  /* Error on first record */
+	case STATUS_EOFMARK:
+	  return -1;
+
+	  /* Error after header rec */
+	case STATUS_SUCCESS:
+	  error (0, 0, "Skipping to next header (offset=%lli)",
+		 current_tar_position - RECORDSIZE);
+	  /* FALL THRU */
+
+	  /* Error after error */
+	case STATUS_BADCHECKSUM:
+	  error (1, 0, "Bad checksum (offset=%lli)", current_tar_position);
+	  return -1;
+
+	default:
+	  return 0;
 	}
-      skip_n_records (tar_file, (hstat.st_size + RECORDSIZE - 1) / RECORDSIZE);
-      return STATUS_SUCCESS;
+
+      /* Record of zeroes */
+    case STATUS_EOFMARK:
+      /* FALL THRU */
+
+    default:			/* End of archive */
+      return 0;
     }
 }
 
@@ -354,80 +577,105 @@ recurse:
 int
 tar_open_archive (struct store *tar_file)
 {
-  ReadStatus status = STATUS_EOFMARK;	/* Initial status at start of archive */
-  ReadStatus prev_status = STATUS_SUCCESS;
+  int res;
 
   current_tar_position = 0;
+  data_to_skip = ext_pending = 0;
 
-  for (;;)
-    {
-      prev_status = status;
-      status = read_header (tar_file);
+  window_buf = malloc (WINDOW_MAX);
+  if (! window_buf)
+    error (1, ENOMEM, "Could not allocate the read window");
+  window_start = window_len = window_used = 0;
+  window_size = WINDOW_MAX;
+  window_eof = 0;
+
+  /* Initial status at start of archive */
+  prev_status = STATUS_EOFMARK;
+
+  do
+    res = next_header (read_header (tar_file));
+  while (res > 0);
+
+  release_window ();
+  free (window_buf);
+  window_buf = NULL;
+
+  return res < 0 ? -1 : 0;
+}
+
+
+/* Incremental parsing.  */
+
+/* Number of bytes of the next record found in REC_BUF so far.  */
+static size_t rec_fill = 0;
+
+/* Result of the incremental parsing once it is over, or 1.  */
+static int parse_result = 1;
+
+void
+tar_parse_init (void)
+{
+  current_tar_position = 0;
+  data_to_skip = ext_pending = 0;
+  rec_fill = 0;
+  parse_result = 1;
 
+  /* Initial status at start of archive */
+  prev_status = STATUS_EOFMARK;
+}
+
+void
+tar_parse_data (const void *data, size_t len)
+{
+  const char *p = data;
+
+  while ((len > 0) && (parse_result > 0))
+    {
+      size_t n;
 
-      switch (status)
+      if (data_to_skip)
 	{
+	  /* Skip file contents */
+	  n = MIN (data_to_skip, len);
+	  data_to_skip -= n;
+	  current_tar_position += n;
+	}
+      else
+	{
+	  /* Fill in the next record and parse it when complete */
+	  n = MIN (RECORDSIZE - rec_fill, len);
+	  memcpy (&rec_buf.charptr[rec_fill], p, n);
+	  rec_fill += n;
 
-	case STATUS_SUCCESS:
-	  continue;
-
-	  /*
-	   * Invalid header:
-	   *
-	   * If the previous header was good, tell them
-	   * that we are skipping bad ones.
-	   */
-	case STATUS_BADCHECKSUM:
-	  switch (prev_status)
+	  if (rec_fill == RECORDSIZE)
 	    {
+	      ReadStatus status;
+
+	      rec_fill = 0;
+	      current_tar_position += RECORDSIZE;
 
-	      /* Error on first record */
-	    case STATUS_EOFMARK:
-	      return -1;
-	      /* FALL THRU */
-
-	      /* Error after header rec */
-	    case STATUS_SUCCESS:
-	      prev_status = status;
-	      { 
-	        /* FIXME: Bad hack */
-	        size_t size;
-	        tar_record_t *hdr;
-	        current_tar_position -= RECORDSIZE;
-	        error (0, 0, "Skipping to next header (offset=%lli)",
-	               current_tar_position);
-	        hdr = get_next_record (tar_file);
-	        size = from_oct (8, hdr->header.size);
-	        size = size % RECORDSIZE
-	               ? size / RECORDSIZE
-	               : (size / RECORDSIZE) + RECORDSIZE;
-	        current_tar_position += size;
-	      }
-	        
-	      /* Error after error */
-
-	    case STATUS_BADCHECKSUM:
-	      error (1, 0, "Bad checksum (offset=%lli)", current_tar_position);
-	      return -1;
-
-	    case STATUS_EOF:
-	      return 0;
+	      status = parse_record (&rec_buf);
+	      if (status != STATUS_CONTINUE)
+		parse_result = next_header (status);
 	    }
+	}
 
-	  /* Record of zeroes */
-	case STATUS_EOFMARK:
-	  status = prev_status;	/* If error after 0's */
-	  /* FALL THRU */
+      p += n;
+      len -= n;
+    }
+}
 
-	case STATUS_EOF:	/* End of archive */
-	  break;
-	}
-      break;
-    };
-  return 0;
+int
+tar_parse_end (void)
+{
+  if (parse_result > 0)
+    /* The archive ended without an EOF marker */
+    parse_result = next_header (STATUS_EOF);
+
+  return parse_result < 0 ? -1 : 0;
 }
 
-
+
 /* Create a tar header based on ST and NAME where NAME is a path.
    If NAME is a hard link (resp. symlink), HARDLINK (resp.
    SYMLINK) is the path of NAME's target.
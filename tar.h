@@ -171,8 +171,42 @@ union record {
 
 typedef union record tar_record_t;
 
+/* A header as decoded by the parser, which is passed to TAR_HEADER_HOOK.
+   The hook may modify it.  */
+typedef struct tar_header
+{
+  char name[NAMSIZ + 1];	/* NUL-terminated */
+  char linkname[NAMSIZ + 1];
+  char linkflag;
+  mode_t mode;			/* Including the file type */
+  uid_t uid;
+  gid_t gid;
+  dev_t rdev;
+  off_t size;
+  time_t mtime;
+  time_t atime;
+  time_t ctime;
+} tar_header_t;
+
+/* A hook which is called each time a header has been parsed with the
+   decoded header and the offset of the record that follows it.  */
+extern int (*tar_header_hook) (tar_header_t *, off_t);
+
 extern int  tar_open_archive (struct store *tar_file);
-extern void tar_header2stat (io_statbuf_t *st, tar_record_t *header);
+
+/* Incremental parsing: Instead of calling tar_open_archive (), the archive
+   can be parsed as its contents become available by calling
+   tar_parse_init (), then tar_parse_data () for every chunk of data, in
+   order, and finally tar_parse_end () which returns the same result as
+   tar_open_archive () would have.  */
+extern void tar_parse_init (void);
+extern void tar_parse_data (const void *data, size_t len);
+extern int  tar_parse_end (void);
+extern void tar_header2stat (io_statbuf_t *st, tar_header_t *header);
+
+/* Decodes RECORD, a header whose checksum is valid, into HEADER, the way
+   the parser does before calling TAR_HEADER_HOOK.  */
+extern void tar_decode_header (tar_header_t *header, tar_record_t *record);
 
 /* Create a tar header based on ST and NAME where NAME is a path.
    If NAME is a hard link (resp. symlink), HARDLINK (resp.
@@ -27,6 +27,8 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stdint.h>
+#include <time.h>
 #include <argp.h>
 #include <argz.h>
 
@@ -34,7 +36,9 @@
 #include "tarfs.h"
 #include "fs.h"
 #include "cache.h"
+#include "names.h"
 #include "zipstores.h"
+#include "workers.h"
 #include "debug.h"
 
 /* New netfs variables */
@@ -66,6 +70,24 @@ const struct argp_option fs_options[] =
   { "volatile",     'v', NULL, 0, "Start tarfs volatile "
   				  "(ie writable but not synced)" },
   { "create",       'c', NULL, 0, "Create tar file if not there" },
+  { "cache-size",   'C', "SIZE", 0, "Keep at most SIZE bytes of file contents "
+				  "in memory, not counting modified data "
+				  "(a `k', `M' or `G' suffix may be used)" },
+  { "block-size",   'B', "SIZE", 0, "Cache the contents of large files in "
+				  "blocks of SIZE bytes, smaller files "
+				  "using smaller blocks (default: 64k)" },
+  { "zip-block-size", 'Z', "SIZE", 0, "Cache the uncompressed contents of "
+				  "zipped archives in blocks of SIZE bytes, "
+				  "from 4k to 64k (default: 8k)" },
+  { "spill-high",   'H', "SIZE", 0, "Move modified file contents to a "
+				  "temporary file when there are more than "
+				  "SIZE bytes of them in memory (default: 64M)" },
+  { "spill-low",    'L', "SIZE", 0, "Keep SIZE bytes of modified file "
+				  "contents in memory when doing so "
+				  "(default: three quarters of --spill-high)" },
+  { "stream",       'S', NULL, 0, "When creating an archive, write files "
+				  "to it (and compress them) as soon as "
+				  "they are closed" },
 #if 0
   { "sync",         's', "INTERVAL", 0, "Sync all data not actually written "
 				  "to disk every INTERVAL seconds (by "
@@ -80,15 +102,23 @@ static struct store *tar_file;
 static struct mutex  tar_file_lock;
 
 /* Archive parsing hook (see tar.c) */
-extern int (* tar_header_hook) (tar_record_t *, off_t);
+extern int (* tar_header_hook) (tar_header_t *, off_t);
+
+/* Set when the archive got parsed while its zip store was being opened
+   (see parse_traversed ()).  */
+static int archive_parsed = 0;
 
 /* List of tar items for this file */
 static struct tar_list tar_list;
 
-/* Data used by netfs_get_dirents() */
-static struct node *curr_dir;
-static struct node *curr_node;
-static int    curr_entry = 0;
+/* Streaming (see stream_items ()): set when new items get written to the
+   archive as soon as they are closed.  STREAM_TAR is the last item written
+   so far (NULL if none) and STREAM_OFFS the offset right after it.  */
+static int streaming = 0;
+static struct tar_item *stream_tar = NULL;
+static off_t stream_offs = 0;
+
+static void stream_items (struct node *locked);
 
 /* A convenience macro */
 #define IF_RWFS \
@@ -98,6 +128,9 @@ static int    curr_entry = 0;
 
 #define D(_s) strdup(_s)
 
+/* Amount of file contents written at once when syncing */
+#define SYNC_CHUNK_SIZE  (64 * RECORDSIZE)
+
 /* Open the tar file STORE according to TARFS_OPTIONS.  Assumes the
    store is already locked.  */
 static error_t
@@ -126,6 +159,16 @@ open_store ()
   return err;
 }
 
+/* Traverse hook of the zip stores: Feeds the tar parser with the
+   uncompressed stream so that a compressed archive gets parsed while its
+   store is being opened rather than decompressed once again afterwards.  */
+static void
+parse_traversed (const void *data, size_t len)
+{
+  archive_parsed = 1;
+  tar_parse_data (data, len);
+}
+
 /* Close the tar file assuming that it is already locked.  */
 static void
 close_store ()
@@ -173,6 +216,33 @@ read_from_file (struct node *node, off_t offset, size_t howmuch,
 }
 
 
+/* Returns the size specified by ARG, possibly with a `k', `M' or `G'
+   suffix, and exits if it is not valid.  WHAT tells what it is.  */
+static size_t
+parse_size (const char *arg, const char *what)
+{
+  char *end;
+  size_t size = strtoul (arg, &end, 10);
+
+  switch (*end)
+  {
+    case 'G':
+      size <<= 10;
+      /* Fall through */
+    case 'M':
+      size <<= 10;
+      /* Fall through */
+    case 'k':
+      size <<= 10;
+      end++;
+  }
+
+  if (*end || !size)
+    error (1, EINVAL, "Invalid %s: %s", what, arg);
+
+  return size;
+}
+
 /* Argp options parser.  */
 error_t
 tarfs_parse_opts (int key, char *arg, struct argp_state *sate)
@@ -208,6 +278,53 @@ tarfs_parse_opts (int key, char *arg, struct argp_state *sate)
     case 's':
       tarfs_options.interval = atoi (arg);
       break;
+    case 'C':
+      tarfs_options.cache_size = parse_size (arg, "cache size");
+      cache_set_budget (tarfs_options.cache_size);
+      break;
+    case 'B':
+    {
+      error_t err;
+
+      tarfs_options.block_size = parse_size (arg, "block size");
+      err = cache_set_block_size (tarfs_options.block_size);
+      if (err)
+	error (1, err, "Invalid block size: %s", arg);
+      break;
+    }
+    case 'Z':
+    {
+      error_t err;
+
+      tarfs_options.zip_block_size = parse_size (arg, "block size");
+      err = store_gzip_set_block_size (tarfs_options.zip_block_size);
+      if (!err)
+	err = store_bzip2_set_block_size (tarfs_options.zip_block_size);
+      if (err)
+	error (1, err, "Invalid zip block size: %s", arg);
+      break;
+    }
+    case 'H':
+      tarfs_options.spill_high = parse_size (arg, "spill watermark");
+      break;
+    case 'L':
+      tarfs_options.spill_low = parse_size (arg, "spill watermark");
+      break;
+    case 'S':
+      tarfs_options.stream = 1;
+      break;
+    case ARGP_KEY_END:
+      if (tarfs_options.spill_high || tarfs_options.spill_low)
+      {
+	error_t err;
+
+	err = cache_set_spill (tarfs_options.spill_high
+			       ? tarfs_options.spill_high : CACHE_SPILL_HIGH,
+			       tarfs_options.spill_low);
+	if (err)
+	  error (1, err, "Invalid spill watermarks");
+      }
+      break;
     case ARGP_KEY_ARG:
       tarfs_options.file_name = strdup (arg);
       if (!tarfs_options.file_name || !strlen (tarfs_options.file_name))
@@ -260,6 +377,79 @@ tarfs_get_args (char **argz, unsigned *argz_len)
   if (err)
     return err;
 
+  if (tarfs_options.cache_size)
+  {
+    char *opt;
+
+    if (asprintf (&opt, "--cache-size=%zu", tarfs_options.cache_size) < 0)
+      return ENOMEM;
+
+    err = argz_add (argz, argz_len, opt);
+    free (opt);
+    if (err)
+      return err;
+  }
+
+  if (tarfs_options.block_size)
+  {
+    char *opt;
+
+    if (asprintf (&opt, "--block-size=%zu", tarfs_options.block_size) < 0)
+      return ENOMEM;
+
+    err = argz_add (argz, argz_len, opt);
+    free (opt);
+    if (err)
+      return err;
+  }
+
+  if (tarfs_options.zip_block_size)
+  {
+    char *opt;
+
+    if (asprintf (&opt, "--zip-block-size=%zu",
+		  tarfs_options.zip_block_size) < 0)
+      return ENOMEM;
+
+    err = argz_add (argz, argz_len, opt);
+    free (opt);
+    if (err)
+      return err;
+  }
+
+  if (tarfs_options.spill_high)
+  {
+    char *opt;
+
+    if (asprintf (&opt, "--spill-high=%zu", tarfs_options.spill_high) < 0)
+      return ENOMEM;
+
+    err = argz_add (argz, argz_len, opt);
+    free (opt);
+    if (err)
+      return err;
+  }
+
+  if (tarfs_options.spill_low)
+  {
+    char *opt;
+
+    if (asprintf (&opt, "--spill-low=%zu", tarfs_options.spill_low) < 0)
+      return ENOMEM;
+
+    err = argz_add (argz, argz_len, opt);
+    free (opt);
+    if (err)
+      return err;
+  }
+
+  if (tarfs_options.stream)
+  {
+    err = argz_add (argz, argz_len, "--stream");
+    if (err)
+      return err;
+  }
+
   err = argz_add (argz, argz_len, tarfs_options.file_name);
   
   return err;
@@ -318,102 +508,750 @@ tarfs_set_options (char *argz, size_t argz_len)
 
 
 
-error_t tarfs_create_node (struct node **newnode, struct node *dir,
-			   char *name, mode_t mode);
+/* Entries.  The members of the archive are recorded as entries while it is
+   parsed (see struct tarfs_entry), and their nodes get built a directory at
+   a time, the first time their directory is looked into (see expand_node
+   ()).  ENTRIES_LOCK protects the entries whose node was not built yet.
+   It may be taken while holding node locks, but not the other way around.
+   ROOT_ENTRY stands for the root directory, which has no tar item.  */
+static struct mutex entries_lock;
+static struct tarfs_entry root_entry;
+
+/* Returns the entry of NODE, or NULL if NODE is anonymous.  */
+static inline struct tarfs_entry *
+node_entry (struct node *node)
+{
+  if (node == netfs_root_node)
+    return &root_entry;
+
+  return NODE_INFO (node)->tar ? TAR_ENTRY (NODE_INFO (node)->tar) : NULL;
+}
+
+/* Sets the stat of NODE, which was just built from ENTRY, the way
+   tar_header2stat () does.  */
+static void
+entry_stat (struct tarfs_entry *entry, struct node *node)
+{
+  io_statbuf_t *st = &node->nn_stat;
+
+  if (entry->flags & ENTRY_HEADER)
+  {
+    st->st_mode = entry->mode;
+    st->st_uid  = entry->uid;
+    st->st_gid  = entry->gid;
+    st->st_rdev = entry->rdev;
+    st->st_size = entry->tar.orig_size;
+    if (st->st_size > 0)
+      st->st_blocks = ((st->st_size - 1) / 512) + 1;
+    else
+      st->st_blocks = 0;
+  }
+  else
+    /* A directory which was not found in the archive */
+    st->st_mode = node->nn_translated = entry->mode;
+
+  st->st_mtime = entry->mtime;
+  st->st_atime = entry->atime;
+  st->st_ctime = entry->ctime;
+
+  if (S_ISDIR (st->st_mode))
+    st->st_nlink = 2 + entry->subdirs;
+}
+
+/* Records in ENTRY the header RECORD which was just written to its
+   member, the way the parser would decode it, so that it can be saved to
+   the metadata index later on.  */
+static void
+entry_set_header (struct tarfs_entry *entry, tar_record_t *record)
+{
+  tar_header_t hdr;
+
+  tar_decode_header (&hdr, record);
+
+  entry->mode  = hdr.mode;
+  entry->uid   = hdr.uid;
+  entry->gid   = hdr.gid;
+  entry->rdev  = hdr.rdev;
+  entry->mtime = hdr.mtime;
+  entry->atime = hdr.atime;
+  entry->ctime = hdr.ctime;
+
+  /* A missing target keeps the entry out of the index */
+  entry->target = hdr.linkname[0]
+		  ? arena_intern (hdr.linkname, strlen (hdr.linkname))
+		  : NULL;
+
+  entry->flags |= ENTRY_HEADER;
+  if (hdr.linkflag == LF_LINK)
+    entry->flags |= ENTRY_LINK;
+  else
+    entry->flags &= ~ENTRY_LINK;
+}
+
+/* Builds the node of ENTRY in DIR, the node of its directory.  */
+static error_t
+entry_build (struct tarfs_entry *entry, struct node *dir)
+{
+  error_t err;
+  struct node *new;
+
+  err = fs_make_node_interned (&new, dir, entry->name, 0);
+  if (err)
+    return err;
+
+  NEW_NODE_INFO (new);
+  NODE_INFO (new)->tar = &entry->tar;
+  entry->tar.node = new;
+  entry->flags |= ENTRY_BUILT;
+  entry_stat (entry, new);
+
+  /* Create a cache for the new node.  */
+  err = cache_create (new);
+  if (err)
+    error (1, err, "An error occured while creating the filesystem");
+
+  /* Symlinks handling */
+  if (S_ISLNK (new->nn_stat.st_mode))
+    fs_link_node_path (new, entry->target);
+
+  return 0;
+}
+
+/* Builds the nodes of the entries of DIR, whose node is built, unless this
+   was done already.  Assumes ENTRIES_LOCK is held.  */
+static void
+entry_expand (struct tarfs_entry *dir)
+{
+  struct tarfs_entry *entry;
+  error_t err;
+
+  if (dir->flags & ENTRY_EXPANDED)
+    return;
+
+  assert (dir->tar.node);
+  if (dir->entries)
+  {
+    /* The first entry follows the last one */
+    entry = dir->entries;
+    do
+    {
+      entry = entry->next;
+      if (!(entry->flags & ENTRY_BUILT))
+      {
+	err = entry_build (entry, dir->tar.node);
+	if (err)
+	  error (1, err, "Filesystem could not be built");
+      }
+    }
+    while (entry != dir->entries);
+  }
+
+  dir->flags |= ENTRY_EXPANDED;
+}
+
+/* Returns the node of ENTRY, which gets built along with those of the
+   other entries of its directory if it was not yet, or NULL if it was
+   removed.  Assumes ENTRIES_LOCK is held.  */
+static struct node *
+entry_node (struct tarfs_entry *entry)
+{
+  if (!(entry->flags & ENTRY_BUILT))
+  {
+    entry_node (entry->dir);
+    entry_expand (entry->dir);
+  }
+
+  return entry->tar.node;
+}
+
+/* Builds the nodes of NODE's entries, if NODE is a directory whose nodes
+   were not built yet.  This has to be done before NODE is looked into.  */
+static void
+expand_node (struct node *node)
+{
+  struct tarfs_entry *entry = node_entry (node);
+
+  if (entry && !(entry->flags & ENTRY_EXPANDED))
+  {
+    mutex_lock (&entries_lock);
+    entry_expand (entry);
+    mutex_unlock (&entries_lock);
+  }
+}
+
+/* Parse-time directory index: maps the directory part of the names found
+   in the headers, as is, to the corresponding entries, so that entries of
+   the same directory, which usually follow each other, don't need their
+   whole path to be looked up again.  PARSE_DIR_LAST is the last directory
+   that was looked up.  The index is freed once the archive is parsed.  */
+struct parse_dir
+{
+  char *path;
+  unsigned int hash;
+  struct tarfs_entry *entry;
+  struct parse_dir *next;
+};
+
+#define PARSE_DIRS_MIN_SIZE  256
+
+static struct parse_dir **parse_dirs = NULL;
+static size_t parse_dirs_size = 0;
+static size_t parse_dirs_count = 0;
+static struct parse_dir *parse_dir_last = NULL;
+
+/* Parse-time name table: the entries whose node is not built, hashed by
+   directory and name, so that members which are already there can be
+   told.  It is open-addressed, so that entries need no link for it, and
+   freed along with the directory index.  */
+#define PARSE_ENTRIES_MIN_SIZE  1024
+
+static struct tarfs_entry **parse_entries = NULL;
+static size_t parse_entries_size = 0;
+static size_t parse_entries_count = 0;
+
+/* Splits PATH, a name found in a tar header, into its directory part,
+   which is returned (PATH itself, or "" if it has none), and its last
+   component, returned in BASE.  PATH is modified.  Returns NULL if BASE
+   would be empty.  */
+static char *
+parse_split (char *path, char **base)
+{
+  char *end = path + strlen (path), *slash;
+
+  /* Directories are followed by a slash */
+  while ((end > path) && (end[-1] == '/'))
+    *--end = '\0';
+
+  slash = strrchr (path, '/');
+  if (slash)
+  {
+    *slash = '\0';
+    *base = slash + 1;
+  }
+  else
+  {
+    *base = path;
+    path = "";
+  }
+
+  return **base ? path : NULL;
+}
+
+/* Returns the directory whose path, as found in the headers, is PATH, or
+   NULL if it is not known yet.  */
+static struct tarfs_entry *
+parse_dir_lookup (const char *path)
+{
+  struct parse_dir *d;
+  unsigned int hash;
+
+  if (!*path)
+    return &root_entry;
+
+  if (parse_dir_last && (!strcmp (parse_dir_last->path, path)))
+    return parse_dir_last->entry;
+
+  if (!parse_dirs)
+    return NULL;
+
+  hash = arena_hash (path, strlen (path));
+  for (d = parse_dirs[hash & (parse_dirs_size - 1)]; d; d = d->next)
+    if ((d->hash == hash) && (!strcmp (d->path, path)))
+    {
+      parse_dir_last = d;
+      return d->entry;
+    }
+
+  return NULL;
+}
+
+/* Records that the directory whose path is PATH is DIR.  Failing to do so
+   is not an error: PATH will just be looked up again.  */
+static void
+parse_dir_add (const char *path, struct tarfs_entry *dir)
+{
+  struct parse_dir *d;
+
+  if (parse_dirs_count >= (parse_dirs_size << 1))
+  {
+    /* Grow the table */
+    size_t size = parse_dirs_size ? parse_dirs_size << 2
+				  : PARSE_DIRS_MIN_SIZE;
+    struct parse_dir **table = calloc (size, sizeof (struct parse_dir *));
+    size_t i;
+
+    if (!table)
+      return;
+
+    for (i = 0; i < parse_dirs_size; i++)
+      while (parse_dirs[i])
+      {
+	d = parse_dirs[i];
+	parse_dirs[i] = d->next;
+	d->next = table[d->hash & (size - 1)];
+	table[d->hash & (size - 1)] = d;
+      }
+
+    free (parse_dirs);
+    parse_dirs = table;
+    parse_dirs_size = size;
+  }
+
+  d = malloc (sizeof (struct parse_dir));
+  if (!d)
+    return;
+  d->path = strdup (path);
+  if (!d->path)
+  {
+    free (d);
+    return;
+  }
+
+  d->hash = arena_hash (path, strlen (path));
+  d->entry = dir;
+  d->next = parse_dirs[d->hash & (parse_dirs_size - 1)];
+  parse_dirs[d->hash & (parse_dirs_size - 1)] = d;
+  parse_dirs_count++;
+  parse_dir_last = d;
+}
+
+/* Frees the parse-time directory index and name table.  */
+static void
+parse_dirs_free ()
+{
+  size_t i;
+
+  for (i = 0; i < parse_dirs_size; i++)
+    while (parse_dirs[i])
+    {
+      struct parse_dir *d = parse_dirs[i];
+      parse_dirs[i] = d->next;
+      free (d->path);
+      free (d);
+    }
+
+  free (parse_dirs);
+  parse_dirs = NULL;
+  parse_dirs_size = parse_dirs_count = 0;
+  parse_dir_last = NULL;
+
+  free (parse_entries);
+  parse_entries = NULL;
+  parse_entries_size = parse_entries_count = 0;
+}
+
+/* Returns the hash value of an entry of directory DIR whose name's hash
+   value is HASH.  */
+static inline size_t
+parse_entry_hash (struct tarfs_entry *dir, unsigned int hash)
+{
+  return hash ^ ((uintptr_t) dir >> 4);
+}
+
+/* Puts ENTRY in the first free slot of TABLE, a name table of SIZE slots,
+   from its hash value on.  */
+static inline void
+parse_entry_put (struct tarfs_entry **table, size_t size,
+		 struct tarfs_entry *entry)
+{
+  size_t i = parse_entry_hash (entry->dir, arena_name_hash (entry->name));
+
+  for (i &= size - 1; table[i]; i = (i + 1) & (size - 1))
+    ;
+  table[i] = entry;
+}
+
+/* Adds ENTRY, whose node is not built, to the name table.  */
+static void
+parse_entry_add (struct tarfs_entry *entry)
+{
+  if (parse_entries_count >= (parse_entries_size >> 1))
+  {
+    /* Grow the table, dropping the entries whose node got built
+       meanwhile.  If memory is short, the current table is kept as long
+       as it has free slots.  */
+    size_t size = parse_entries_size ? parse_entries_size << 1
+				     : PARSE_ENTRIES_MIN_SIZE;
+    struct tarfs_entry **table = calloc (size, sizeof (struct tarfs_entry *));
+    size_t i;
+
+    if (!table && (parse_entries_count + 1 >= parse_entries_size))
+      error (1, ENOMEM, "Filesystem could not be built");
+
+    if (table)
+    {
+      parse_entries_count = 0;
+      for (i = 0; i < parse_entries_size; i++)
+	if (parse_entries[i] && !(parse_entries[i]->flags & ENTRY_BUILT))
+	{
+	  parse_entry_put (table, size, parse_entries[i]);
+	  parse_entries_count++;
+	}
+
+      free (parse_entries);
+      parse_entries = table;
+      parse_entries_size = size;
+    }
+  }
+
+  parse_entry_put (parse_entries, parse_entries_size, entry);
+  parse_entries_count++;
+}
+
+/* Returns the entry named NAME in directory DIR, or NULL if there is
+   none.  Names are told apart by their hash value first.  */
+static struct tarfs_entry *
+parse_lookup (struct tarfs_entry *dir, const char *name)
+{
+  struct tarfs_entry *entry;
+  size_t len, i;
+  unsigned int hash;
+
+  if (dir->flags & ENTRY_EXPANDED)
+  {
+    /* Look for NAME among DIR's nodes */
+    struct node *node = fs_find_node (dir->tar.node, (char *) name);
+    return node ? node_entry (node) : NULL;
+  }
+
+  /* Looking for '.' or '..'? */
+  if ((name[0] == '.') && ((!name[1]) || ((name[1] == '.') && (!name[2]))))
+    return name[1] ? dir->dir : dir;
+
+  if (!parse_entries)
+    return NULL;
+
+  len = strlen (name);
+  hash = arena_hash (name, len);
+  for (i = parse_entry_hash (dir, hash) & (parse_entries_size - 1);
+       (entry = parse_entries[i]);
+       i = (i + 1) & (parse_entries_size - 1))
+    if ((entry->dir == dir) && !(entry->flags & ENTRY_BUILT)
+	&& arena_name_is (entry->name, name, len, hash))
+      break;
+
+  return entry;
+}
+
+/* Looks for the entry located at PATH, starting at directory *DIR, the
+   way fs_find_node_path () does with nodes, except that PATH gets split
+   in place, like strtok_r () does, and that NOTFOUND and RETRY_NAME point
+   into it.  */
+static void
+parse_lookup_path (struct tarfs_entry **dir, char **retry_name,
+		   char **notfound, char *path)
+{
+  struct tarfs_entry *entry = *dir;
+  char *str;
+  char *name = NULL;
+
+  name = strtok_r (path, "/", &str);
+
+  while (entry && name)
+  {
+    entry = parse_lookup (*dir, name);
+    if (entry)
+    {
+      name = strtok_r (NULL, "/", &str);
+      *dir = entry;
+    }
+  }
+
+  if (entry)
+    /* We did find the very last entry. */
+    *notfound = *retry_name = NULL;
+  else
+  {
+    /* We stopped at NAME, which was not found. */
+    assert (name != NULL);
+    assert (strlen (name) != 0);
+    *notfound = name;
+
+    /* Did we parse the whole string? */
+    while (*str == '/')
+      str++;
+    *retry_name = *str ? str : NULL;
+  }
+}
+
+/* Returns the entry whose path, as found in the headers, is PATH, or NULL
+   if there is none.  */
+static struct tarfs_entry *
+parse_find_entry (const char *path)
+{
+  struct tarfs_entry *entry = NULL;
+  char *copy = strdup (path), *dirpath, *base, *retry, *notfound;
+
+  if (!copy)
+    return NULL;
+
+  dirpath = parse_split (copy, &base);
+  if (dirpath)
+  {
+    entry = parse_dir_lookup (dirpath);
+    if (entry)
+      entry = parse_lookup (entry, base);
+    else
+    {
+      /* Look it up the long way, on the whole path again */
+      if (base != copy)
+	base[-1] = '/';
+      entry = &root_entry;
+      parse_lookup_path (&entry, &retry, &notfound, copy);
+      if (retry || notfound)
+	entry = NULL;
+    }
+  }
+
+  free (copy);
+
+  return entry;
+}
+
+/* Appends ENTRY to the entries of directory DIR.  */
+static inline void
+parse_append (struct tarfs_entry *dir, struct tarfs_entry *entry)
+{
+  entry->dir = dir;
+  if (dir->entries)
+  {
+    entry->next = dir->entries->next;
+    dir->entries->next = entry;
+  }
+  else
+    entry->next = entry;
+  dir->entries = entry;
+}
+
+/* Returns the item after which the item of a new entry of directory DIR
+   should be inserted, the way tar_put_item () finds it for new nodes.  */
+static struct tar_item *
+parse_put_item (struct tarfs_entry *dir)
+{
+  struct tarfs_entry *entry;
+
+  if (!dir->entries)
+    return (dir == &root_entry) ? NULL : &dir->tar;
+
+  /* Get to the last entry of DIR's last entry's deepest subdir */
+  for (entry = dir->entries; entry->entries; entry = entry->entries)
+    ;
+
+  return &entry->tar;
+}
+
+/* Records the entry of a member named NAME in directory DIR, whose header
+   HDR is at offset OFFSET of the archive, or of a directory missing from
+   the archive if HDR is NULL, and returns it.  Its node gets built right
+   away if those of DIR's entries are.  */
+static struct tarfs_entry *
+parse_add_entry (struct tarfs_entry *dir, const char *name,
+		 tar_header_t *hdr, off_t offset)
+{
+  error_t err;
+  struct tarfs_entry *entry;
+
+  err = tar_make_entry (&entry);
+  if (!err)
+  {
+    /* Entries share their names, which are interned */
+    entry->name = fs_intern_name (name);
+    if (hdr && S_ISLNK (hdr->mode))
+      entry->target = arena_intern (hdr->linkname, strlen (hdr->linkname));
+    if ((!entry->name) || (hdr && S_ISLNK (hdr->mode) && (!entry->target)))
+      err = ENOMEM;
+  }
+  if (err)
+    error (1, err, "Filesystem could not be built");
+
+  entry->tar.offset = offset;
+  if (hdr)
+  {
+    entry->flags = ENTRY_HEADER;
+    entry->tar.orig_size = hdr->size;
+    entry->mode  = hdr->mode;
+    entry->uid   = hdr->uid;
+    entry->gid   = hdr->gid;
+    entry->rdev  = hdr->rdev;
+    entry->mtime = hdr->mtime;
+    entry->atime = hdr->atime;
+    entry->ctime = hdr->ctime;
+  }
+  else
+  {
+    entry->mode  = S_IFDIR | 755;
+    entry->mtime = entry->atime = entry->ctime = time (NULL);
+  }
+
+  parse_append (dir, entry);
+
+  /* Update DIR's hard links count */
+  if (S_ISDIR (entry->mode))
+  {
+    if (dir->flags & ENTRY_BUILT)
+      dir->tar.node->nn_stat.st_nlink++;
+    else
+      dir->subdirs++;
+  }
+
+  if (dir->flags & ENTRY_EXPANDED)
+  {
+    err = entry_build (entry, dir->tar.node);
+    if (err)
+      error (1, err, "Filesystem could not be built");
+  }
+  else
+    parse_entry_add (entry);
+
+  return entry;
+}
 
 /* This function is called every time a header has been successfully parsed.
-   It simply creates the node corresponding to the header.
+   It simply records the entry corresponding to the header.
    OFFSET denotes the offset of the header in the archive.  */
 int
-tarfs_add_header (tar_record_t *hdr, off_t offset)
+tarfs_add_header (tar_header_t *hdr, off_t offset)
 {
   error_t err;
   static struct tar_item *last_item = NULL;
-  struct node *dir, *new = NULL;
-  char *name, *notfound, *retry;
-  char arch_name[NAMSIZ + 1];
+  struct tarfs_entry *dir, *new = NULL;
+  char *name, *notfound, *retry, *path = NULL;
+  char *dirpath, *base;
   
   assert (hdr != NULL);
 
-  dir = netfs_root_node;
+  mutex_lock (&entries_lock);
 
-  memcpy (arch_name, hdr->header.arch_name, NAMSIZ);
-  arch_name[NAMSIZ] = '\0';
-  name = strdup (arch_name);
-  assert (name);
-  debug (("name = %s", name));
+  debug (("name = %s", hdr->name));
 
-  /* Find the new node's parent directory.  */
-  do
+  /* Find the new entry's directory, first in the directory index.
+     HDR->NAME gets split in place, and its components are not copied.  */
+  dirpath = parse_split (hdr->name, &base);
+  if (dirpath && (dir = parse_dir_lookup (dirpath)))
   {
-    err = fs_find_node_path (&dir, &retry, &notfound, name);
+    struct tarfs_entry *entry = parse_lookup (dir, base);
 
-    /* If a subdirectory wasn't found, then complain, create it and go on.
-       eg.: if we wan't to create "/foo/bar" and "/foo" does not exist
-            yet, then create "/foo" first and then continue with "bar".  */
-    if (retry)
+    if (entry)
+      /* Already there */
+      dir = entry, notfound = NULL;
+    else
+      notfound = base;
+  }
+  else
+  {
+    /* Look the whole name up, on a copy of it since it gets split in
+       place too */
+    if (base != hdr->name)
+      base[-1] = '/';
+    path = name = strdup (hdr->name);
+    if (!path)
+      error (1, ENOMEM, "Filesystem could not be built");
+    if (base != hdr->name)
+      base[-1] = '\0';
+
+    dir = &root_entry;
+
+    do
     {
-      error (0, 0, "Inconsistent tar archive "
-		   "(directory \"%s\" not found)", notfound);
-      err = tarfs_create_node (&new, dir, notfound, S_IFDIR | 755);
-      assert_perror (err);
-      /*fs_make_subdir (&new, dir, notfound);
-      NEW_NODE_INFO (new);*/
-      free (name);
-      name = retry;
-      dir = new;
+      parse_lookup_path (&dir, &retry, &notfound, name);
+
+      /* If a subdirectory wasn't found, then complain, create it and go on.
+	 eg.: if we wan't to create "/foo/bar" and "/foo" does not exist
+	      yet, then create "/foo" first and then continue with "bar".  */
+      if (retry)
+      {
+	struct tar_item *prev = parse_put_item (dir);
+
+	error (0, 0, "Inconsistent tar archive "
+		     "(directory \"%s\" not found)", notfound);
+	dir = parse_add_entry (dir, notfound, NULL, -1);
+	tar_insert_item (&tar_list, prev, &dir->tar);
+	name = retry;
+      }
     }
+    while (retry);
+
+    if (notfound && dirpath)
+      /* Remember DIR, the new entry's directory */
+      parse_dir_add (dirpath, dir);
   }
-  while (retry);
 
   if (!notfound)
   {
-    /* Means that this node is already here: do nothing.  Complain only
-       if the node we found is not the root dir ("tar cf x ." creates
+    /* Means that this entry is already here: do nothing.  Complain only
+       if the entry we found is not the root dir ("tar cf x ." creates
        './' as the first tar entry).  */
-    if (dir != netfs_root_node)
-      error (0, 0, "Warning: node \"%s\" already exists", name);
+    if (base != hdr->name)
+      base[-1] = '/';
+    if (dir != &root_entry)
+      error (0, 0, "Warning: node \"%s\" already exists", hdr->name);
 
+    free (path);
+    mutex_unlock (&entries_lock);
     return 0;
   }
 
-  /* Now, go ahead and create the node.  */
+  /* Now, go ahead and record the entry.  */
   name = notfound;
   assert (strlen (name) > 0);
 
-  switch (hdr->header.linkflag)
+  switch (hdr->linkflag)
   {
     /* Hard link.  */
     case LF_LINK:
     {
-      char *tgname;
-      struct node *target;
+      char *tgname = hdr->linkname;
+      struct tarfs_entry *target;
+      struct node *node = NULL, *link = NULL;
 
       debug (("Hard linking \"%s\"", name));
 
-      /* Get the target's node first. */
-      tgname = malloc (NAMSIZ + 1);
-      memcpy (tgname, hdr->header.arch_linkname, NAMSIZ);
-      tgname [NAMSIZ] = '\0';
-      target = netfs_root_node;
-      fs_find_node_path (&target, &retry, &notfound, tgname);
+      /* Get the target's node first: hard links are built right away,
+	 along with the nodes of their directory and of their target's.  */
+      target = parse_find_entry (tgname);
+      if (target)
+	node = entry_node (target);
 
-      if ((!retry) && (!notfound))
+      if (node)
       {
+	entry_node (dir);
+	entry_expand (dir);
+
 	/* FIXME: Call tarfs_create_node () and tarfs_link_node instead */
-	fs_hard_link_node (&new, dir, name, target->nn_stat.st_mode, target);
+	fs_hard_link_node (&link, dir->tar.node, name,
+			   node->nn_stat.st_mode, node);
 
 	/* Update node info & stats */
-	if (new)
+	if (link)
 	{
-	  NEW_NODE_INFO (new);
+	  struct tar_item *tar;
+
+	  NEW_NODE_INFO (link);
 
           /* No need to create a cache for hard links.  */
 
-	  /* Add the tar item into the list.  */
-	  err = tar_make_item (&NODE_INFO(new)->tar, new,
-			       0, offset);
+	  /* Make its entry.  */
+	  err = tar_make_item (&tar, link, 0, offset);
 	  assert_perror (err);
+	  new = TAR_ENTRY (tar);
+	  parse_append (dir, new);
+	  new->name = link->nn->name;
+	  new->target = arena_intern (tgname, strlen (tgname));
+	  new->flags |= ENTRY_HEADER | ENTRY_LINK;
+	  new->mode  = hdr->mode;
+	  new->uid   = hdr->uid;
+	  new->gid   = hdr->gid;
+	  new->rdev  = hdr->rdev;
+	  new->mtime = hdr->mtime;
+	  new->atime = hdr->atime;
+	  new->ctime = hdr->ctime;
+
+	  /* Directories */
+	  if (S_ISDIR (link->nn_stat.st_mode))
+	  {
+	    link->nn_stat.st_nlink = 2;
+	    link->nn->dir->nn_stat.st_nlink++;
+	  }
 	}
       }
       else
@@ -422,64 +1260,526 @@ tarfs_add_header (tar_record_t *hdr, off_t offset)
       break;
     }
 
-    /* Other node types.  */
+    /* Other member types.  */
     default:
-      err = fs_make_node (&new, dir, name, 0);
-      assert_perror (err);
+      new = parse_add_entry (dir, name, hdr, offset);
+
+      if (S_ISLNK (hdr->mode) && (!hdr->linkname[0]))
+	error (0, 0, "Warning: empty symlink target for node \"%s\"", name);
+  }
+
+  if (!new)
+    error (1, 0, "Filesystem could not be built");
+
+  free (path);
+
+  tar_insert_item (&tar_list, last_item, &new->tar);
+  last_item = &new->tar;
+
+  mutex_unlock (&entries_lock);
+
+  return 0;
+}
+
+
+
+
+/* Metadata index.  */
+
+/* The tree of a plain archive is saved to a file named after the archive
+   with this suffix once it has been parsed or synced (from the tar list,
+   see meta_add_item ()), so that the next
+   time the archive is mounted, the tree gets rebuilt from it without
+   reading any header.  */
+#define META_SUFFIX  ".tarfs-meta"
+
+/* Index files start with this magic string, followed by the format
+   version number.  Bump the latter whenever the format changes.  */
+#define META_MAGIC    "tarfsmet"
+#define META_VERSION  1
+
+/* The archive is hashed by META_SAMPLES samples of META_SAMPLE_SIZE bytes
+   spread evenly from its beginning to its end in order to make sure the
+   index matches it.  */
+#define META_SAMPLES      16
+#define META_SAMPLE_SIZE  4096
+
+/* Header of a metadata index file.  Like seek indexes (see zipstores.c),
+   index files are written in native byte order.  */
+struct meta_header
+{
+  char     magic[8];
+  uint32_t version;
+
+  /* Size, modification time and hash (see meta_stamp ()) of the archive
+     when the index was written.  */
+  uint64_t file_size;
+  int64_t  file_mtime;
+  uint64_t file_hash;
+
+  /* Number of entries */
+  uint64_t count;
+};
+
+/* An entry of an index file, i.e. a header as passed to tarfs_add_header (),
+   followed by NAME_LEN bytes of name and LINK_LEN bytes of link target.  */
+struct meta_entry
+{
+  uint64_t offset;
+  uint64_t size;
+  int64_t  mtime;
+  int64_t  atime;
+  int64_t  ctime;
+  uint32_t mode;
+  uint32_t uid;
+  uint32_t gid;
+  uint32_t rdev;
+  uint8_t  linkflag;
+  uint8_t  name_len;
+  uint8_t  link_len;
+};
+
+/* Non-zero when the metadata index matches the archive, i.e. when it was
+   loaded or saved and the archive was not written to since.  */
+static int meta_valid = 0;
+
+/* Fills in the size, modification time and hash of the archive in HDR.
+   The hash is a FNV-1a hash of samples of the archive.  */
+static error_t
+meta_stamp (struct meta_header *hdr)
+{
+  error_t err = 0;
+  char buf[META_SAMPLE_SIZE];
+  struct stat st;
+  off_t step;
+  ssize_t len, i;
+  int fd, n;
+
+  fd = open (tarfs_options.file_name, O_RDONLY);
+  if (fd < 0)
+    return errno;
+
+  if (fstat (fd, &st))
+  {
+    err = errno;
+    close (fd);
+    return err;
+  }
+
+  hdr->file_size  = st.st_size;
+  hdr->file_mtime = st.st_mtime;
+  hdr->file_hash  = 14695981039346656037ULL;
+
+  step = (st.st_size > META_SAMPLE_SIZE)
+	 ? (st.st_size - META_SAMPLE_SIZE) / (META_SAMPLES - 1)
+	 : 0;
+
+  for (n = 0; n < META_SAMPLES; n++)
+  {
+    len = pread (fd, buf, META_SAMPLE_SIZE, step * n);
+    if (len < 0)
+    {
+      err = errno;
+      break;
+    }
+
+    for (i = 0; i < len; i++)
+    {
+      hdr->file_hash ^= (unsigned char) buf[i];
+      hdr->file_hash *= 1099511628211ULL;
+    }
+  }
+
+  close (fd);
+
+  return err;
+}
 
-      /* Update node info & stats */
-      if (new)
+/* Builds the tree from the archive's metadata index, provided that it
+   matches the archive.  The index is checked as a whole before the tree
+   gets built so that nothing is built if it is invalid.  */
+static error_t
+meta_load ()
+{
+  error_t err = 0;
+  char *name, *data = NULL, *p, *end = NULL;
+  FILE *file;
+  struct stat st;
+  struct meta_header hdr, now;
+  struct meta_entry entry;
+  tar_header_t header;
+  uint64_t i;
+  size_t len;
+  int pass;
+
+  if (asprintf (&name, "%s" META_SUFFIX, tarfs_options.file_name) < 0)
+    return ENOMEM;
+
+  file = fopen (name, "r");
+  if (!file)
+    err = errno;
+
+  if ((!err) && ((fread (&hdr, sizeof (hdr), 1, file) != 1)
+		 || memcmp (hdr.magic, META_MAGIC, sizeof (hdr.magic))
+		 || (hdr.version != META_VERSION)))
+    err = EINVAL;
+
+  /* Make sure this index was computed from the current archive */
+  if (!err)
+    err = meta_stamp (&now);
+  if ((!err) && ((hdr.file_size != now.file_size)
+		 || (hdr.file_mtime != now.file_mtime)
+		 || (hdr.file_hash != now.file_hash)))
+    err = ESTALE;
+
+  /* Read the entries at once */
+  if ((!err) && fstat (fileno (file), &st))
+    err = errno;
+  if ((!err) && (st.st_size < sizeof (hdr)))
+    err = EINVAL;
+  if (!err)
+  {
+    len = st.st_size - sizeof (hdr);
+    data = malloc (len + 1);
+    if (!data)
+      err = ENOMEM;
+    else if (len && (fread (data, len, 1, file) != 1))
+      err = EINVAL;
+    end = data + len;
+  }
+
+  /* First check the entries, then build the tree */
+  for (pass = 0; (!err) && (pass < 2); pass++)
+    for (i = 0, p = data; (!err) && (i < hdr.count); i++)
+    {
+      if (end - p < sizeof (entry))
+      {
+	err = EINVAL;
+	break;
+      }
+      memcpy (&entry, p, sizeof (entry));
+      p += sizeof (entry);
+
+      if ((entry.name_len > NAMSIZ) || (entry.link_len > NAMSIZ)
+	  || (end - p < entry.name_len + entry.link_len)
+	  || (entry.offset > hdr.file_size))
       {
-	NEW_NODE_INFO (new);
-	tar_header2stat (&new->nn_stat, hdr);
+	err = EINVAL;
+	break;
+      }
 
-	/* Create a cache for the new node.  */
-	err = cache_create (new);
-	if (err)
-	  error (1, err, "An error occured while creating the filesystem");
+      if (pass)
+      {
+	memcpy (header.name, p, entry.name_len);
+	header.name[entry.name_len] = '\0';
+	memcpy (header.linkname, p + entry.name_len, entry.link_len);
+	header.linkname[entry.link_len] = '\0';
+	header.linkflag = entry.linkflag;
+	header.mode  = entry.mode;
+	header.uid   = entry.uid;
+	header.gid   = entry.gid;
+	header.rdev  = entry.rdev;
+	header.size  = entry.size;
+	header.mtime = entry.mtime;
+	header.atime = entry.atime;
+	header.ctime = entry.ctime;
+
+	tarfs_add_header (&header, entry.offset);
+      }
+
+      p += entry.name_len + entry.link_len;
+    }
+
+  if (file)
+    fclose (file);
+
+  debug (("%s: %s (%llu entries)", name, strerror (err),
+	  err ? 0ULL : (unsigned long long) hdr.count));
+
+  free (data);
+  free (name);
+
+  meta_valid = !err;
+
+  return err;
+}
+
+/* Index being written (see meta_begin ()), its name, its header, and the
+   error which keeps it from being completed, if any.  META_LOCK is held
+   while an index is being written.  */
+static FILE *meta_file = NULL;
+static char *meta_name = NULL;
+static struct meta_header meta_hdr;
+static error_t meta_err = 0;
+static struct mutex meta_lock;
+
+/* Starts writing the archive's metadata index, unless the archive is
+   compressed or an index is being written already.  The index is first
+   written to a temporary file which is renamed by meta_end () so that no
+   one ever sees a partial index.  */
+static error_t
+meta_begin ()
+{
+  error_t err = 0;
+
+  if (tarfs_options.compress != COMPRESS_NONE)
+    return EOPNOTSUPP;
+
+  if (! mutex_try_lock (&meta_lock))
+    return EBUSY;
+
+  if (asprintf (&meta_name, "%s" META_SUFFIX ".new",
+		tarfs_options.file_name) < 0)
+  {
+    meta_name = NULL;
+    mutex_unlock (&meta_lock);
+    return ENOMEM;
+  }
+
+  bzero (&meta_hdr, sizeof (meta_hdr));
+  memcpy (meta_hdr.magic, META_MAGIC, sizeof (meta_hdr.magic));
+  meta_hdr.version = META_VERSION;
+  meta_err = 0;
+
+  /* The header is written again once the entries have been counted */
+  meta_file = fopen (meta_name, "w");
+  if (!meta_file)
+    err = errno;
+  else if (fwrite (&meta_hdr, sizeof (meta_hdr), 1, meta_file) != 1)
+    err = errno ?: EIO;
+
+  if (err)
+  {
+    if (meta_file)
+      fclose (meta_file);
+    meta_file = NULL;
+    unlink (meta_name);
+    free (meta_name);
+    meta_name = NULL;
+    mutex_unlock (&meta_lock);
+  }
+
+  return err;
+}
+
+/* Adds HEADER, as passed to tarfs_add_header () along with OFFSET, to the
+   index being written.  Failing to do so makes meta_end () fail.  This is
+   a header hook as well.  */
+static int
+meta_add (tar_header_t *header, off_t offset)
+{
+  struct meta_entry entry;
+
+  if (!meta_file || ferror (meta_file))
+    return 0;
+
+  bzero (&entry, sizeof (entry));
+  entry.offset   = offset;
+  entry.size     = header->size;
+  entry.mtime    = header->mtime;
+  entry.atime    = header->atime;
+  entry.ctime    = header->ctime;
+  entry.mode     = header->mode;
+  entry.uid      = header->uid;
+  entry.gid      = header->gid;
+  entry.rdev     = header->rdev;
+  entry.linkflag = header->linkflag;
+  entry.name_len = strlen (header->name);
+  entry.link_len = strlen (header->linkname);
+
+  if ((fwrite (&entry, sizeof (entry), 1, meta_file) == 1)
+      && (fwrite (header->name, entry.name_len, 1, meta_file) == 1
+	  || !entry.name_len)
+      && (fwrite (header->linkname, entry.link_len, 1, meta_file) == 1
+	  || !entry.link_len))
+    meta_hdr.count++;
+
+  return 0;
+}
+
+/* Finishes writing the index if COMMIT is true and if it all went well,
+   otherwise removes it: no index is better than a stale one.  */
+static error_t
+meta_end (int commit)
+{
+  error_t err = 0;
+  char *name;
+
+  if (!meta_file)
+    return 0;
+
+  if (!commit)
+    err = EAGAIN;
+  if (!err)
+    err = meta_err;
+  if ((!err) && ferror (meta_file))
+    err = EIO;
+  if (!err)
+    err = meta_stamp (&meta_hdr);
+  if ((!err) && ((fseek (meta_file, 0, SEEK_SET) != 0)
+		 || (fwrite (&meta_hdr, sizeof (meta_hdr), 1, meta_file) != 1)))
+    err = errno ?: EIO;
+  if (fclose (meta_file) && !err)
+    err = errno;
+  meta_file = NULL;
+
+  /* Strip the ".new" suffix */
+  name = strndup (meta_name, strlen (meta_name) - 4);
+  if ((!err) && (!name))
+    err = ENOMEM;
+  if ((!err) && rename (meta_name, name))
+    err = errno;
+  if (err)
+  {
+    unlink (meta_name);
+    if (name)
+      unlink (name);
+  }
+
+  debug (("%s: %s (%llu entries)", meta_name, strerror (err),
+	  (unsigned long long) meta_hdr.count));
+
+  free (name);
+  free (meta_name);
+  meta_name = NULL;
+  meta_valid = !err;
+  mutex_unlock (&meta_lock);
+
+  return err;
+}
+
+/* Header hook used while the archive is being parsed: the headers are
+   added to the index as they are.  */
+static int
+meta_add_header (tar_header_t *hdr, off_t offset)
+{
+  meta_add (hdr, offset);
+  return tarfs_add_header (hdr, offset);
+}
+
+/* Returns the type flag of a header for a member of mode MODE, which is
+   not a hard link.  */
+static inline char
+meta_linkflag (mode_t mode)
+{
+  if (S_ISDIR (mode))
+    return LF_DIR;
+  if (S_ISLNK (mode))
+    return LF_SYMLINK;
+  if (S_ISCHR (mode))
+    return LF_CHR;
+  if (S_ISBLK (mode))
+    return LF_BLK;
+  if (S_ISFIFO (mode))
+    return LF_FIFO;
+  return LF_NORMAL;
+}
+
+/* Adds the header of TAR, an item of the archive which was just synced,
+   to the index being written, the way parsing the archive would give it:
+   its entry holds the stat of its header (see entry_set_header ()), and
+   its name is its entry's path.  Failing to do so makes meta_end ()
+   fail.  */
+static void
+meta_add_item (struct tar_item *tar)
+{
+  struct tarfs_entry *entry = TAR_ENTRY (tar), *e;
+  tar_header_t hdr;
+  size_t len = 0, n;
+  char *p;
+
+  if ((!meta_file) || meta_err)
+    return;
+
+  if ((tar->offset == -1) || !(entry->flags & ENTRY_HEADER))
+  {
+    meta_err = EINVAL;
+    return;
+  }
+
+  /* Its path, written backwards from its end */
+  for (e = entry; e && (e != &root_entry); e = e->dir)
+    len += (e->name ? arena_name_len (e->name) : NAMSIZ) + 1;
+  if ((!e) || (len - 1 > NAMSIZ))
+  {
+    meta_err = ENAMETOOLONG;
+    return;
+  }
+
+  p = &hdr.name[len - 1];
+  *p = '\0';
+  for (e = entry; e != &root_entry; e = e->dir)
+  {
+    n = arena_name_len (e->name);
+    p -= n;
+    memcpy (p, e->name, n);
+    if (p > hdr.name)
+      *--p = '/';
+  }
+
+  hdr.linkname[0] = '\0';
+  if (entry->target && (arena_name_len (entry->target) <= NAMSIZ))
+    strcpy (hdr.linkname, entry->target);
+  else if (S_ISLNK (entry->mode) || (entry->flags & ENTRY_LINK))
+  {
+    meta_err = entry->target ? ENAMETOOLONG : ENOMEM;
+    return;
+  }
+
+  hdr.linkflag = (entry->flags & ENTRY_LINK)
+		 ? LF_LINK
+		 : meta_linkflag (entry->mode);
+  hdr.mode  = entry->mode;
+  hdr.uid   = entry->uid;
+  hdr.gid   = entry->gid;
+  hdr.rdev  = entry->rdev;
+  hdr.size  = tar->orig_size;
+  hdr.mtime = entry->mtime;
+  hdr.atime = entry->atime;
+  hdr.ctime = entry->ctime;
+
+  meta_add (&hdr, tar->offset);
+}
+
+/* Updates the stamp of the metadata index, which matches the archive even
+   though the latter was written to (see tarfs_sync_fs ()).  */
+static error_t
+meta_restamp ()
+{
+  error_t err = 0;
+  char *name;
+  FILE *file;
+  struct meta_header hdr;
 
-	/* Add the tar item into the list.  */
-	err = tar_make_item (&NODE_INFO(new)->tar, new,
-			     new->nn_stat.st_size, offset);
-	assert_perror (err);
-      }
-  }
+  if (asprintf (&name, "%s" META_SUFFIX, tarfs_options.file_name) < 0)
+    return ENOMEM;
 
-  if (!new || err)
-    error (1, err, "Filesystem could not be built");
+  file = fopen (name, "r+");
+  if (!file)
+    err = errno;
 
-  tar_insert_item (&tar_list, last_item, NODE_INFO(new)->tar);
-  last_item = NODE_INFO(new)->tar;
+  if ((!err) && ((fread (&hdr, sizeof (hdr), 1, file) != 1)
+		 || memcmp (hdr.magic, META_MAGIC, sizeof (hdr.magic))
+		 || (hdr.version != META_VERSION)))
+    err = EINVAL;
+  if (!err)
+    err = meta_stamp (&hdr);
+  if ((!err) && ((fseek (file, 0, SEEK_SET) != 0)
+		 || (fwrite (&hdr, sizeof (hdr), 1, file) != 1)))
+    err = errno ?: EIO;
+  if (file && fclose (file) && !err)
+    err = errno;
 
-#if 0
-  debug (("%s: Created node \"%s\" (size=%li)\n",
-          __FUNCTION__, name, new->nn_stat.st_size));
-#endif
+  /* A partial header would not match any archive anyway */
+  debug (("%s: restamped: %s", name, strerror (err)));
 
-  /* Symlinks handling */
-  if (S_ISLNK (new->nn_stat.st_mode))
-  {
-    if (hdr->header.arch_linkname[0])
-      fs_link_node_path (new, strdup (hdr->header.arch_linkname));
-    else
-    {
-      error (0, 0, "Warning: empty symlink target for node \"%s\"",
-	     new->nn->name);
-      fs_link_node_path (new, strdup (""));
-    }
-  }
+  free (name);
 
-  /* Directories */
-  if (S_ISDIR (new->nn_stat.st_mode))
-  {
-    new->nn_stat.st_nlink = 2;
-    new->nn->dir->nn_stat.st_nlink++;
-  }
+  meta_valid = !err;
 
-  return 0;
+  return err;
 }
 
-
 error_t
 tarfs_init (struct node **root, struct iouser *user)
 {
@@ -510,11 +1810,40 @@ tarfs_init (struct node **root, struct iouser *user)
   {
     error_t err;
 
-    /* Go ahead: parse and build.  */
+    /* Go ahead: parse and build, unless this has already been done
+       while opening the store.  */
     mutex_lock (&tar_file_lock);
-    err = tar_open_archive (tar_file);
+    if (archive_parsed)
+      err = tar_parse_end ();
+    else if ((tarfs_options.compress == COMPRESS_NONE) && !meta_load ())
+      err = 0;
+    else
+    {
+      /* Save the headers to the metadata index while parsing them.
+	 Failing to save the index is not an error.  */
+      int saving = !meta_begin ();
+
+      if (saving)
+	tar_header_hook = meta_add_header;
+      err = tar_open_archive (tar_file);
+      tar_header_hook = tarfs_add_header;
+      if (saving)
+	meta_end (!err);
+    }
     mutex_unlock (&tar_file_lock);
 
+    /* The directory index is only used while parsing */
+    parse_dirs_free ();
+
+    {
+      struct names_stats stats;
+
+      names_get_stats (&stats);
+      debug (("User and group names: %zu lookups, %zu hits (%.1f%%)",
+	      stats.lookups, stats.hits,
+	      stats.lookups ? 100. * stats.hits / stats.lookups : 0.));
+    }
+
     if (err)
       error (1, 0, "Invalid tar archive (%s)", tarfs_options.file_name);
 #if 0
@@ -566,17 +1895,30 @@ tarfs_init (struct node **root, struct iouser *user)
   err = fs_make_node (&netfs_root_node, NULL, NULL, st.st_mode);
   if (err)
     return err;
+  root_entry.tar.node = netfs_root_node;
+  root_entry.flags = ENTRY_BUILT;
 
   /* Parse the archive and build the filesystem */
   cache_init (read_from_file);
   tar_header_hook = tarfs_add_header;
   tar_list_init (&tar_list);
 
-  /* Open the corresponding store */
+  /* Start the worker threads used by the zip stores */
+  err = workers_init (0);
+  if (err)
+    error (0, err, "Could not start worker threads");
+
+  /* Open the corresponding store.  Zip stores get traversed when opened:
+     parse the archive at the same time.  */
+  tar_parse_init ();
+  store_gzip_traverse_hook = store_bzip2_traverse_hook = parse_traversed;
+
   err = open_store ();
   if (err)
     error (1, err, "%s", tarfs_options.file_name);
 
+  store_gzip_traverse_hook = store_bzip2_traverse_hook = NULL;
+
   assert (tar_file);
 
   /* We make the following assumption because this is the way it's gotta
@@ -590,134 +1932,162 @@ tarfs_init (struct node **root, struct iouser *user)
     else
       read_archive ();
   }
+  else
+    /* Only new archives can be written as files get closed */
+    streaming = tarfs_options.stream && !tarfs_options.volatil;
 
   return 0;
 }
 
 
+/* Returns NODE, or the first named node following it, if NODE is
+   anonymous (created by dir_mkfile ()), or NULL.  */
+static inline struct node *
+named_node (struct node *node)
+{
+  while (node && (! node->nn->name))
+    node = node->next;
+
+  return node;
+}
+
 int
-tarfs_set_cd (struct node *dir)
+tarfs_set_cd (struct dir_cursor *cursor, struct node *dir)
 {
-  curr_dir = dir;
-  curr_node = dir->nn->entries;
+  expand_node (dir);
 
-  /* Skip anonymous nodes (created by dir_mkfile ()).  */
-  while (curr_node && (! curr_node->nn->name))
-    curr_node = curr_node->next;
+  cursor->dir = dir;
+  cursor->node = named_node (dir->nn->entries);
+  cursor->entry = 0;
 
-  curr_entry = 0;
   return 0;
 }
 
+/* Skips the N first entries of CURSOR's directory.  The number of the
+   last entry returned by a scan of the directory, and the entry itself,
+   are kept in the directory (until one of its entries is removed) so that
+   a scan which resumes where the previous one stopped, which is what
+   clients listing a directory a few entries at a time do, doesn't have to
+   skip them one by one.  */
 int
-tarfs_skip_entries (int n)
+tarfs_skip_entries (struct dir_cursor *cursor, int n)
 {
-  assert (n >= 0);
+  struct node *dir = cursor->dir;
 
-  /* Skip N first DIR entries. */
-  curr_node = curr_dir->nn->entries;
+  assert (n >= 0);
 
-  if (n > 2)
+  if ((n > 2) && dir->nn->scan_node && (dir->nn->scan_entry == n - 1))
+  {
+    /* Resume after the last entry returned */
+    cursor->node = named_node (dir->nn->scan_node->next);
+    cursor->entry = n;
+  }
+  else if (n > 2)
   {
     /* Skip more than `.' and `..' */
-    curr_entry = 2;
-    while ((curr_entry < n) && (curr_node))
+    cursor->entry = 2;
+    while ((cursor->entry < n) && (cursor->node))
     {
-      /* Skip anonymous nodes (created by dir_mkfile ()).  */
-      do
-	curr_node = curr_node->next;
-      while (curr_node && (! curr_node->nn->name));
-
-      curr_entry++;
+      cursor->node = named_node (cursor->node->next);
+      cursor->entry++;
     }
   }
   else
-    curr_entry = n;
+    cursor->entry = n;
   
   /* Returns non-null if could not skip N entries. */
-  return (curr_entry<=n)?0:1;
+  return (cursor->entry < n) ? 1 : 0;
 }
 
+/* Writes to BUF, which is *SIZE bytes long, the dirent of node N, named
+   NAME (NAMELEN bytes long), if it fits, and sets *SIZE to its size.
+   N==NULL means that we are considering the parent of the node on which
+   the translator is set.  Returns non-zero if it didn't fit.  */
 static inline int
-_new_dirent (struct dirent** e, const struct node *n, const char* nodename)
+_new_dirent (char *buf, size_t *size, const struct node *n,
+	     const char *name, size_t namelen)
 {
-  size_t namelen;
-  char*  name;
+  struct dirent *e = (struct dirent *) buf;
+  size_t reclen = DIRENT_SIZE (namelen);
+  int fits = (reclen <= *size);
 
-  assert (nodename != NULL);
+  assert (name != NULL);
+  assert (namelen != 0);
 
-  /* N==NULL means that we are considering the node on which the
-     translator is set.  */
-  namelen = (n) ? strlen (nodename) : 2;
+  *size = reclen;
+  if (! fits)
+    return 1;
 
-  /* Allocate it. */
-  *e = mmap (NULL, sizeof (struct dirent) + namelen,
-	     PROT_READ|PROT_WRITE, MAP_ANONYMOUS, 0, 0);
-  assert (*e != NULL);
-  
   /* Copy node name */
-  name = &(*e)->d_name[0];
+  memcpy (e->d_name, name, namelen);
+  memset (&e->d_name[namelen], 0,
+	  reclen - offsetof (struct dirent, d_name) - namelen);
 
   if (n == NULL)
   {
     /* `..' */
-    memcpy (name, nodename, 3);
-    namelen = 2;
-    (*e)->d_type = DT_DIR;
-    (*e)->d_ino  = netfs_root_node->nn_stat.st_ino;
+    e->d_type = DT_DIR;
+    e->d_ino  = netfs_root_node->nn_stat.st_ino;
   }
   else
   {
-    memcpy (name, nodename, namelen);
-
     /* Set the type corresponding to n->nn_stat.st_mode */
     if (n->nn_stat.st_mode & S_IFREG)
-      (*e)->d_type = DT_REG;
+      e->d_type = DT_REG;
     else if (n->nn_stat.st_mode & S_IFDIR)
-      (*e)->d_type = DT_DIR;
+      e->d_type = DT_DIR;
     else if (n->nn_stat.st_mode & S_IFLNK)
-      (*e)->d_type = DT_LNK;
+      e->d_type = DT_LNK;
     else
-      (*e)->d_type = DT_UNKNOWN;
+      e->d_type = DT_UNKNOWN;
 
     /* if FILENO==0 then the node won't appear. */
-    (*e)->d_fileno = n->nn_stat.st_ino;
+    e->d_fileno = n->nn_stat.st_ino;
   }
 
-  assert (namelen != 0);
-
-  (*e)->d_namlen = namelen;
-  (*e)->d_reclen = sizeof (struct dirent) + namelen;
+  e->d_namlen = namelen;
+  e->d_reclen = reclen;
 
   return 0;
 }
 
 int
-tarfs_get_next_entry (struct dirent **entry)
+tarfs_get_next_entry (struct dir_cursor *cursor, char *buf, size_t *size)
 {
-  switch (curr_entry++)
+  struct node *dir = cursor->dir;
+  const char *name;
+
+  switch (cursor->entry)
   {
     case 0:
-      _new_dirent (entry, curr_dir, ".");
+      if (_new_dirent (buf, size, dir, ".", 1))
+	return 0;	/* BUF is too small */
       break;
     case 1:
-      _new_dirent (entry, curr_dir->nn->dir, "..");
+      if (_new_dirent (buf, size, dir->nn->dir, "..", 2))
+	return 0;
       break;
     default:
-      if (!curr_node)
+      if (!cursor->node)
 	return 1;	/* no more entries */
       else
       {
-	_new_dirent (entry, curr_node, curr_node->nn->name);
+	/* Names are interned, so their length is known beforehand */
+	name = cursor->node->nn->name;
+	if (_new_dirent (buf, size, cursor->node, name, arena_name_len (name)))
+	  return 0;
+
+	/* Remember where this scan stands (see tarfs_skip_entries ()) */
+	dir->nn->scan_node = cursor->node;
+	dir->nn->scan_entry = cursor->entry;
 
-	/* Skip anonymous nodes (created by dir_mkfile ()).  */
-	do
-	  curr_node = curr_node->next;
-	while (curr_node && (! curr_node->nn->name));
+	cursor->node = named_node (cursor->node->next);
       }
       break;
   }
 
+  cursor->entry++;
+
   return 0;
 }
 
@@ -725,19 +2095,12 @@ tarfs_get_next_entry (struct dirent **entry)
 error_t
 tarfs_lookup_node (struct node** node, struct node* dir, const char* name)
 {
-  struct node *n = dir->nn->entries;
-
-  /* Look for NAME in DIR entries. */
-  while (n)
-  {
-    char *this = n->nn->name;
+  struct node *n;
 
-    if (this)
-      if (!strcmp (this, name))
-        break;
+  expand_node (dir);
 
-    n = n->next;
-  }
+  /* Look for NAME in DIR entries (this uses DIR's hash table if any) */
+  n = fs_find_node (dir, (char *) name);
 
   *node = n;
 
@@ -819,7 +2182,7 @@ tarfs_change_stat (struct node *node, const io_statbuf_t *st)
 
 
 /* Create a node named NAME in directory DIR. If NEWNODE is non-zero then
-   it will point to the new node.  NAME is duplicated.  */
+   it will point to the new node.  NAME gets interned by fs_make_node ().  */
 error_t
 tarfs_create_node (struct node **newnode, struct node *dir,
 		   char *name, mode_t mode)
@@ -829,6 +2192,11 @@ tarfs_create_node (struct node **newnode, struct node *dir,
 
   IF_RWFS;
 
+  expand_node (dir);
+
+  /* The files created before this one may have been closed meanwhile */
+  stream_items (dir);
+
   /* Allow anonymous (nameless) nodes (created by dir_mkfile ()).  */
   if (name)
   {
@@ -856,7 +2224,7 @@ tarfs_create_node (struct node **newnode, struct node *dir,
     return err;
   }
 
-  err = fs_make_node (&new, dir, strdup (name), mode);
+  err = fs_make_node (&new, dir, name, mode);
   if (!err && new)
   {
     struct tar_item *tar, *prev_tar;
@@ -870,6 +2238,8 @@ tarfs_create_node (struct node **newnode, struct node *dir,
 	 Offset `-1' denotes a note that does not exist inside the tar file.  */
       err = tar_make_item (&tar, new, 0, -1);
       assert_perror (err);
+      TAR_ENTRY (tar)->dir = node_entry (dir);
+      TAR_ENTRY (tar)->name = new->nn->name;
 
       /* Find a place to put TAR.  */
       tar_put_item (&prev_tar, tar);
@@ -895,6 +2265,9 @@ tarfs_unlink_node (struct node *node)
 
   debug (("Unlinking %s", node->nn->name));
 
+  /* A directory is empty only if it has no entries at all */
+  expand_node (node);
+
   /* Delete NODE.  */
   err = fs_unlink_node (node);
   if (err)
@@ -931,6 +2304,8 @@ tarfs_link_node (struct node *dir, struct node *target,
   struct tar_item *prev_tar, *tar;
   struct node *new;
 
+  expand_node (dir);
+
   if (fs_find_node (dir, name))
     return excl ? EEXIST : 0;
 
@@ -939,16 +2314,17 @@ tarfs_link_node (struct node *dir, struct node *target,
   if (!target->nn->name)
   {
     new = target;
-    new->nn->name = strdup (name);
+    err = fs_name_node (new, name);
 
     /* Insert NEW into the tar list */
-    err = tar_make_item (&tar, new, 0, -1);
+    if (!err)
+      err = tar_make_item (&tar, new, 0, -1);
     if (!err)
       tar_put_item (&prev_tar, tar);
   }
   else
   {
-    err = fs_hard_link_node (&new, dir, strdup (name),
+    err = fs_hard_link_node (&new, dir, name,
 			     target->nn_stat.st_mode, target);
     if (! err && new)
     {
@@ -978,6 +2354,8 @@ tarfs_link_node (struct node *dir, struct node *target,
   {
     tar_insert_item (&tar_list, prev_tar, tar);
     NODE_INFO(new)->tar = tar;
+    TAR_ENTRY (tar)->dir = node_entry (new->nn->dir);
+    TAR_ENTRY (tar)->name = new->nn->name;
   }
 
   return err;
@@ -1026,10 +2404,22 @@ cache_ahead (struct tar_item *curr_tar, off_t offs, size_t size)
 
   do
   {
-    /* Looks for an item available in the tar file.  */
+    /* Looks for an item available in the tar file.  The node of an entry
+       which was never looked at gets built if its records are to be
+       overwritten.  */
     while (curr_tar)
       if ((curr_tar->offset != -1) && (curr_tar->node))
 	break;
+      else if ((curr_tar->offset != -1)
+	       && (!(TAR_ENTRY (curr_tar)->flags & ENTRY_BUILT)))
+      {
+	if (curr_tar->offset >= offs + size)
+	  /* Neither this one nor the following ones will be */
+	  return 0;
+	mutex_lock (&entries_lock);
+	entry_node (TAR_ENTRY (curr_tar));
+	mutex_unlock (&entries_lock);
+      }
       else
         curr_tar = curr_tar->next;
 
@@ -1063,204 +2453,418 @@ cache_ahead (struct tar_item *curr_tar, off_t offs, size_t size)
   return err;
 }
 
-/* Store the filesystem into the tar file.  */
-error_t
-tarfs_sync_fs (int wait)
+/* Dump BUF to the tar file's store, enlarging it if necessary.  */
+static error_t
+tar_write (off_t offset, void *buf, size_t len, size_t *amount)
 {
   error_t err = 0;
-  char buf[RECORDSIZE];
-  off_t  file_offs = 0; /* Current offset in the tar file */
-  size_t orig_size = 0;	/* Total original tar file size */
-  int need_trailing_block = 0; /* Do we need an additional block at the end? */
-  struct tar_item *tar;
+  int cnt = 0;
 
-  /* Dump BUF to the tar file's store, enlarging it if necessary.  */
-  error_t
-  tar_write (off_t offset, void *buf, size_t len, size_t *amount)
+  while (1)
   {
-    error_t err = 0;
-    int cnt = 0;
+    mutex_lock (&tar_file_lock);
 
-    while (1)
+    if (!tar_file)
+      err = open_store ();
+
+    if (!err)
+      err = store_write (tar_file, offset, buf, len, amount);
+
+    /* The metadata index does not match anymore */
+    meta_valid = 0;
+
+    mutex_unlock (&tar_file_lock);
+
+    cnt++;
+
+    if (! err)
+      break;
+    if (cnt > 1)
+      break;
+
+    if (err == EIO)
     {
-      mutex_lock (&tar_file_lock);
+      /* Try to enlarge the file.  */
+      debug (("Enlarging file from %lli to %lli",
+	     tar_file->size, offset + len));
+      err = store_set_size (tar_file, offset + len);
+      if (err)
+	break;
+    }
+  }
+
+  if (err)
+    error (0, err,
+	   "Could not write to file (offs="OFF_FMT")", offset);
 
-      if (!tar_file)
-	err = open_store ();
+  return err;
+}
 
-      if (!err)
-	err = store_write (tar_file, offset, buf, len, amount);
+/* Write the records of NODE, whose contents start at offset START of
+   the tar file, covering its range [OFFS, END).  END must be a multiple
+   of RECORDSIZE.  If AHEAD is non-zero then the nodes following TAR,
+   NODE's item, which would be overwritten get cached first.  The
+   records are written SYNC_CHUNK_SIZE bytes at a time through CHUNK, so
+   that the contents which were spilled (see cache_set_spill ()) are
+   streamed from the spill file to the archive.  */
+static error_t
+write_records (struct tar_item *tar, struct node *node, off_t start,
+	       off_t offs, off_t end, int ahead, char *chunk)
+{
+  error_t err = 0;
 
-      mutex_unlock (&tar_file_lock);
+  offs -= offs % RECORDSIZE;
+  while (offs < end)
+  {
+    size_t len = (end - offs > SYNC_CHUNK_SIZE)
+		 ? SYNC_CHUNK_SIZE
+		 : end - offs;
+    size_t amount;
 
-      cnt++;
+    if (ahead)
+    {
+      /* Cache everything that will be overlapped.  */
+      err = cache_ahead (tar, start + offs, len);
+      if (err)
+	break;
+    }
 
-      if (! err)
-        break;
-      if (cnt > 1)
-        break;
+    err = cache_read (node, offs, len, chunk, &amount);
+    if (err)
+      break;
 
-      if (err == EIO)
-      {
-        /* Try to enlarge the file.  */
-        debug (("Enlarging file from %lli to %lli",
-               tar_file->size, offset + len));
-        err = store_set_size (tar_file, offset + len);
-        if (err)
-          break;
-      }
+    /* Last record: fill it with zeros if necessary.  */
+    if (amount < len)
+    {
+      assert (offs + len == end);
+      bzero (&chunk[amount], len - amount);
     }
 
+    /* Write whole records, regardless of the amount of data
+       actually read.  */
+    err = tar_write (start + offs, chunk, len, &amount);
     if (err)
-      error (0, err,
-	     "Could not write to file (offs="OFF_FMT")", file_offs);
+      break;
+
+    assert (amount == len);
+    offs += len;
+  }
+
+  return err;
+}
+
+/* Write the records of NODE, whose contents start at offset START of
+   the tar file and whose records end at offset END of NODE, which were
+   modified since NODE was last synced.  This assumes that NODE's
+   records were not moved.  */
+static error_t
+write_changes (struct tar_item *tar, struct node *node, off_t start,
+	       off_t end, char *chunk)
+{
+  error_t err;
+  struct cache_extent *extents, *e;
+  off_t done = 0;	/* Records before this were written */
 
+  err = cache_get_extents (node, &extents);
+  if (err)
     return err;
+
+  for (e = extents; (!err) && e; e = e->next)
+  {
+    off_t offs = e->start - (e->start % RECORDSIZE);
+    off_t to = round_size (e->end);
+
+    if (to > end)
+      to = end;
+    if (offs < done)
+      offs = done;
+
+    if (offs < to)
+      err = write_records (tar, node, start, offs, to, 0, chunk);
+    if (to > done)
+      done = to;
   }
 
+  if ((!err) && (node->nn_stat.st_size != tar->orig_size))
+  {
+    /* NODE was resized within its last record, whose end must be
+       padded with zeros.  */
+    off_t offs = end - RECORDSIZE;
+
+    if (offs < done)
+      offs = done;
+    if (offs < end)
+      err = write_records (tar, node, start, offs, end, 0, chunk);
+  }
 
-  /* Traverse the tar items list and sync them.  */
-  tar_list_lock (&tar_list);
+  cache_free_extents (extents);
 
-  for (tar = tar_list_head (&tar_list);
-       tar;
-       /* TAR is incremented inside the loop */ )
+  return err;
+}
+
+/* Sync TAR, an item whose node is locked, to offset *FILE_OFFS of the tar
+   file and update *FILE_OFFS to the end of its records.  CHUNK is a buffer
+   of SYNC_CHUNK_SIZE bytes.  */
+static error_t
+sync_item (struct tar_item *tar, off_t *file_offs, char *chunk)
+{
+  error_t err = 0;
+  struct node *node = tar->node;
+  char buf[RECORDSIZE];
+  int have_to_sync;
+  char *path;
+  size_t size;
+
+  have_to_sync = (tar->offset != *file_offs + RECORDSIZE);
+  path = fs_get_path_from_root (netfs_root_node, node);
+  size = node->nn_stat.st_size;
+
+  /* Round SIZE.  */
+  size = round_size (size);
+
+  /* Synchronize NODE's stat.  */
+  if ((NODE_INFO(node)->stat_changed) ||
+      (node->nn_stat.st_size != tar->orig_size) ||
+      (have_to_sync))
   {
-    struct node *node = tar->node;
+    size_t amount;
+    char *target;
 
-    /* Compute the original tar file size.  */
-    if (tar->offset != -1)
-      orig_size += round_size (tar->orig_size) + RECORDSIZE;
+    debug (("%s: syncing stat", path));
+
+    /* Cache all the nodes that would have been overwritten otherwise.  */
+    err = cache_ahead (tar, *file_offs, RECORDSIZE);
+    if (err)
+      goto out;
 
-    if (node)
+    target = node->nn->hardlink
+	     ? fs_get_path_from_root (netfs_root_node, node->nn->hardlink)
+	     : NULL;
+
+    /* Create and write the corresponding tar header.  */
+    tar_make_header ((tar_record_t *)buf, &node->nn_stat,
+		     path, node->nn->symlink, target);
+
+    err = tar_write (*file_offs, buf, RECORDSIZE, &amount);
+    if (err)
+      goto out;
+
+    assert (amount == RECORDSIZE);
+
+    /* The header now matches NODE's stat */
+    NODE_INFO(node)->stat_changed = 0;
+    entry_set_header (TAR_ENTRY (tar), (tar_record_t *) buf);
+  }
+  *file_offs += RECORDSIZE;
+
+  /* Synchronize NODE's contents except if it's a directory/link.  */
+  if ((! S_ISDIR (node->nn_stat.st_mode))
+      && (! node->nn->symlink)
+      && (! node->nn->hardlink)
+      && ((! cache_synced (node)) || (have_to_sync)
+	  || (node->nn_stat.st_size != tar->orig_size)) )
+  {
+    off_t  start = *file_offs; /* NODE's start */
+
+    /* We don't need to cache_ahead () if we already are more than
+       one chunk behind the original item since we write only
+       SYNC_CHUNK_SIZE bytes at a time.  */
+    int ahead = (tar->offset - (long)start < SYNC_CHUNK_SIZE);
+
+    if ((! have_to_sync) && (size == round_size (tar->orig_size)))
+    {
+      /* NODE's records did not move: only write those which
+	 changed.  */
+      debug (("%s: syncing changes (%i bytes)", path, size));
+      err = write_changes (tar, node, start, size, chunk);
+    }
+    else
     {
-      int have_to_sync;
-      char *path;
-      size_t size;
+      debug (("%s: syncing contents (%i bytes)", path, size));
+      err = write_records (tar, node, start, 0, size, ahead, chunk);
+    }
 
-      /* Lock the node first */
-      mutex_lock (&node->lock);
-      have_to_sync = (tar->offset != file_offs + RECORDSIZE);
-      path = fs_get_path_from_root (netfs_root_node, node);
-      size = node->nn_stat.st_size;
+    if (err)
+      goto out;
 
-      /* Round SIZE.  */
-      size = round_size (size);
+    *file_offs = start + size;
 
-      /* Synchronize NODE's stat.  */
-      if ((NODE_INFO(node)->stat_changed) ||
-	  (node->nn_stat.st_size != tar->orig_size) ||
-	  (have_to_sync))
-      {
-	size_t amount;
-	char *target;
+    /* Update NODE's offset *after* cache_ahead () !  */
+    tar->offset = start;
 
-	debug (("%s: syncing stat", path));
+    /* Update the original item size.  */
+    tar->orig_size = node->nn_stat.st_size;
+  }
+  else
+  {
+    /* Update NODE's offset.  */
+    tar->offset = *file_offs;
 
-	/* Cache all the nodes that would have been overwritten otherwise.  */
-	err = cache_ahead (tar, file_offs, RECORDSIZE);
-	if (err)
-	  break;
+    /* Its header may have been written with a new size */
+    tar->orig_size = node->nn_stat.st_size;
 
-	target = node->nn->hardlink
-		 ? fs_get_path_from_root (netfs_root_node, node->nn->hardlink)
-		 : NULL;
+    /* Skip record anyway.  */
+    *file_offs += size;
+  }
 
-	/* Create and write the corresponding tar header.  */
-	tar_make_header ((tar_record_t *)buf, &node->nn_stat,
-			 path, node->nn->symlink, target);
+  /* NODE's cache blocks now match the archive */
+  cache_mark_clean (node);
 
-	err = tar_write (file_offs, buf, RECORDSIZE, &amount);
-	if (err)
-	  break;
+out:
+  free (path);
+  return err;
+}
+
+/* Write the new items which follow the last item written to the tar file,
+   as long as their node is not open anymore, after it, and release their
+   cache.  Compressed archives get compressed up to there (see
+   store_gzip_flush ()).  LOCKED is a node which the caller holds
+   locked.  */
+static void
+stream_items (struct node *locked)
+{
+  error_t err = 0;
+  struct tar_item *tar;
+  char *chunk;
+  off_t offs;
 
-	assert (amount == RECORDSIZE);
+  if (!streaming)
+    return;
 
-	/* Never finish the tar file with a stat record.  */
-	need_trailing_block = 1;
-      }
-      file_offs  += RECORDSIZE;
+  if (!mutex_try_lock (&tar_list.lock))
+    /* The archive is being synced */
+    return;
 
-      /* Synchronize NODE's contents except if it's a directory/link.  */
-      if ((! S_ISDIR (node->nn_stat.st_mode))
-          && (! node->nn->symlink)
-          && (! node->nn->hardlink)
-	  && ((! cache_synced (node)) || (have_to_sync)) )
-      {
-	off_t  start = file_offs; /* NODE's start */
-	off_t  offs = 0; /* Offset in NODE */
+  chunk = malloc (SYNC_CHUNK_SIZE);
+  if (!chunk)
+  {
+    tar_list_unlock (&tar_list);
+    return;
+  }
 
-	/* We don't need to cache_ahead () if we already are more than
-	   one block behind the original item since we write only
-	   RECORDSIZE bytes record.  */
-	int ahead = (tar->offset - (long)start < RECORDSIZE);
+  for (tar = stream_tar ? stream_tar->next : tar_list_head (&tar_list);
+       tar && tar->node && (tar->offset == -1);
+       tar = tar->next)
+  {
+    struct node *node = tar->node;
 
-	debug (("%s: syncing contents (%i bytes)", path, size));
+    if ((node != locked) && (!mutex_try_lock (&node->lock)))
+      break;
 
-	/* Write RECORDSIZE-long blocks.  */
-	while (offs < size)
-	{
-	  size_t amount;
-	  
-	  if (ahead)
-	  {
-	    /* Cache everything that will be overlapped.  */
-	    err = cache_ahead (tar, file_offs, RECORDSIZE);
-	    if (err)
-	      break;
-	  }
+    /* The only reference to a regular file which was closed is that of
+       its directory.  */
+    if (S_ISREG (node->nn_stat.st_mode) && (node->references > 1))
+    {
+      if (node != locked)
+	mutex_unlock (&node->lock);
+      break;
+    }
 
-	  err = cache_read (node, offs, RECORDSIZE, buf, &amount);
-	  assert_perror (err);
+    debug (("Streaming %s at "OFF_FMT, node->nn->name, stream_offs));
+    err = sync_item (tar, &stream_offs, chunk);
+    if (!err)
+      cache_release (node);
 
-	  /* Last block: fill it with zeros if necessary.  */
-	  if (amount < RECORDSIZE)
-	  {
-	    assert (offs + RECORDSIZE == size);
-	    bzero (&buf[amount], RECORDSIZE - amount);
-	  }
+    if (node != locked)
+      mutex_unlock (&node->lock);
 
-	  /* Write the whole record, regardless of the amount of data
-	     actually read.  */
-	  err = tar_write (file_offs, buf, RECORDSIZE, &amount);
-	  if (err)
-	    break;
+    if (err)
+      break;
 
-	  assert (amount == RECORDSIZE);
+    stream_tar = tar;
+  }
 
-	  offs += RECORDSIZE;
-	  file_offs += RECORDSIZE;
-	}
+  if (err)
+  {
+    /* The archive will be written as a whole when synced */
+    error (0, err, "Could not stream to the archive");
+    streaming = 0;
+  }
 
-	if (err)
-	  break;
+  offs = stream_offs;
+  tar_list_unlock (&tar_list);
+  free (chunk);
 
-	/* Update NODE's offset *after* cache_ahead () !  */
-	tar->offset = start;
+  if ((!err) && (tarfs_options.compress != COMPRESS_NONE))
+  {
+    mutex_lock (&tar_file_lock);
+    if (tar_file)
+      err = (tarfs_options.compress == COMPRESS_GZIP)
+	    ? store_gzip_flush (tar_file, offs)
+	    : store_bzip2_flush (tar_file, offs);
+    mutex_unlock (&tar_file_lock);
 
-	/* Update the original item size.  */
-	tar->orig_size = node->nn_stat.st_size;
+    /* The archive may have been synced already */
+    if (err && (err != EOPNOTSUPP))
+      error (0, err, "Could not compress the archive");
+  }
+}
 
-	/* If this is the last tar item, tell whether we need an additional
-	   trailing block: if NODE's size is a RECORDSIZE multiple then we
-	   need one.  */
-	need_trailing_block = ! (tar->orig_size % RECORDSIZE);
-      }
-      else
-      {
-	/* Update NODE's offset.  */
-	tar->offset = file_offs;
+/* Store the filesystem into the tar file.  The entries which were never
+   looked at are left as they are, unless they have to be moved.  */
+error_t
+tarfs_sync_fs (int wait)
+{
+  error_t err = 0;
+  char buf[RECORDSIZE];
+  char *chunk;		/* Buffer of SYNC_CHUNK_SIZE bytes */
+  off_t  file_offs = 0; /* Current offset in the tar file */
+  size_t orig_size = 0;	/* Total original tar file size */
+  struct tar_item *tar, *last = NULL;
+  int restamp = 0;	/* Whether the metadata index is up to date */
+  int saving = 0;	/* Whether it is being saved */
 
-        /* Skip record anyway.  */
-        file_offs += RECORDSIZE * ((node->nn_stat.st_size / RECORDSIZE)
-                     + ( (node->nn_stat.st_size % RECORDSIZE) ? 1 : 0 ));
-      }
+  chunk = malloc (SYNC_CHUNK_SIZE);
+  if (!chunk)
+    return ENOMEM;
+
+  /* Traverse the tar items list and sync them.  */
+  tar_list_lock (&tar_list);
+
+  for (tar = tar_list_head (&tar_list);
+       tar;
+       /* TAR is incremented inside the loop */ )
+  {
+    struct node *node;
+    int built;
+
+    /* Compute the original tar file size.  */
+    if (tar->offset != -1)
+      orig_size += round_size (tar->orig_size) + RECORDSIZE;
+
+    /* Build the node of an entry which has to be moved, or which is a
+       symlink (whose size, that of its target, is not that of its
+       member).  */
+    mutex_lock (&entries_lock);
+    node = tar->node;
+    built = TAR_ENTRY (tar)->flags & ENTRY_BUILT;
+    if ((!built)
+	&& ((tar->offset != file_offs + RECORDSIZE)
+	    || S_ISLNK (TAR_ENTRY (tar)->mode)))
+      node = entry_node (TAR_ENTRY (tar));
+    mutex_unlock (&entries_lock);
+
+    if ((!node) && (!built))
+    {
+      /* Leave it as it is */
+      file_offs = tar->offset + round_size (tar->orig_size);
 
-      cache_free (node);
-      free (path);
+      /* Go to next item.  */
+      last = tar;
+      tar = tar->next;
+    }
+    else if (node)
+    {
+      /* Lock the node first */
+      mutex_lock (&node->lock);
+      err = sync_item (tar, &file_offs, chunk);
       mutex_unlock (&node->lock);
 
+      if (err)
+	break;
+
       /* Go to next item.  */
+      last = tar;
       tar = tar->next;
     }
     else
@@ -1268,14 +2872,34 @@ tarfs_sync_fs (int wait)
       struct tar_item *next = tar->next;
       debug (("Node removed (size=%i)", tar->orig_size));
       tar_unlink_item_safe (&tar_list, tar);
+      meta_valid = 0;
 
       /* Go to next item.  */
       tar = next;
     }
   }
 
-  tar_list_unlock (&tar_list);
+  if (err)
+    /* Items may have been freed or moved */
+    streaming = 0;
+  else
+  {
+    /* Streaming goes on after the last item */
+    stream_tar  = last;
+    stream_offs = file_offs;
+  }
 
+  /* Save the headers which were synced to the metadata index unless it
+     still matches, in which case only the trailing records change.  The
+     list is kept locked till then so that nothing gets streamed.  */
+  if (!err)
+  {
+    restamp = meta_valid;
+    saving = (!restamp) && (!meta_begin ());
+    if (saving)
+      for (tar = tar_list_head (&tar_list); tar; tar = tar->next)
+	meta_add_item (tar);
+  }
 
   /* Add an empty record (FIXME: GNU tar added several of them) */
   if (!err)
@@ -1314,8 +2938,18 @@ tarfs_sync_fs (int wait)
     /* Call store_free () to commit the changes. This is actually only useful
        for zip stores.  */
     close_store ();
+
+    if (restamp)
+      meta_restamp ();
   }
 
+  /* Failing to save the metadata index is not an error */
+  if (saving)
+    meta_end (!err);
+  tar_list_unlock (&tar_list);
+
+  free (chunk);
+
   return err;
 }
 
@@ -1335,6 +2969,14 @@ tarfs_go_away ()
   if (tar_file)
     store_close_source (tar_file);
 
+  {
+    struct cache_stats stats;
+
+    cache_get_stats (&stats);
+    debug (("Readahead: %zu blocks, %zu used, %zu wasted",
+	    stats.readahead, stats.readahead_hits, stats.readahead_wasted));
+  }
+
   debug (("Bye!"));
 
   return 0;
@@ -42,6 +42,12 @@ struct tarfs_opts
   int   threaded:1;	/* tells whether archive should be parsed in
 			   another thread to avoid startup timeout.  */
   int   interval;	/* Sync interval (in seconds) */
+  size_t cache_size;	/* Maximum amount of cached data (in bytes) */
+  size_t block_size;	/* Size of the cache blocks of large files */
+  size_t zip_block_size;	/* Size of the zip stores' cache blocks */
+  size_t spill_high;	/* Spill watermarks (see cache_set_spill ()) */
+  size_t spill_low;
+  int   stream:1;	/* TRUE to write files as soon as they are closed */
 };
 
 /* Compression types */
@@ -73,6 +79,55 @@ struct tar_item
   struct tar_item *next;
 };
 
+/* Archive members are recorded as entries, which are their tar items and
+   hold what their nodes get built from.  The nodes of a directory's
+   entries are only built the first time the directory is looked into (see
+   tarfs.c), so that a member which is never accessed costs its entry
+   only.  Entries are cut out of a slab (see slab.c); those of the
+   nodes created afterwards just serve as their tar items.  */
+struct tarfs_entry
+{
+  /* Tar item of the entry (must be first) */
+  struct tar_item tar;
+
+  /* Parent directory.  Along with the name, it gives the entry's path,
+     with which its header is saved to the metadata index.  */
+  struct tarfs_entry *dir;
+
+  /* Last entry of a directory and next entry of the same directory: the
+     entries of a directory make a ring, the first one following the last
+     one.  These are not used anymore once the nodes of the directory
+     have been built.  */
+  struct tarfs_entry *entries;
+  struct tarfs_entry *next;
+
+  /* Name of the entry and target of a symlink or hard link, both
+     interned (see arena.h) */
+  const char *name;
+  const char *target;
+
+  /* Stat of the member, as found in its header (or as last written to
+     it, see entry_set_header ()) */
+  mode_t mode;
+  uid_t  uid;
+  gid_t  gid;
+  dev_t  rdev;
+  time_t mtime, atime, ctime;
+
+  /* Number of subdirectories (directories) and flags (see below) */
+  nlink_t subdirs;
+  int flags;
+};
+
+/* Entry flags */
+#define ENTRY_HEADER    0x1	/* the stat was found in a header */
+#define ENTRY_BUILT     0x2	/* the node was built (and may be gone) */
+#define ENTRY_EXPANDED  0x4	/* the nodes of its entries were built */
+#define ENTRY_LINK      0x8	/* the member is a hard link */
+
+/* Returns the entry whose tar item is TAR.  */
+#define TAR_ENTRY(Tar)  ((struct tarfs_entry *) (Tar))
+
 /* Struct tar_list represents a list of tar items.  */
 struct tar_list
 {
@@ -86,6 +141,9 @@ struct tar_list
 /* Initialize LIST.  */
 extern void tar_list_init (struct tar_list *list);
 
+/* Returns a new zeroed entry in NEW.  */
+extern error_t tar_make_entry (struct tarfs_entry **new);
+
 /* Make a tar item containing the given information. NEW points to the
    newly created item.  */
 extern error_t tar_make_item (struct tar_item **new_item,
@@ -28,15 +28,33 @@
 
 #include "tarfs.h"
 #include "fs.h"
+#include "slab.h"
 #include "debug.h"
 
 
+/* Entries (and thus tar items) are allocated from this slab cache */
+static struct slab_cache entries_slab;
+
 /* Initialize LIST.  */
 void
 tar_list_init (struct tar_list *list)
 {
   list->head = NULL;
   mutex_init (&list->lock);
+  slab_cache_init (&entries_slab, sizeof (struct tarfs_entry));
+}
+
+/* Returns a new zeroed entry in NEW.  */
+error_t
+tar_make_entry (struct tarfs_entry **new)
+{
+  *new = slab_alloc (&entries_slab);
+  if (! *new)
+    return ENOMEM;
+
+  bzero (*new, sizeof (struct tarfs_entry));
+
+  return 0;
 }
 
 /* Make a tar item containing the given information. NEW points to the
@@ -45,11 +63,17 @@ error_t
 tar_make_item (struct tar_item **new_item,
 	       struct node *node, size_t orig_size, off_t offset)
 {
+  struct tarfs_entry *entry;
   struct tar_item *new;
+  error_t err;
 
-  new = calloc (1, sizeof (struct tar_item));
-  if (! new)
-    return ENOMEM;
+  err = tar_make_entry (&entry);
+  if (err)
+    return err;
+
+  /* NODE is there already, and so will be the nodes of its entries */
+  entry->flags = ENTRY_BUILT | ENTRY_EXPANDED;
+  new = &entry->tar;
 
   assert (node != NULL);
   new->orig_size = orig_size;
@@ -130,7 +154,7 @@ tar_unlink_item_safe (struct tar_list *list, struct tar_item *item)
   }
 
   /* Free ITEM.  */
-  free (item);
+  slab_free (&entries_slab, TAR_ENTRY (item));
 }
 
 void
@@ -173,52 +197,31 @@ tar_put_item (struct tar_item **prev_tar, struct tar_item *tar)
        3: dir/file2
        4: NEWNODE.  */
 
-  last_entry = dir->nn->entries;
+  /* Get a reference to DIR's last entry other than NODE.  */
+  if (fs_dir_last_entry (dir, &last_entry))
+    last_entry = NULL;
+  else if (last_entry == node)
+    last_entry = fs_dir_prev_entry (dir, node);
 
-  if (last_entry)
-  {
-    /* Get a reference to DIR's last entry.  */
-    struct node *next;
-
-    for ( ;
-	 (next = last_entry->next) != NULL;
-	 last_entry = next)
-    {
-      if (next == node)
-      {
-        /* If LAST_ENTRY is TAR's node...  */
-        if (node->next)
-          /* ... skip it */
-          next = node->next;
-        else
-          /* ... or keep the next-to-last entry */
-          break;
-      }
-    }
-
-    if (last_entry == node)
-      last_entry = NULL;
-
-    /* Jump to the last node of LAST_ENTRY's deepest subdir */
-    while (last_entry)
-    {
-      /* If it's a directory, get its last entry.  */
-      if ( (S_ISDIR (last_entry->nn_stat.st_mode))
-	   && (last_entry->nn->entries) )
-      {
-	for (last_entry = last_entry->nn->entries;
-	     last_entry->next;
-	     last_entry = last_entry->next);
-      }
-      else
-        break;
-    }
-  }
+  /* Jump to the last node of LAST_ENTRY's deepest subdir: as long as it's
+     a non-empty directory, get its last entry.  */
+  while (last_entry && (!fs_dir_last_entry (last_entry, &last_entry)))
+    ;
 
   if ((last_entry) && (last_entry != node))
   {
+    struct tarfs_entry *entry;
+
     assert (NODE_INFO(last_entry)->tar);
-    *prev_tar = NODE_INFO(last_entry)->tar;
+
+    /* The nodes of a directory which was not looked into are not built
+       yet: go on with the entries it is made of.  */
+    for (entry = TAR_ENTRY (NODE_INFO(last_entry)->tar);
+	 entry->entries && !(entry->flags & ENTRY_EXPANDED);
+	 entry = entry->entries)
+      ;
+
+    *prev_tar = &entry->tar;
   }
   else
   {
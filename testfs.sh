@@ -4,6 +4,9 @@
 TARNAME=test-tar
 TRANSNODE=t
 LOGFILE=test-log
+MEMBER=tarfs.c		# Member changed in place by do_rewrite
+SPILLSIZE=8		# Size of the file written by do_spill, in MiB
+SPILLHIGH=1M		# Spill watermark used by do_spill
 
 # Start tarfs on TRANSNODE with the given args
 function start_trans
@@ -60,13 +63,186 @@ function do_rm_cp
   return 0
 }
 
+# Overwrite 700 bytes of MEMBER, at offset 1000, with those of FILE, both
+# through TRANSNODE and in the copy of MEMBER that it should now match,
+# then sync and check the archive
+function do_overwrite
+{
+  local file=$1 i ret=0
+
+  echo -n "Overwriting part of $MEMBER with $file... "
+  dd if=$file of=$TARNAME-member bs=100 skip=10 seek=10 count=7 \
+     conv=notrunc 2> /dev/null \
+    && dd if=$file of=$TRANSNODE/$MEMBER bs=100 skip=10 seek=10 count=7 \
+          conv=notrunc 2> /dev/null \
+    && stop_trans && echo "ok"
+  [ $? -ne 0 ] && echo "failed" && return 1
+
+  echo -n "Checking that it was rewritten in place... "
+  grep -q "$MEMBER: syncing changes" $LOGFILE && echo "ok"
+  [ $? -ne 0 ] && echo "failed" && return 1
+
+  echo -n "Checking the archive... "
+  tar xOf $tarfile $MEMBER | cmp -s - $TARNAME-member || ret=1
+  for i in $contents
+  do
+    [ -f "$i" ] && [ "$i" != "$MEMBER" ] || continue
+    tar xOf $tarfile "$i" | cmp -s - "$i" || ret=1
+    [ $ret -ne 0 ] && break
+  done
+  [ $ret -ne 0 ] && echo failed || echo ok
+
+  return $ret
+}
+
+# Checks that a member which is changed without changing its size is
+# rewritten in place properly, and that the other members are left intact
+function do_rewrite
+{
+  echo -n "Mounting... "
+  cp $MEMBER $TARNAME-member && start_trans $tarfs_opts -w $tarfile \
+    && echo "ok"
+  [ $? -ne 0 ] && echo "failed" && return 1
+  dd if=/dev/urandom of=$TARNAME-random bs=100 count=17 2> /dev/null
+  do_overwrite $TARNAME-random || return 1
+
+  # Put the original contents back
+  echo -n "Remounting... "
+  start_trans $tarfs_opts -w $tarfile && echo "ok"
+  [ $? -ne 0 ] && echo "failed" && return 1
+  do_overwrite $MEMBER || return 1
+  rm -f $TARNAME-member $TARNAME-random
+  return 0
+}
+
+# Checks that a file much larger than the spill watermark, whose blocks
+# get spilled to the temporary file, is written to the archive properly
+function do_spill
+{
+  echo -n "Writing $SPILLSIZE MiB with a spill watermark of $SPILLHIGH... "
+  dd if=/dev/urandom of=$TARNAME-spill bs=1024k count=$SPILLSIZE \
+     2> /dev/null \
+    && start_trans $tarfs_opts -w --spill-high=$SPILLHIGH $tarfile \
+    && cp $TARNAME-spill $TRANSNODE && stop_trans && echo "ok"
+  [ $? -ne 0 ] && echo "failed" && return 1
+  echo -n "Checking that blocks were spilled... "
+  grep -q "Spilled block" $LOGFILE && echo "ok"
+  [ $? -ne 0 ] && echo "failed" && return 1
+  echo -n "Checking the archive... "
+  tar xOf $tarfile $TARNAME-spill | cmp -s - $TARNAME-spill && echo "ok"
+  [ $? -ne 0 ] && echo "failed" && return 1
+
+  # Leave the archive as it was
+  echo -n "Removing the file... "
+  start_trans $tarfs_opts -w $tarfile && rm $TRANSNODE/$TARNAME-spill \
+    && stop_trans && echo "ok"
+  [ $? -ne 0 ] && echo "failed" && return 1
+  rm -f $TARNAME-spill
+  return 0
+}
+
+# Checks that a new archive gets written as files are closed with --stream,
+# and that changing a file which was already written there makes the
+# archive get written as a whole when synced
+function do_stream
+{
+  local streamfile=$TARNAME-stream${tarfile#$TARNAME} i ret=0
+
+  echo -n "Streaming a new archive ($streamfile)... "
+  rm -f $streamfile* && start_trans $tarfs_opts -c --stream $streamfile \
+    && cp -r $contents $TRANSNODE && echo "ok"
+  [ $? -ne 0 ] && echo "failed" && return 1
+  echo -n "Checking that files were streamed... "
+  grep -q "Streaming" $LOGFILE && echo "ok"
+  [ $? -ne 0 ] && echo "failed" && return 1
+  echo -n "Changing a file which was streamed... "
+  (cat $MEMBER && echo "Appended once streamed") > $TARNAME-member \
+    && cp $TARNAME-member $TRANSNODE/$MEMBER && echo "ok"
+  [ $? -ne 0 ] && echo "failed" && return 1
+  echo -n "Syncing... "
+  stop_trans && echo "ok"
+  [ $? -ne 0 ] && echo "failed" && return 1
+  echo -n "Remounting... "
+  start_trans $tarfs_opts -r $streamfile && echo "ok"
+  [ $? -ne 0 ] && echo "failed" && return 1
+
+  echo -n "Consistency check... "
+  cd $TRANSNODE
+  for i in $contents
+  do
+    if [ "$i" = "$MEMBER" ]
+    then
+      diff "$i" ../$TARNAME-member > /dev/null || ret=1
+    else
+      diff -r "$i" ../"$i" > /dev/null || ret=1
+    fi
+    [ $ret -ne 0 ] && break
+  done
+  cd $homedir
+  [ $ret -ne 0 ] && echo failed || echo ok
+  stop_trans
+
+  rm -f $streamfile* $TARNAME-member
+  return $ret
+}
+
+# Checks that a plain archive gets mounted from the metadata index which was
+# saved next to it, and that the index is not used anymore once the archive
+# has changed
+function do_meta_index
+{
+  local ret=0
+
+  echo -n "Looking for the metadata index... "
+  [ -f $tarfile.tarfs-meta ] && echo "ok"
+  [ $? -ne 0 ] && echo "failed" && return 1
+  echo -n "Remounting from it... "
+  start_trans -r $tarfile && ls $TRANSNODE > /dev/null \
+    && grep -q "$tarfile.tarfs-meta: Success" $LOGFILE && echo "ok"
+  [ $? -ne 0 ] && echo "failed" && return 1
+  do_diff || return 1
+  stop_trans
+
+  echo -n "Adding a member behind tarfs' back... "
+  date > $TARNAME-extra && tar rf $tarfile $TARNAME-extra && echo "ok"
+  [ $? -ne 0 ] && echo "failed" && return 1
+  echo -n "Remounting without the stale index... "
+  start_trans -r $tarfile && cmp -s $TRANSNODE/$TARNAME-extra $TARNAME-extra \
+    && ! grep -q "$tarfile.tarfs-meta: Success" $LOGFILE && echo "ok"
+  [ $? -ne 0 ] && echo "failed" && ret=1
+  [ $ret -eq 0 ] && { do_diff || ret=1; }
+  stop_trans
+
+  # Leave the archive as it was
+  tar --delete -f $tarfile $TARNAME-extra
+  rm -f $TARNAME-extra
+  return $ret
+}
+
+# Checks that a compressed archive can be read back through the seek index
+# which was saved next to it
+function do_seek_index
+{
+  echo -n "Looking for the seek index... "
+  [ -f $tarfile.tarfs-seek ] && echo "ok"
+  [ $? -ne 0 ] && echo "failed" && return 1
+  echo -n "Remounting through it... "
+  start_trans $tarfs_opts -r $tarfile && echo "ok"
+  [ $? -ne 0 ] && echo "failed" && return 1
+  do_diff || return 1
+  stop_trans
+  return 0
+}
+
 # Hello world
 echo "A Small Test Suite for tarfs"
 echo
 
 # Clean up the directory and get a list of the files in here
 stop_trans
-rm -f $TARNAME $TARNAME.gz $TARNAME.bz2 $LOGFILE $TRANSNODE
+rm -f $TARNAME $TARNAME.gz $TARNAME.bz2 $TARNAME.*.tarfs-seek \
+      $TARNAME*.tarfs-meta $TARNAME-extra $TARNAME-member $TARNAME-random \
+      $TARNAME-spill $TARNAME-stream* $LOGFILE $TRANSNODE
 contents=`echo *`
 homedir=`pwd`
 
@@ -93,12 +269,22 @@ do
   if [ $? -ne 0 ]
   then
     echo "Unable to read $tarfile"
+    stop_trans
   else
     # Read-only tests
     do_diff  || exit 1
     do_rm_cp || exit 1
     do_diff  || exit 1
-  fi
+    stop_trans
 
-  stop_trans
+    # Write tests
+    do_rewrite || exit 1
+    do_spill   || exit 1
+    do_stream  || exit 1
+
+    case "$tarfile" in
+      *.gz|*.bz2) do_seek_index || exit 1 ;;
+      *)          do_meta_index || exit 1 ;;
+    esac
+  fi
 done
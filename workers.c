@@ -0,0 +1,179 @@
+/* tarfs - A GNU tar filesystem for the Hurd.
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or * (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+   USA */
+
+/*
+ * A pool of worker threads.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <cthreads.h>
+
+#include "workers.h"
+#include "debug.h"
+
+/* Number of workers started when the number of processors is unknown */
+#define WORKERS_DEFAULT  2
+
+/* A queue of pending work, protected by LOCK.  AVAILABLE is signaled
+   when work is queued.  */
+struct work_queue
+{
+  struct work *head, *tail;
+  struct condition available;
+};
+
+/* The workers' queue, and the background thread's one.  */
+static struct work_queue queue, background;
+static struct mutex lock;
+
+/* Signaled when work is done.  */
+static struct condition work_done;
+
+/* Number of worker threads */
+static int workers = 0;
+
+/* The main loop of the workers, and of the background thread: do the
+   work queued in ARG.  */
+static any_t
+worker (any_t arg)
+{
+  struct work_queue *q = arg;
+  struct work *work;
+
+  mutex_lock (&lock);
+
+  while (1)
+  {
+    while (!q->head)
+      condition_wait (&q->available, &lock);
+
+    /* Dequeue the first work */
+    work = q->head;
+    q->head = work->next;
+    if (!q->head)
+      q->tail = NULL;
+
+    mutex_unlock (&lock);
+    work->fn (work);
+    mutex_lock (&lock);
+
+    work->pending = 0;
+    condition_broadcast (&work_done);
+  }
+
+  return NULL;
+}
+
+error_t
+workers_init (int count)
+{
+  cthread_t thread;
+  int i;
+
+  if (workers)
+    /* Already started */
+    return 0;
+
+  if (count <= 0)
+  {
+    long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+    count = (cpus > 0) ? cpus : WORKERS_DEFAULT;
+  }
+
+  mutex_init (&lock);
+  condition_init (&queue.available);
+  condition_init (&background.available);
+  condition_init (&work_done);
+
+  /* Without the background thread, workers could deadlock */
+  thread = cthread_fork (worker, &background);
+  if (!thread)
+    return EAGAIN;
+  cthread_detach (thread);
+
+  for (i = 0; i < count; i++)
+  {
+    thread = cthread_fork (worker, &queue);
+    if (!thread)
+      break;
+    cthread_detach (thread);
+  }
+
+  debug (("%i workers started", i));
+
+  workers = i;
+
+  return i ? 0 : EAGAIN;
+}
+
+int
+workers_count (void)
+{
+  return workers ? workers : 1;
+}
+
+/* Queue WORK in Q.  */
+static void
+enqueue (struct work_queue *q, struct work *work)
+{
+  if (!workers)
+  {
+    /* Do it ourselves */
+    work->pending = 0;
+    work->fn (work);
+    return;
+  }
+
+  mutex_lock (&lock);
+
+  work->pending = 1;
+  work->next = NULL;
+  if (q->tail)
+    q->tail->next = work;
+  else
+    q->head = work;
+  q->tail = work;
+
+  condition_signal (&q->available);
+  mutex_unlock (&lock);
+}
+
+void
+work_queue (struct work *work)
+{
+  enqueue (&queue, work);
+}
+
+void
+work_queue_background (struct work *work)
+{
+  enqueue (&background, work);
+}
+
+void
+work_wait (struct work *work)
+{
+  if (!workers)
+    return;
+
+  mutex_lock (&lock);
+  while (work->pending)
+    condition_wait (&work_done, &lock);
+  mutex_unlock (&lock);
+}
@@ -0,0 +1,65 @@
+/* tarfs - A GNU tar filesystem for the Hurd.
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or * (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+   USA */
+
+/*
+ * A pool of worker threads.
+ */
+
+#ifndef __WORKERS_H__
+#define __WORKERS_H__
+
+#include <errno.h>
+
+/* A piece of work to be done by a worker thread.  This is usually embedded
+   at the beginning of a larger structure holding the work's arguments and
+   results.  */
+struct work
+{
+  /* The function called by the worker with this work as its argument */
+  void (* fn) (struct work *work);
+
+  /* Non-zero when this work has been queued and FN has not returned yet */
+  int pending;
+
+  /* Next work in the queue */
+  struct work *next;
+};
+
+/* Starts COUNT worker threads, or one per processor if COUNT is zero.
+   Until this is called, work is done by the thread that queues it.  */
+extern error_t workers_init (int count);
+
+/* Returns the number of worker threads (at least one).  */
+extern int workers_count (void);
+
+/* Queue WORK which will then be done by one of the workers as soon as
+   possible.  FN must be set in WORK.  */
+extern void work_queue (struct work *work);
+
+/* Queue WORK which will then be done, after the work queued this way
+   before it, by a thread of its own rather than by one of the workers.
+   This is meant for work which takes locks or waits for other work (like
+   reading ahead, which may wait for blocks being decompressed): if
+   workers did it, they could all end up waiting for work that none of
+   them is left to do.  FN must be set in WORK.  */
+extern void work_queue_background (struct work *work);
+
+/* Waits till WORK is done.  Returns immediately if WORK is not pending.  */
+extern void work_wait (struct work *work);
+
+#endif
@@ -42,9 +42,16 @@
 # define ZIP_BUFSIZE  (1 << ZIP_BUFSIZE_LOG2)
 #endif
 
-/* Copy-on-write cache size */
-#define CACHE_BLOCK_SIZE_LOG2  ZIP_BUFSIZE_LOG2
-#define CACHE_BLOCK_SIZE       ZIP_BUFSIZE
+/* Smallest and largest copy-on-write cache block sizes (log2), see
+   STORE_ZIP (set_block_size) () */
+#define ZIP_BLOCK_MIN_LOG2  12
+#define ZIP_BLOCK_MAX_LOG2  16
+
+/* Copy-on-write cache block size, which is ZIP_BUFSIZE unless told
+   otherwise.  It is the same for all the stores.  */
+static unsigned block_size_log2 = ZIP_BUFSIZE_LOG2;
+#define CACHE_BLOCK_SIZE_LOG2  block_size_log2
+#define CACHE_BLOCK_SIZE       ((size_t) 1 << CACHE_BLOCK_SIZE_LOG2)
 
 /* BLOCK_NUMBER gives the number in which Offset can be found
    (equivalent to Offset/CACHE_BLOCK_SIZE).  */
@@ -57,6 +64,47 @@
   ((AbsoluteOffset) & (CACHE_BLOCK_SIZE - 1))
 
 
+/* Maximum amount of clean (ie. unmodified) uncompressed data kept in
+   memory, in bytes.  */
+#ifndef ZIP_CLEAN_CACHE_SIZE
+# define ZIP_CLEAN_CACHE_SIZE  (8 << 20)
+#endif
+#define ZIP_CLEAN_BLOCKS  (ZIP_CLEAN_CACHE_SIZE >> CACHE_BLOCK_SIZE_LOG2)
+
+#ifdef ZIP_HAS_CHECKPOINTS
+# ifndef ZIP_CHECKPOINT_SPAN
+/* Distance (in the uncompressed stream) between two decompression
+   checkpoints.  This bounds the amount of data that needs to be
+   decompressed in order to reach any given offset.  */
+#  define ZIP_CHECKPOINT_SPAN  (1 << 20)
+# endif
+#endif
+
+#ifdef ZIP_HAS_BLOCKS
+# ifndef ZIP_BLOCK_SLOTS
+/* Number of independent blocks that may be held decompressed at once,
+   including those decompressed ahead of time.  */
+#  define ZIP_BLOCK_SLOTS  8
+# endif
+#endif
+
+/* The seek index of a zip store is saved to a file named after the
+   archive with this suffix, so that the next time it is opened, the
+   archive does not need to be traversed.  */
+#ifndef ZIP_INDEX_SUFFIX
+# define ZIP_INDEX_SUFFIX  ".tarfs-seek"
+#endif
+
+/* Index files start with this magic string, followed by the format
+   version number.  Bump the latter whenever the format changes.  */
+#define ZIP_INDEX_MAGIC    "tarfsidx"
+#define ZIP_INDEX_VERSION  1
+
+/* Number of bytes at the beginning and at the end of the archive that
+   are hashed in order to make sure the index matches the archive.  */
+#define ZIP_INDEX_HASHED   4096
+
+
 typedef unsigned char uchar;
 
 /* Read status */
@@ -72,6 +120,40 @@ enum status
   STATUS_EOF
 };
 
+/* A decompression checkpoint: the information needed to resume
+   decompression at offset ZIP_OFFS of the uncompressed stream without
+   going through everything that comes before it.  */
+struct checkpoint
+{
+  /* Offset in the underlying store of the first byte to be read when
+     resuming.  The compressed data actually starts BITS bits before.  */
+  store_offset_t file_offs;
+  int bits;
+
+  /* Corresponding offset in the uncompressed stream */
+  store_offset_t zip_offs;
+
+#ifdef ZIP_CRC_UPDATE
+  /* Running CRC of the uncompressed stream up to ZIP_OFFS */
+  uLong crc;
+#endif
+
+  /* Decompressor's dictionary at this point (e.g. deflate's sliding
+     window), or NULL if none is needed.  */
+  char  *window;
+  size_t window_len;
+};
+
+/* A vector of checkpoints, sorted by offset.  */
+struct checkpoint_index
+{
+  struct checkpoint **points;
+
+  /* Number of checkpoints and size of POINTS */
+  size_t count;
+  size_t size;
+};
+
 /* Compression/decompression state */
 struct stream_state
 {
@@ -96,10 +178,62 @@ struct stream_state
   uLong crc;
 #endif
 
+  /* Checkpoints recorded while going through this stream */
+  struct checkpoint_index index;
+
   /* Stream lock */
   struct mutex lock;
 };
 
+/* Where the data of cache blocks, either clean or not, is allocated from
+   (see ZIP (open))  */
+static struct slab_cache blocks_slab;
+
+/* Gives the data of a cache block back to BLOCKS_SLAB (see
+   radix_truncate ()).  */
+static void
+block_release (void *data, void *arg)
+{
+  slab_free (&blocks_slab, data);
+}
+
+/* A clean cache block, ie. a block of the uncompressed stream which was
+   decompressed but not modified.  */
+struct clean_block
+{
+  /* Number of the block and its data (CACHE_BLOCK_SIZE bytes) */
+  size_t block;
+  char *data;
+
+  /* Previous (more recently used) and next clean blocks */
+  struct clean_block *prev;
+  struct clean_block *next;
+};
+
+#ifdef ZIP_HAS_BLOCKS
+struct ZIP (object);
+
+/* An independent block of the uncompressed stream, decompressed by a
+   worker thread.  */
+struct block_slot
+{
+  /* The decompression work (this must come first) */
+  struct work work;
+
+  struct ZIP (object) *zip;
+
+  /* Non-zero if this slot is used, in which case BLOCK is the number of the
+     block (ie. of its checkpoint) it holds.  */
+  int used;
+  size_t block;
+
+  /* Decompressed block, or error */
+  char *data;
+  size_t len;
+  error_t err;
+};
+#endif
+
 /* Zip object information */
 struct ZIP (object)
 {
@@ -126,20 +260,54 @@ struct ZIP (object)
   size_t zip_orig_size;
   size_t zip_orig_blocks_size;
 
+  /* Non-zero while the stream gets compressed as it is written rather than
+     when the store is freed (see STORE_ZIP (flush)).  The original stream
+     is then the part of it which can already be decompressed.  */
+  int append;
+
+  /* Name of the underlying file and of its seek index file */
+  char *file_name;
+  char *index_name;
+
+#ifdef ZIP_HAS_BLOCKS
+  /* Blocks decompressed on behalf of ZIP (read), possibly ahead of time,
+     and the last block read.  These are protected by CACHE.LOCK.  */
+  struct block_slot slots[ZIP_BLOCK_SLOTS];
+  size_t last_block;
+#endif
+
   /* Copy-on-write cache of the uncompressed stream */
   struct
   {
-    /* Vector of cache blocks */
-    char **blocks;
-
-    /* Size of BLOCKS */
-    size_t size;
+    /* Modified cache blocks, indexed by block number */
+    struct radix_tree blocks;
 
     /* Cache lock */
     struct mutex lock;
   } cache;
+
+  /* Clean blocks, as opposed to the copy-on-write ones which are all in
+     CACHE.  They are kept in LRU order, and protected by CACHE.LOCK.  */
+  struct
+  {
+    /* Clean blocks, indexed by block number */
+    struct radix_tree blocks;
+
+    /* Most and least recently used blocks, and number of blocks */
+    struct clean_block *head;
+    struct clean_block *tail;
+    size_t count;
+  } clean;
 };
 
+/* Non-zero while ZIP's original stream is being overwritten by its write
+   stream (see ZIP (sync)), as opposed to being appended to.  */
+#define ZIP_SYNCING(Zip) \
+  (((Zip)->write.zip_status == STATUS_RUNNING) && (!(Zip)->append))
+
+/* See zipstores.h */
+void (* STORE_ZIP (traverse_hook)) (const void *data, size_t len) = NULL;
+
 #ifndef MAX
 # define MAX(A,B)  ((A) < (B) ? (B) : (A))
 #endif
@@ -199,6 +367,88 @@ store_simple_write (struct store *store, off_t addr, void *buf,
   return err;
 }
 
+
+/* Returns the number of checkpoints of INDEX located at or before OFFS.  */
+static inline size_t
+checkpoint_lookup (const struct checkpoint_index *index, store_offset_t offs)
+{
+  size_t low = 0, high = index->count;
+
+  /* Binary search: POINTS[LOW - 1] is the last one not beyond OFFS.  */
+  while (low < high)
+  {
+    size_t middle = (low + high) / 2;
+
+    if (index->points[middle]->zip_offs <= offs)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  return low;
+}
+
+/* Returns the last checkpoint of INDEX located at or before OFFS, or NULL
+   if there is none.  */
+static inline struct checkpoint *
+checkpoint_find (const struct checkpoint_index *index, store_offset_t offs)
+{
+  size_t count = checkpoint_lookup (index, offs);
+
+  return count ? index->points[count - 1] : NULL;
+}
+
+/* Returns the last checkpoint of INDEX, or NULL if INDEX is empty.  */
+static inline struct checkpoint *
+checkpoint_last (const struct checkpoint_index *index)
+{
+  return index->count ? index->points[index->count - 1] : NULL;
+}
+
+/* Append POINT to INDEX.  POINT has to be located after any other
+   checkpoint of INDEX.  */
+static inline error_t
+checkpoint_append (struct checkpoint_index *index, struct checkpoint *point)
+{
+  assert (!checkpoint_last (index)
+	  || (checkpoint_last (index)->zip_offs < point->zip_offs));
+
+  if (index->count >= index->size)
+  {
+    /* Grow the checkpoint vector */
+    struct checkpoint **points;
+    size_t size = index->size ? index->size << 1 : 16;
+
+    points = realloc (index->points, size * sizeof (struct checkpoint *));
+    if (!points)
+      return ENOMEM;
+
+    index->points = points;
+    index->size = size;
+  }
+
+  index->points[index->count++] = point;
+
+  return 0;
+}
+
+/* Free all the checkpoints of INDEX.  */
+static void
+checkpoint_index_free (struct checkpoint_index *index)
+{
+  size_t i;
+
+  for (i = 0; i < index->count; i++)
+  {
+    free (index->points[i]->window);
+    free (index->points[i]);
+  }
+
+  free (index->points);
+  index->points = NULL;
+  index->count = index->size = 0;
+}
+
 
 /* Initializes GZIP: Resets its file/zip offsets and prepare it for
    reading.  */
@@ -243,6 +493,99 @@ ZIP (stream_read_init) (struct ZIP (object) *zip)
   return err;
 }
 
+#ifdef ZIP_HAS_CHECKPOINTS
+/* Resets ZIP's read stream so that decompression resumes at checkpoint
+   POINT.  */
+static error_t
+ZIP (stream_read_restore) (struct ZIP (object) *zip,
+			   const struct checkpoint *point)
+{
+  error_t err;
+  int zerr;
+  ZIP_STREAM *stream = &zip->read.stream;
+
+  mutex_lock (&zip->read.lock);
+
+  if (stream->state)
+  {
+    zerr = ZIP_DECOMPRESS_END (stream);
+    err  = ZIP (error) (stream, zerr);
+    assert_perror (err);
+  }
+
+  zerr = ZIP_DECOMPRESS_INIT (stream);
+  err = ZIP (error) (stream, zerr);
+
+  if (!err)
+  {
+    stream->next_in = stream->next_out = NULL;
+    stream->avail_in = stream->avail_out = 0;
+
+    zip->read.file_offs = point->file_offs;
+    zip->read.zip_offs  = point->zip_offs;
+    zip->read.file_status = zip->read.zip_status = STATUS_RUNNING;
+
+#ifdef ZIP_CRC_UPDATE
+    zip->read.crc = point->crc;
+#endif
+
+    /* Give the decompressor its state back */
+    err = ZIP_CHECKPOINT_RESTORE (stream, zip->source, point);
+  }
+
+  mutex_unlock (&zip->read.lock);
+
+  debug (("Resumed at file/zip offset %llu / %llu (err = %s)",
+	  point->file_offs, point->zip_offs, strerror (err)));
+
+  return err;
+}
+
+/* Records a checkpoint at the current position of ZIP's read stream if
+   the last one is far enough.  BUF contains the LEN bytes that have been
+   decompressed but not yet accounted for in ZIP->READ.CRC.  This assumes
+   that ZIP->READ is locked.  */
+static void
+ZIP (checkpoint_record) (struct ZIP (object) *zip, const void *buf,
+			 size_t len)
+{
+  error_t err;
+  struct checkpoint *point, *last;
+  ZIP_STREAM *stream = &zip->read.stream;
+
+  if (!ZIP_AT_CHECKPOINT (stream))
+    return;
+
+  last = checkpoint_last (&zip->read.index);
+  if (zip->read.zip_offs < (last ? last->zip_offs : 0) + ZIP_CHECKPOINT_SPAN)
+    return;
+
+  point = calloc (1, sizeof (struct checkpoint));
+  if (!point)
+    return;
+
+  point->file_offs = zip->read.file_offs;
+  point->zip_offs  = zip->read.zip_offs;
+  point->bits      = ZIP_CHECKPOINT_BITS (stream);
+#ifdef ZIP_CRC_UPDATE
+  point->crc = ZIP_CRC_UPDATE (zip->read.crc, buf, len);
+#endif
+
+  err = ZIP_CHECKPOINT_SAVE (stream, point);
+  if (!err)
+    err = checkpoint_append (&zip->read.index, point);
+
+  if (err)
+  {
+    /* Not fatal: we'll just have to decompress a little more.  */
+    debug (("Checkpoint at %llu not recorded: %s",
+	    point->zip_offs, strerror (err)));
+    free (point->window);
+    free (point);
+  }
+}
+#endif
+
 /* Initializes GZIP: Resets its file/zip offsets and prepare it for
    writing.  */
 static error_t
@@ -385,6 +728,10 @@ ZIP (stream_read) (struct ZIP (object) *const zip,
 	  if (err)
 	    break;
 
+	  if (!read)
+	    /* The stream is being appended to and ends here for now */
+	    break;
+
 	  stream->avail_in = read;
 
 	  if (*file_offs + read >= zip->source->size)
@@ -404,8 +751,33 @@ ZIP (stream_read) (struct ZIP (object) *const zip,
       *file_offs += avail_in  - stream->avail_in;
       *zip_offs  += avail_out - stream->avail_out;
 
+#ifdef ZIP_HAS_CHECKPOINTS
+      if (zerr != ZIP_STREAM_END)
+	ZIP (checkpoint_record) (zip, buf, *zip_offs - zip_start);
+#endif
+
       if (zerr == ZIP_STREAM_END)
       {
+#ifdef ZIP_HAS_STREAMS
+	char magic[sizeof (ZIP_STREAM_MAGIC) - 1];
+	size_t magic_len;
+
+	if ((*file_offs < zip->source->size)
+	    && (!store_simple_read (zip->source, *file_offs, sizeof (magic),
+				    magic, &magic_len))
+	    && (magic_len == sizeof (magic))
+	    && (!memcmp (magic, ZIP_STREAM_MAGIC, sizeof (magic))))
+	{
+	  /* Another stream follows: go on with it */
+	  ZIP_DECOMPRESS_END (stream);
+	  zerr = ZIP_DECOMPRESS_INIT (stream);
+	  err = ZIP (error) (stream, zerr);
+	  if (err)
+	    break;
+	  continue;
+	}
+#endif
+
 	zip->read.zip_status = STATUS_EOF;
 	debug (("End of stream"));
 	if (zip->read.file_status != STATUS_EOF)
@@ -545,7 +917,53 @@ ZIP (stream_write) (struct ZIP (object) *const zip,
   *len = *zip_offs - zip_start;
 
 #ifdef ZIP_CRC_UPDATE
-  zip->write.crc = ZIP_CRC_UPDATE (zip->write.crc, buf, *len);
+  if (*len)
+    zip->write.crc = ZIP_CRC_UPDATE (zip->write.crc, buf, *len);
+#endif
+
+#ifdef ZIP_HAS_CHECKPOINTS
+  if (!err && !finish
+      && (*zip_offs >= (checkpoint_last (&zip->write.index)
+			? checkpoint_last (&zip->write.index)->zip_offs : 0)
+		       + ZIP_CHECKPOINT_SPAN))
+  {
+    /* Flush the compression stream so that decompression can later be
+       resumed from here without any history, and record a checkpoint.  */
+    struct checkpoint *point;
+
+    do
+    {
+      if (stream->avail_out == 0)
+      {
+	err = do_write (zip->write.buf, ZIP_BUFSIZE);
+	if (err)
+	  goto end;
+
+	stream->next_out  = zip->write.buf;
+	stream->avail_out = ZIP_BUFSIZE;
+      }
+
+      zerr = ZIP_COMPRESS_FLUSH (stream);
+      err  = ZIP (error) (stream, zerr);
+      if (err)
+	goto end;
+    }
+    while (stream->avail_out == 0);
+
+    point = calloc (1, sizeof (struct checkpoint));
+    if (point)
+    {
+      /* The flushed data that is still in the buffer comes first */
+      point->file_offs = *file_offs + (ZIP_BUFSIZE - stream->avail_out);
+      point->zip_offs  = *zip_offs;
+#ifdef ZIP_CRC_UPDATE
+      point->crc = zip->write.crc;
+#endif
+
+      if (checkpoint_append (&zip->write.index, point))
+	free (point);
+    }
+  }
 #endif
 
   if (!err && finish)
@@ -585,122 +1003,851 @@ end:
 }
 
 
-/* Jump at offset OFFS of ZIP's raw decompression stream, without
-   taking the cache data into account. When ZIP is being written, only
-   forward seeks are allowed.  */
-static error_t
-ZIP (stream_read_seek) (struct ZIP (object) *const zip, store_offset_t offs)
+/* Clean block cache.  */
+
+/* Unlinks ENTRY from ZIP's LRU list.  */
+static inline void
+clean_unlink (struct ZIP (object) *zip, struct clean_block *entry)
 {
-  error_t err = 0;
-  char buf[ZIP_BUFSIZE];
-  const store_offset_t *zip_offs  = &zip->read.zip_offs;
+  if (entry->prev)
+    entry->prev->next = entry->next;
+  else
+    zip->clean.head = entry->next;
 
-  if (*zip_offs > offs)
-  {
-    /* Reverse seek are forbidden when writing */
-    assert (zip->write.zip_status != STATUS_RUNNING);
+  if (entry->next)
+    entry->next->prev = entry->prev;
+  else
+    zip->clean.tail = entry->prev;
+}
 
-    /* Start from the beginning */
-    err = ZIP (stream_read_init) (zip);
-    if (err)
-      return err;
-  }
+/* Makes ENTRY the most recently used of ZIP's clean blocks.  */
+static inline void
+clean_push (struct ZIP (object) *zip, struct clean_block *entry)
+{
+  entry->prev = NULL;
+  entry->next = zip->clean.head;
+  if (zip->clean.head)
+    zip->clean.head->prev = entry;
+  else
+    zip->clean.tail = entry;
+  zip->clean.head = entry;
+}
 
-  if (offs != *zip_offs)
+/* Returns the data of ZIP's clean block BLOCK, or NULL if it is not
+   cached.  */
+static inline char *
+clean_lookup (struct ZIP (object) *zip, size_t block)
+{
+  struct clean_block *entry;
+
+  entry = radix_lookup (&zip->clean.blocks, block);
+  if (!entry)
+    return NULL;
+
+  if (entry != zip->clean.head)
   {
-    /* Emulate a seek by reading the data before OFFS */
-    size_t len;
-    size_t amount;
+    clean_unlink (zip, entry);
+    clean_push (zip, entry);
+  }
 
-    debug (("Seeking from "OFF_FMT" to "OFF_FMT, *zip_offs, offs));
+  return entry->data;
+}
 
-    while (*zip_offs < offs)
-    {
-      /* Read from zero to BLOCK_OFFS.  */
-      amount = MIN (offs - *zip_offs, ZIP_BUFSIZE);
+/* Removes block BLOCK from ZIP's clean cache and returns its data, or NULL
+   if it is not cached.  */
+static char *
+clean_take (struct ZIP (object) *zip, size_t block)
+{
+  struct clean_block *entry;
+  char *data;
 
-      err = ZIP (stream_read) (zip, amount, buf, &len);
-      if (err)
-        return err;
-      if (len < amount)
-      {
-        debug (("Couln't seek to %lli (got %u instead of %u)",
-                 offs, len, amount));
-        return EIO;
-      }
-    }
-  }
+  entry = radix_remove (&zip->clean.blocks, block);
+  if (!entry)
+    return NULL;
 
-  /* Make sure we got there.  */
-  assert (*zip_offs == offs);
+  clean_unlink (zip, entry);
+  zip->clean.count--;
 
-  return err;
+  data = entry->data;
+  free (entry);
+
+  return data;
 }
 
-/* Read AMOUNT bytes from STORE at offset OFFSET. Returns the number of bytes
-   actually read in LEN.  */
+/* Adds DATA, a CACHE_BLOCK_SIZE bytes long buffer, to ZIP's clean cache as
+   block number BLOCK.  The cache then owns DATA.  If the cache is full, the
+   least recently used block gets evicted.  */
 static error_t
-ZIP (read) (struct store *store,
-	    store_offset_t offset, size_t index, size_t amount, void **buf,
-	    size_t *len)
+clean_insert (struct ZIP (object) *zip, size_t block, char *data)
 {
-  error_t err = 0;
-  struct ZIP (object) *zip = store->misc;
-  
-  char **blocks;
-  size_t blocks_size;
-  size_t block = BLOCK_NUMBER (offset);	/* 1st block to read */
-  store_offset_t block_offset;
-  char  *datap = *buf;	/* current pointer */
-  size_t  size;
+  struct clean_block *entry;
 
-  if (offset >= store->size)
+  entry = radix_lookup (&zip->clean.blocks, block);
+  if (entry)
   {
-    *len = 0;
-    return EIO;
+    /* Already there */
+    slab_free (&blocks_slab, data);
+    return 0;
   }
 
-  /* Adjust SIZE and LEN to the maximum that can be read.  */
-  size = store->size - offset;
-  size = (size > amount) ? amount : size;
-  *len = size;
+  if (zip->clean.count >= ZIP_CLEAN_BLOCKS)
+  {
+    /* Recycle the least recently used block */
+    entry = zip->clean.tail;
+    clean_unlink (zip, entry);
+    radix_remove (&zip->clean.blocks, entry->block);
+    slab_free (&blocks_slab, entry->data);
+  }
+  else
+  {
+    entry = malloc (sizeof (struct clean_block));
+    if (!entry)
+    {
+      slab_free (&blocks_slab, data);
+      return ENOMEM;
+    }
+    zip->clean.count++;
+  }
+
+  entry->block = block;
+  entry->data  = data;
+  if (radix_insert (&zip->clean.blocks, block, entry))
+  {
+    slab_free (&blocks_slab, data);
+    free (entry);
+    zip->clean.count--;
+    return ENOMEM;
+  }
+  clean_push (zip, entry);
+
+  return 0;
+}
+
+/* Copies the blocks entirely contained in the LEN bytes of DATA, which were
+   decompressed from offset OFFS of ZIP's stream, to its clean cache.  This
+   is a no-op while ZIP is being written since the read stream then only
+   saves data that is about to be overwritten (see ZIP (sync)).  */
+static void
+clean_fill (struct ZIP (object) *zip, store_offset_t offs,
+	    const char *data, size_t len)
+{
+  store_offset_t end = offs + len;
+
+  if (ZIP_SYNCING (zip))
+    return;
+
+  /* Skip the beginning of the first block if it is missing */
+  if (BLOCK_RELATIVE_OFFSET (offs))
+  {
+    size_t skip = CACHE_BLOCK_SIZE - BLOCK_RELATIVE_OFFSET (offs);
+    if (skip >= len)
+      return;
+    offs += skip;
+    data += skip;
+  }
+
+  for (; offs + CACHE_BLOCK_SIZE <= end;
+       offs += CACHE_BLOCK_SIZE, data += CACHE_BLOCK_SIZE)
+  {
+    char *copy;
+
+    if (radix_lookup (&zip->clean.blocks, BLOCK_NUMBER (offs)))
+      /* Already there */
+      continue;
+
+    copy = slab_alloc (&blocks_slab);
+    if (!copy)
+      break;
+
+    memcpy (copy, data, CACHE_BLOCK_SIZE);
+    if (clean_insert (zip, BLOCK_NUMBER (offs), copy))
+      break;
+  }
+}
+
+/* Empties ZIP's clean cache.  */
+static void
+clean_free (struct ZIP (object) *zip)
+{
+  struct clean_block *entry, *next;
+  void *chain = NULL;
+
+  for (entry = zip->clean.head; entry; entry = next)
+  {
+    next = entry->next;
+    slab_chain (&chain, entry->data);
+    free (entry);
+  }
+  slab_free_chain (&blocks_slab, chain);
+
+  radix_truncate (&zip->clean.blocks, 0, NULL, NULL);
+  bzero (&zip->clean, sizeof (zip->clean));
+}
+
+
+
+#ifdef ZIP_HAS_BLOCKS
+/* Bit offset in the underlying store corresponding to checkpoint POINT */
+#define CHECKPOINT_BIT(Point) \
+  (((Point)->file_offs << 3) - (Point)->bits)
+
+/* Decompresses the block of SLOT.  This is called by a worker thread.  */
+static void
+ZIP (block_decode) (struct work *work)
+{
+  struct block_slot *slot = (struct block_slot *) work;
+  struct checkpoint **points = slot->zip->read.index.points;
+
+  slot->err = ZIP_BLOCK_DECODE (slot->zip->source,
+				CHECKPOINT_BIT (points[slot->block]),
+				CHECKPOINT_BIT (points[slot->block + 1]),
+				&slot->data, &slot->len);
+}
+
+/* Make SLOT hold block number BLOCK of ZIP, which will be decompressed by
+   a worker thread.  */
+static void
+ZIP (block_queue) (struct ZIP (object) *zip, struct block_slot *slot,
+		   size_t block)
+{
+  work_wait (&slot->work);
+  free (slot->data);
+
+  slot->zip   = zip;
+  slot->used  = 1;
+  slot->block = block;
+  slot->data  = NULL;
+  slot->len   = 0;
+  slot->err   = 0;
+
+  slot->work.fn = ZIP (block_decode);
+  work_queue (&slot->work);
+}
+
+/* Waits for ZIP's slots to be decompressed and empties them.  */
+static void
+ZIP (block_slots_free) (struct ZIP (object) *zip)
+{
+  int i;
+
+  for (i = 0; i < ZIP_BLOCK_SLOTS; i++)
+  {
+    work_wait (&zip->slots[i].work);
+    free (zip->slots[i].data);
+    zip->slots[i].data = NULL;
+    zip->slots[i].used = 0;
+  }
+}
+
+/* Returns in SLOT the slot holding block number BLOCK of ZIP once it has
+   been decompressed.  When blocks are read in sequence, the next ones get
+   decompressed ahead of time.  This assumes that ZIP's cache is locked.  */
+static error_t
+ZIP (block_get) (struct ZIP (object) *zip, size_t block,
+		 struct block_slot **slot)
+{
+  size_t blocks = zip->read.index.count - 1, next;
+  struct block_slot *s = &zip->slots[block % ZIP_BLOCK_SLOTS];
+
+  if ((!s->used) || (s->block != block))
+    ZIP (block_queue) (zip, s, block);
+
+  if (block == zip->last_block + 1)
+    for (next = block + 1;
+	 (next < blocks) && (next < block + ZIP_BLOCK_SLOTS)
+	   && (next <= block + workers_count ());
+	 next++)
+    {
+      struct block_slot *n = &zip->slots[next % ZIP_BLOCK_SLOTS];
+      if ((!n->used) || (n->block != next))
+	ZIP (block_queue) (zip, n, next);
+    }
+
+  zip->last_block = block;
+
+  work_wait (&s->work);
+  *slot = s;
+
+  return s->err;
+}
+
+/* Reads AMOUNT bytes at offset OFFS of ZIP's uncompressed stream into BUF
+   using its independent blocks.  This assumes that ZIP's cache is
+   locked.  */
+static error_t
+ZIP (block_read) (struct ZIP (object) *zip, store_offset_t offs,
+		  size_t amount, char *buf)
+{
+  error_t err;
+  struct checkpoint_index *index = &zip->read.index;
+
+  while (amount > 0)
+  {
+    struct block_slot *slot;
+    size_t block = checkpoint_lookup (index, offs) - 1, len;
+    store_offset_t start;
+
+    if (block + 1 >= index->count)
+      /* Beyond the last block */
+      return EIO;
+
+    err = ZIP (block_get) (zip, block, &slot);
+    if (err)
+      return err;
+
+    start = index->points[block]->zip_offs;
+    if (offs - start >= slot->len)
+      /* The index doesn't match the block */
+      return EIO;
+
+    len = MIN (amount, slot->len - (offs - start));
+    memcpy (buf, &slot->data[offs - start], len);
+
+    buf    += len;
+    offs   += len;
+    amount -= len;
+  }
+
+  return 0;
+}
+
+/* Traverses ZIP by decompressing its independent blocks in parallel.
+   Records a checkpoint at the beginning of each block, plus one at the end
+   of the last one.  Returns the uncompressed stream size in SIZE, or
+   EOPNOTSUPP if the blocks could not be found.  */
+static error_t
+ZIP (traverse_blocks) (struct ZIP (object) *zip, size_t *size)
+{
+  error_t err;
+  struct checkpoint_index *index = &zip->read.index;
+  store_offset_t *bits;
+  size_t count, block, queued = 0, total = 0;
+
+  err = ZIP_BLOCK_SCAN (zip->source, zip->start_file_offs, &bits, &count);
+  if (err)
+  {
+    debug (("No independent blocks (%s)", strerror (err)));
+    return EOPNOTSUPP;
+  }
+
+  /* Record a checkpoint at the beginning of each block.  Their uncompressed
+     offsets are only known once the previous blocks have been decompressed:
+     meanwhile, use their number to keep the index sorted.  */
+  for (block = 0; (!err) && (block < count); block++)
+  {
+    struct checkpoint *point = calloc (1, sizeof (struct checkpoint));
+    if (!point)
+    {
+      err = ENOMEM;
+      break;
+    }
+
+    point->file_offs = (bits[block] + 7) >> 3;
+    point->bits      = (point->file_offs << 3) - bits[block];
+    point->zip_offs  = block;
+
+    err = checkpoint_append (index, point);
+    if (err)
+      free (point);
+  }
+
+  free (bits);
+
+  for (block = 0; (!err) && (block < count - 1); block++)
+  {
+    struct block_slot *slot = &zip->slots[block % ZIP_BLOCK_SLOTS];
+
+    /* Keep the workers busy */
+    for (; (queued < count - 1) && (queued < block + ZIP_BLOCK_SLOTS);
+	 queued++)
+      ZIP (block_queue) (zip, &zip->slots[queued % ZIP_BLOCK_SLOTS], queued);
+
+    work_wait (&slot->work);
+    err = slot->err;
+    if ((!err) && (!slot->len))
+      err = EIO;
+    if (err)
+      break;
+
+    index->points[block]->zip_offs = total;
+
+    if (STORE_ZIP (traverse_hook))
+      STORE_ZIP (traverse_hook) (slot->data, slot->len);
+
+    clean_fill (zip, total, slot->data, slot->len);
+    total += slot->len;
+  }
+
+  ZIP (block_slots_free) (zip);
+
+  if (err)
+  {
+    checkpoint_index_free (index);
+    return err;
+  }
+
+  index->points[count - 1]->zip_offs = total;
+  *size = total;
+
+  debug (("%u blocks traversed (%u bytes)", count - 1, total));
+
+  return 0;
+}
+#endif
+
+/* Jump at offset OFFS of ZIP's raw decompression stream, without
+   taking the cache data into account. When ZIP is being written, only
+   forward seeks are allowed.  */
+static error_t
+ZIP (stream_read_seek) (struct ZIP (object) *const zip, store_offset_t offs)
+{
+  error_t err = 0;
+  char *buf;
+  const store_offset_t *zip_offs  = &zip->read.zip_offs;
+
+#ifdef ZIP_HAS_CHECKPOINTS
+  struct checkpoint *point = NULL;
+
+  /* Look for the closest checkpoint, unless the read stream is being used
+     to save data that is about to be overwritten (see ZIP (sync)): in
+     that case it must not skip anything.  */
+  if (!ZIP_SYNCING (zip))
+    point = checkpoint_find (&zip->read.index, offs);
+
+  if (point && (point->zip_offs <= *zip_offs) && (*zip_offs <= offs))
+    /* We are already closer to OFFS than POINT */
+    point = NULL;
+
+  if (point)
+  {
+    /* Resume from the closest checkpoint */
+    err = ZIP (stream_read_restore) (zip, point);
+    if (err)
+      return err;
+  }
+  else
+#endif
+  if (*zip_offs > offs)
+  {
+    /* Reverse seek are forbidden when writing */
+    assert (!ZIP_SYNCING (zip));
+
+    /* Start from the beginning */
+    err = ZIP (stream_read_init) (zip);
+    if (err)
+      return err;
+  }
+
+  if (offs != *zip_offs)
+  {
+    /* Emulate a seek by reading the data before OFFS */
+    size_t len;
+    size_t amount;
+
+    debug (("Seeking from "OFF_FMT" to "OFF_FMT, *zip_offs, offs));
+
+    buf = slab_alloc (&blocks_slab);
+    if (!buf)
+      return ENOMEM;
+
+    while (*zip_offs < offs)
+    {
+      store_offset_t start = *zip_offs;
+
+      /* Read from zero to BLOCK_OFFS, a cache block at a time so that the
+	 data can be kept as clean blocks.  */
+      amount = MIN (offs - *zip_offs,
+		    CACHE_BLOCK_SIZE - BLOCK_RELATIVE_OFFSET (*zip_offs));
+
+      err = ZIP (stream_read) (zip, amount, buf, &len);
+      if ((!err) && (len < amount))
+      {
+        debug (("Couln't seek to %lli (got %u instead of %u)",
+                 offs, len, amount));
+        err = EIO;
+      }
+      if (err)
+        break;
+
+      clean_fill (zip, start, buf, len);
+    }
+
+    slab_free (&blocks_slab, buf);
+    if (err)
+      return err;
+  }
+
+  /* Make sure we got there.  */
+  assert (*zip_offs == offs);
+
+  return err;
+}
+
+/* Decompresses block number BLOCK of ZIP's original stream and adds it to
+   the clean cache.  Returns its data in DATA.  This assumes that ZIP's
+   cache is locked.  */
+static error_t
+ZIP (clean_fetch) (struct ZIP (object) *zip, size_t block, char **data)
+{
+  error_t err;
+  store_offset_t offs = (store_offset_t) block << CACHE_BLOCK_SIZE_LOG2;
+  size_t amount = MIN (CACHE_BLOCK_SIZE, zip->zip_orig_size - offs), len;
+  char *buf;
+
+  buf = slab_alloc (&blocks_slab);
+  if (!buf)
+    return ENOMEM;
+  bzero (buf + amount, CACHE_BLOCK_SIZE - amount);
+
+#ifdef ZIP_HAS_BLOCKS
+  if (zip->read.index.count > 1)
+    /* Read from the independent blocks */
+    err = ZIP (block_read) (zip, offs, amount, buf);
+  else
+#endif
+  {
+    err = ZIP (stream_read_seek) (zip, offs);
+    if (!err)
+      err = ZIP (stream_read) (zip, amount, buf, &len);
+    if (!err && (len != amount))
+      err = EIO;
+  }
+
+  if (!err)
+    err = clean_insert (zip, block, buf);
+  else
+    slab_free (&blocks_slab, buf);
+
+  if (!err)
+    *data = buf;
+
+  return err;
+}
+
+
+/* Appending.  A store whose original stream is empty, e.g. a new archive,
+   can be compressed as it gets written, from the beginning on, rather than
+   when it is freed.  The cache blocks which were compressed can then be
+   freed (see STORE_ZIP (flush)).  */
+
+/* ZIP (stream_write) callback used when appending: nothing needs to be
+   saved since the original stream ends where the data gets written.  */
+static error_t
+ZIP (append_advertise) (struct ZIP (object) *zip, store_offset_t offs,
+			size_t amount)
+{
+  return 0;
+}
+
+#ifdef ZIP_HAS_STREAMS
+/* Begins a new stream right after the one ZIP's write stream terminated.  */
+static error_t
+ZIP (stream_write_restart) (struct ZIP (object) *zip)
+{
+  error_t err;
+  ZIP_STREAM *stream = &zip->write.stream;
+  int zerr;
+
+  mutex_lock (&zip->write.lock);
+
+  zerr = ZIP_COMPRESS_INIT (stream);
+  err = ZIP (error) (stream, zerr);
+
+  if (!err)
+  {
+    stream->next_in   = NULL;
+    stream->avail_in  = 0;
+    stream->next_out  = zip->write.buf;
+    stream->avail_out = ZIP_BUFSIZE;
+    zip->write.zip_status = STATUS_RUNNING;
+  }
+
+  mutex_unlock (&zip->write.lock);
+
+  return err;
+}
+#endif
+
+/* Makes what ZIP's write stream compressed so far part of the original
+   stream, i.e. writes it all to the underlying store in such a way that it
+   can be decompressed.  This assumes that ZIP's cache is locked and that
+   ZIP is being appended to.  */
+static error_t
+ZIP (append_sync) (struct ZIP (object) *zip)
+{
+  error_t err = 0;
+
+  if (zip->write.zip_offs == zip->zip_orig_size)
+    /* Nothing new */
+    return 0;
+
+#ifdef ZIP_HAS_STREAMS
+  {
+    size_t len;
+
+    /* Terminate the current stream, another one will follow */
+    err = ZIP (stream_write) (zip, 0, NULL, &len, 1,
+			      ZIP (append_advertise));
+    if (!err)
+      zip->write.zip_status = STATUS_EOF;
+  }
+#else
+  {
+    ZIP_STREAM *stream = &zip->write.stream;
+    int zerr;
+
+    /* Write the AMOUNT bytes of compressed data which are in the buffer */
+    error_t
+    output (size_t amount)
+    {
+      error_t err;
+      size_t len;
+
+      err = store_simple_write (zip->source, zip->write.file_offs,
+				zip->write.buf, amount, &len);
+      if (!err && (len != amount))
+	err = EIO;
+
+      zip->write.file_offs += amount;
+      stream->next_out  = zip->write.buf;
+      stream->avail_out = ZIP_BUFSIZE;
+
+      return err;
+    }
+
+    mutex_lock (&zip->write.lock);
+
+# ifdef ZIP_HAS_CHECKPOINTS
+    /* The stream may have just been flushed at a checkpoint, in which
+       case it must not be flushed again.  */
+    if ((!checkpoint_last (&zip->write.index))
+	|| (checkpoint_last (&zip->write.index)->zip_offs
+	    != zip->write.zip_offs))
+# endif
+    do
+    {
+      if (stream->avail_out == 0)
+      {
+	err = output (ZIP_BUFSIZE);
+	if (err)
+	  break;
+      }
+
+      /* Flush the compressed stream onto a byte boundary */
+      zerr = ZIP_COMPRESS_FLUSH (stream);
+      err  = ZIP (error) (stream, zerr);
+    }
+    while ((!err) && (stream->avail_out == 0));
+
+    if ((!err) && (stream->avail_out < ZIP_BUFSIZE))
+      err = output (ZIP_BUFSIZE - stream->avail_out);
+
+    mutex_unlock (&zip->write.lock);
+  }
+#endif
+
+  if (err)
+    return err;
+
+  zip->zip_orig_size = zip->write.zip_offs;
+  zip->zip_orig_blocks_size = BLOCK_NUMBER (zip->zip_orig_size - 1) + 1;
+
+  if (zip->read.zip_status == STATUS_EOF)
+    /* The read stream had reached the end of what was there */
+    err = ZIP (stream_read_init) (zip);
+
+  return err;
+}
+
+/* Compresses ZIP's stream from where its write stream is up to offset END,
+   and frees the cache blocks which were entirely compressed.  If FINISH is
+   non-zero then the stream is terminated.  This assumes that ZIP's cache is
+   locked and that ZIP is being appended to.  */
+static error_t
+ZIP (append) (struct ZIP (object) *zip, store_offset_t end, int finish)
+{
+  error_t err = 0;
+  store_offset_t *zip_offs = &zip->write.zip_offs;
+
+#ifdef ZIP_HAS_STREAMS
+  if (zip->write.zip_status == STATUS_EOF)
+  {
+    if (*zip_offs >= end)
+      /* Everything was compressed and terminated already */
+      return 0;
+
+    err = ZIP (stream_write_restart) (zip);
+  }
+#endif
+
+  while ((!err) && ((*zip_offs < end) || finish))
+  {
+    size_t block = BLOCK_NUMBER (*zip_offs);
+    size_t offset = BLOCK_RELATIVE_OFFSET (*zip_offs);
+    size_t amount = MIN (end - *zip_offs, CACHE_BLOCK_SIZE - offset);
+    int last = finish && (*zip_offs + amount == end);
+    char *b = radix_lookup (&zip->cache.blocks, block);
+    size_t len;
+
+    if ((!b) && amount)
+    {
+      /* This block was never written */
+      b = slab_alloc (&blocks_slab);
+      if (!b)
+      {
+	err = ENOMEM;
+	break;
+      }
+      bzero (b, CACHE_BLOCK_SIZE);
+
+      err = radix_insert (&zip->cache.blocks, block, b);
+      if (err)
+      {
+	slab_free (&blocks_slab, b);
+	break;
+      }
+    }
+
+    err = ZIP (stream_write) (zip, amount, b ? &b[offset] : NULL, &len, last,
+			      ZIP (append_advertise));
+    if (err)
+      break;
+
+    if (offset + amount == CACHE_BLOCK_SIZE)
+      /* We are done with this block */
+      slab_free (&blocks_slab, radix_remove (&zip->cache.blocks, block));
+
+    if (last)
+      break;
+  }
+
+  return err;
+}
+
+/* Stops appending to ZIP: its whole stream will be compressed again when
+   it is freed, like that of any modified store.  This assumes that ZIP's
+   cache is locked.  */
+static error_t
+ZIP (append_stop) (struct ZIP (object) *zip)
+{
+  error_t err;
+
+  err = ZIP (append_sync) (zip);
+
+  /* The compressed data that is not part of the original stream yet, if
+     any, is thrown away along with the compression state.  */
+  if (zip->write.zip_status == STATUS_RUNNING)
+    ZIP_COMPRESS_END (&zip->write.stream);
+  zip->write.zip_status = STATUS_IDLE;
+  checkpoint_index_free (&zip->write.index);
+  zip->append = 0;
+
+  debug (("Stopped appending at %u", zip->zip_orig_size));
+
+  return err;
+}
+
+/* See zipstores.h */
+error_t
+STORE_ZIP (flush) (struct store *store, store_offset_t offs)
+{
+  error_t err = 0;
+  struct ZIP (object) *zip = store->misc;
+
+  mutex_lock (&zip->cache.lock);
+
+  if (!zip->append)
+  {
+    if (store->flags & STORE_READONLY)
+      err = EROFS;
+    else if (zip->zip_orig_size || (zip->write.zip_status != STATUS_IDLE))
+      /* Only an empty stream can be appended to, and only once */
+      err = EOPNOTSUPP;
+    else
+    {
+      err = ZIP (stream_write_init) (zip);
+      if (!err)
+	zip->append = 1;
+    }
+  }
+
+  if (!err)
+    err = ZIP (append) (zip, MIN (offs, store->size), 0);
+
+  mutex_unlock (&zip->cache.lock);
+
+  return err;
+}
+
+
+/* Read AMOUNT bytes from STORE at offset OFFSET. Returns the number of bytes
+   actually read in LEN.  */
+static error_t
+ZIP (read) (struct store *store,
+	    store_offset_t offset, size_t index, size_t amount, void **buf,
+	    size_t *len)
+{
+  error_t err = 0;
+  struct ZIP (object) *zip = store->misc;
+  
+  size_t block = BLOCK_NUMBER (offset);	/* 1st block to read */
+  store_offset_t block_offset;
+  char  *datap = *buf;	/* current pointer */
+  size_t  size;
+
+  if (offset >= store->size)
+  {
+    *len = 0;
+    return EIO;
+  }
+
+  /* Adjust SIZE and LEN to the maximum that can be read.  */
+  size = store->size - offset;
+  size = (size > amount) ? amount : size;
+  *len = size;
 
   /* Get the relative offset inside cache block BLOCK.  */
   block_offset = BLOCK_RELATIVE_OFFSET (offset);
 
   /* Lock the file during the whole reading (XXX: not very fine-grained) */
   mutex_lock (&zip->cache.lock);
-  blocks = zip->cache.blocks;
-  blocks_size = zip->cache.size;
 
-  while (size > 0)
+  if (zip->append && (offset < zip->write.zip_offs))
+    /* Make what was compressed readable */
+    err = ZIP (append_sync) (zip);
+
+  while ((!err) && (size > 0))
   {
-    size_t read = (size > CACHE_BLOCK_SIZE)
+    size_t read = (size > CACHE_BLOCK_SIZE - block_offset)
                   ? (CACHE_BLOCK_SIZE - block_offset)
 		  : (size);
+    char *cached = radix_lookup (&zip->cache.blocks, block);
 
-    if ((block < blocks_size) && (blocks[block]))
+    if (cached)
       /* Read block from cache */
-      memcpy (datap, &blocks[block][block_offset], read);
+      memcpy (datap, &cached[block_offset], read);
+    else if (block >= zip->zip_orig_blocks_size)
+      /* Beyond the original stream and never written */
+      bzero (datap, read);
     else
     {
-      /* Read block directly from file */
-      size_t actually_read;
-
-      err = ZIP (stream_read_seek) (zip, offset);
-      assert_perror (err);
+      char *clean = clean_lookup (zip, block);
 
-      err = ZIP (stream_read) (zip, read, datap, &actually_read);
-      if (err)
-        break;
+      if (!clean)
+      {
+	/* Decompress the whole block and keep it as a clean block */
+	err = ZIP (clean_fetch) (zip, block, &clean);
+	if (err)
+	  break;
+      }
 
-      /* We should have read everything.  */
-      assert (actually_read == read);
+      memcpy (datap, &clean[block_offset], read);
     }
 
     /* Go ahead with next block.  */
     block++;
     size  -= read;
+    offset += read;
     block_offset = 0;
     datap  = datap + read;
   }
@@ -710,43 +1857,64 @@ ZIP (read) (struct store *store,
   return err;
 }
 
-/* Fetches block number BLOCK from STORE and caches it.
-   Cache is assumed to be locked when this is called.  */
+/* Fetches block number BLOCK from STORE and caches it.  The block is
+   returned in DATA.  Cache is assumed to be locked when this is called.  */
 static inline error_t
-fetch_block (struct ZIP (object) *zip, size_t block)
+fetch_block (struct ZIP (object) *zip, size_t block, char **data)
 {
   error_t err   = 0;
-  char **blocks = zip->cache.blocks;
   size_t last_block = BLOCK_NUMBER (zip->zip_orig_size - 1);
   size_t read;
   size_t actually_read = 0;
+  char *b = NULL;
 
   /* Don't try to go beyond the boundaries.  */
   assert (block <= last_block);
 
-  if (blocks[block])
+  *data = radix_lookup (&zip->cache.blocks, block);
+  if (*data)
     /* Nothing to do */
     return 0;
 
-  /* Allocate a new block.  */
-  blocks[block] = calloc (CACHE_BLOCK_SIZE, sizeof (char));
-  if (!blocks[block])
-    return ENOMEM;
+  if (!ZIP_SYNCING (zip))
+    /* A clean block just needs to be moved here.  This is not done while
+       ZIP is being written since the read stream must then go through
+       each block (see ZIP (sync)).  */
+    b = clean_take (zip, block);
 
-  /* If this is the last block, then we may have less to read.  */
-  if (block == last_block)
-    read = zip->zip_orig_size % CACHE_BLOCK_SIZE;
-  else
-    read = CACHE_BLOCK_SIZE;
+  if (!b)
+  {
+    /* Allocate a new block.  */
+    b = slab_alloc (&blocks_slab);
+    if (!b)
+      return ENOMEM;
+
+    /* If this is the last block, then we may have less to read.  */
+    if (block == last_block)
+      read = zip->zip_orig_size - (block << CACHE_BLOCK_SIZE_LOG2);
+    else
+      read = CACHE_BLOCK_SIZE;
+    bzero (&b[read], CACHE_BLOCK_SIZE - read);
 
-  err = ZIP (stream_read_seek) (zip, block << CACHE_BLOCK_SIZE_LOG2);
-  assert_perror (err);
+    err = ZIP (stream_read_seek) (zip, block << CACHE_BLOCK_SIZE_LOG2);
+    assert_perror (err);
 
-  err = ZIP (stream_read) (zip, read, blocks[block], &actually_read);
+    err = ZIP (stream_read) (zip, read, b, &actually_read);
+    if (err)
+    {
+      slab_free (&blocks_slab, b);
+      return err;
+    }
 
-  if (!err)
     /* We should have read everything.  */
     assert (actually_read == read);
+  }
+
+  err = radix_insert (&zip->cache.blocks, block, b);
+  if (err)
+    slab_free (&blocks_slab, b);
+  else
+    *data = b;
 
   return err;
 }
@@ -762,12 +1930,10 @@ ZIP (write) (struct store *store,
   struct ZIP (object) *zip = store->misc;
   size_t size;
   
-  char **blocks;
   int   block = BLOCK_NUMBER (offset); /* 1st block to read.  */
   const void *datap = buf; /* current pointer */
 
   mutex_lock (&zip->cache.lock);
-  blocks = zip->cache.blocks;
 
   if (offset >= store->size)
   {
@@ -777,6 +1943,18 @@ ZIP (write) (struct store *store,
     return EIO;
   }
 
+  if (zip->append && (offset < zip->write.zip_offs))
+  {
+    /* Data which was compressed already gets modified */
+    err = ZIP (append_stop) (zip);
+    if (err)
+    {
+      *amount = 0;
+      mutex_unlock (&zip->cache.lock);
+      return err;
+    }
+  }
+
   /* Adjust SIZE and LEN to the maximum that can be read.  */
   size = store->size - offset;
   size = (size > len) ? len : size;
@@ -790,219 +1968,759 @@ ZIP (write) (struct store *store,
     size_t write = (size + offset > CACHE_BLOCK_SIZE)
                    ? (CACHE_BLOCK_SIZE - offset)
 		   : (size);
+    char *b;
+
+    /* Allocate/fetch this block if not here yet (copy-on-write).  */
+    if (block < zip->zip_orig_blocks_size)
+    {
+      /* Fetch this block */
+      err = fetch_block (zip, block, &b);
+      if (err)
+	break;
+    }
+    else if (!(b = radix_lookup (&zip->cache.blocks, block)))
+    {
+      /* Allocate a new block, which needs to be zeroed unless it is
+	 about to be entirely overwritten.  */
+      b = slab_alloc (&blocks_slab);
+      if (!b)
+      {
+	err = ENOMEM;
+	break;
+      }
+      if (write < CACHE_BLOCK_SIZE)
+	bzero (b, CACHE_BLOCK_SIZE);
+
+      err = radix_insert (&zip->cache.blocks, block, b);
+      if (err)
+      {
+	slab_free (&blocks_slab, b);
+	break;
+      }
+    }
+
+    /* Copy the new data into cache.  */
+    memcpy (&b[offset], datap, write);
+
+    /* Go ahead with next block.  */
+    block++;
+    size  -= write;
+    offset = 0;
+    datap  = datap + write;
+  }
+
+  mutex_unlock (&zip->cache.lock);
+
+  return err;
+}
+
+/* Set STORE's size to SIZE (in bytes), i.e. adjust its cache size.  */
+static error_t
+ZIP (set_size) (struct store *store, size_t size)
+{
+  error_t err = 0;
+  struct ZIP (object) *zip = store->misc;
+  size_t newsize;	/* Number of blocks */
+
+  mutex_lock (&zip->cache.lock);
+  newsize = size ? BLOCK_NUMBER (size - 1) + 1 : 0;
+
+  debug (("old/new size = %lli / %u", store->size, size));
+
+  if (zip->append && (size < zip->write.zip_offs))
+    /* Data which was compressed already gets cut off */
+    err = ZIP (append_stop) (zip);
+
+  if (size < store->size)
+    /* Free unused cache blocks */
+    radix_truncate (&zip->cache.blocks, newsize, block_release, NULL);
+
+  if (!err)
+    store->size = store->end = store->wrap_src = store->runs[0].length = size;
+
+  mutex_unlock (&zip->cache.lock);
+
+  debug (("newsize is %lli (err = %s)", store->size, strerror (err)));
+
+  return err;
+}
+
+/* Modify SOURCE to reflect those runs in RUNS, and return it in STORE.  */
+error_t
+ZIP (remap) (struct store *source,
+	    const struct store_run *runs, size_t num_runs,
+	    struct store **store)
+{
+  return EOPNOTSUPP;
+}
+
+error_t
+ZIP (allocate_encoding) (const struct store *store, struct store_enc *enc)
+{
+  return EOPNOTSUPP;
+}
+
+error_t
+ZIP (encode) (const struct store *store, struct store_enc *enc)
+{
+  return EOPNOTSUPP;
+}
+
+error_t
+ZIP (decode) (struct store_enc *enc, const struct store_class *const *classes,
+	     struct store **store)
+{
+  return EOPNOTSUPP;
+}
+
+static error_t
+ZIP (validate_name) (const char *name, const struct store_class *const *classes)
+{
+  return 0;
+}
+
+static error_t
+ZIP (map) (const struct store *store, vm_prot_t prot, mach_port_t *memobj)
+{
+  *memobj = MACH_PORT_NULL;
+  return EOPNOTSUPP;
+}
+
+
+/* Traverses the whole zip store STORE and allocate its cache.
+   Returns STORE's size (the uncompressed stream size) in SIZE.
+   The uncompressed stream is passed to the traverse hook, if any.
+   Going through the stream also records the read stream's checkpoints,
+   if any (see ZIP (stream_read)).
+   This should be called *only once* when initializing STORE.  */
+static inline error_t
+traverse (struct store *const store, size_t *const size)
+{
+  error_t err;
+  struct ZIP (object) *zip = store->misc;
+  size_t total_size = 0;
+  char buf[ZIP_BUFSIZE];
+
+  /* No need to lock the cache here since this is called from
+     the open method.  */
+
+#ifdef ZIP_HAS_BLOCKS
+  /* Decompress independent blocks in parallel if possible */
+  err = ZIP (traverse_blocks) (zip, size);
+  if (err != EOPNOTSUPP)
+  {
+    return err;
+  }
+#endif
+
+  /* We could cache the whole file but we don't, in order to minimize memory
+     usage.  */
+  while (zip->read.zip_status != STATUS_EOF)
+  {
+    size_t len;
+
+    err = ZIP (stream_read) (zip, ZIP_BUFSIZE, buf, &len);
+    if (err || !len)
+      break;
+
+    if (STORE_ZIP (traverse_hook))
+      STORE_ZIP (traverse_hook) (buf, len);
+
+    clean_fill (zip, total_size, buf, len);
+    total_size += len;
+  }
+
+  if (err)
+  {
+    debug (("error = %s", strerror (err)));
+    return err;
+  }
+
+  debug (("file traversed (offset file/zip = %llu / %llu, %u checkpoints)",
+          zip->read.file_offs, zip->read.zip_offs, zip->read.index.count));
+
+  *size = total_size;
+
+  return err;
+}
+
+
+/* Seek index files.  */
+
+/* Header of a seek index file.  Index files are only meant to be reused on
+   the machine that wrote them so they are written in native byte order.  */
+struct index_header
+{
+  char     magic[8];
+  uint32_t version;
+  char     type[8];		/* Store type (i.e. ZIP_TYPE) */
+
+  /* Size, modification time and hash (see ZIP (index_hash)) of the
+     underlying file when the index was written.  */
+  uint64_t file_size;
+  int64_t  file_mtime;
+  uint64_t file_hash;
+
+  /* Size of the uncompressed stream and number of checkpoints */
+  uint64_t zip_size;
+  uint64_t count;
+};
+
+/* A checkpoint as stored in an index file, followed by WINDOW_LEN bytes
+   of window.  */
+struct index_checkpoint
+{
+  uint64_t file_offs;
+  uint64_t zip_offs;
+  uint32_t crc;
+  int32_t  bits;
+  uint32_t window_len;
+};
+
+/* Computes in HASH a FNV-1a hash of the first and last ZIP_INDEX_HASHED
+   bytes of ZIP's underlying store.  */
+static error_t
+ZIP (index_hash) (struct ZIP (object) *zip, uint64_t *hash)
+{
+  error_t err;
+  char buf[ZIP_INDEX_HASHED];
+  store_offset_t size = zip->source->size;
+  store_offset_t offs[2] = { 0, MAX (size, ZIP_INDEX_HASHED)
+				- ZIP_INDEX_HASHED };
+  size_t len, i;
+  int n;
+
+  *hash = 14695981039346656037ULL;
+
+  for (n = 0; n < 2; n++)
+  {
+    err = store_simple_read (zip->source, offs[n],
+			     MIN (size - offs[n], ZIP_INDEX_HASHED),
+			     buf, &len);
+    if (err)
+      return err;
+
+    for (i = 0; i < len; i++)
+    {
+      *hash ^= (uchar) buf[i];
+      *hash *= 1099511628211ULL;
+    }
+  }
+
+  return 0;
+}
+
+/* Loads ZIP's seek index from its index file, provided that it matches the
+   underlying file.  On success, the checkpoints are put into ZIP's read
+   stream index and the size of the uncompressed stream is returned in
+   SIZE.  */
+static error_t
+ZIP (index_load) (struct ZIP (object) *zip, size_t *size)
+{
+  error_t err = 0;
+  FILE *file;
+  struct stat st;
+  struct index_header hdr;
+  uint64_t hash;
+  size_t i;
+
+  if ((!zip->index_name) || (!zip->source->size))
+    return ENOENT;
+
+  file = fopen (zip->index_name, "r");
+  if (!file)
+    return errno;
+
+  if ((fread (&hdr, sizeof (hdr), 1, file) != 1)
+      || memcmp (hdr.magic, ZIP_INDEX_MAGIC, sizeof (hdr.magic))
+      || (hdr.version != ZIP_INDEX_VERSION)
+      || strncmp (hdr.type, STRINGIFY (ZIP_TYPE), sizeof (hdr.type))
+      || (hdr.zip_size > (size_t) -1))
+    err = EINVAL;
+
+  /* Make sure this index was computed from the current archive */
+  if ((!err) && stat (zip->file_name, &st))
+    err = errno;
+  if ((!err) && ((hdr.file_size != zip->source->size)
+		 || (hdr.file_mtime != st.st_mtime)))
+    err = ESTALE;
+  if (!err)
+    err = ZIP (index_hash) (zip, &hash);
+  if ((!err) && (hash != hdr.file_hash))
+    err = ESTALE;
+
+  for (i = 0; (!err) && (i < hdr.count); i++)
+  {
+    struct index_checkpoint entry;
+    struct checkpoint *point, *last = checkpoint_last (&zip->read.index);
+
+    if ((fread (&entry, sizeof (entry), 1, file) != 1)
+	|| (entry.file_offs > hdr.file_size)
+	|| (entry.zip_offs > hdr.zip_size)
+	|| (last && (entry.zip_offs <= last->zip_offs))
+	|| (entry.bits < 0) || (entry.bits > 7)
+	|| (entry.window_len > (1 << 16)))
+    {
+      err = EINVAL;
+      break;
+    }
+
+    point = calloc (1, sizeof (struct checkpoint));
+    if (!point)
+    {
+      err = ENOMEM;
+      break;
+    }
+
+    point->file_offs  = entry.file_offs;
+    point->zip_offs   = entry.zip_offs;
+    point->bits       = entry.bits;
+#ifdef ZIP_CRC_UPDATE
+    point->crc        = entry.crc;
+#endif
+    point->window_len = entry.window_len;
 
-    /* Allocate/fetch this block if not here yet (copy-on-write).  */
-    if (!blocks[block])
+    if (entry.window_len)
     {
-      if (block < zip->zip_orig_blocks_size)
-      {
-	/* Fetch this block */
-	err = fetch_block (zip, block);
-	if (err)
-	  break;
-      }
-      else
-      {
-        /* Allocate a new block */
-        char *b = calloc (CACHE_BLOCK_SIZE, sizeof (char));
-        if (!b)
-        {
-          err = ENOMEM;
-          break;
-        }
-        blocks[block] = b;
-      }
+      point->window = malloc (entry.window_len);
+      if (!point->window)
+	err = ENOMEM;
+      else if (fread (point->window, entry.window_len, 1, file) != 1)
+	err = EINVAL;
     }
 
-    /* Copy the new data into cache.  */
-    memcpy (&blocks[block][offset], datap, write);
+    if (!err)
+      err = checkpoint_append (&zip->read.index, point);
 
-    /* Go ahead with next block.  */
-    block++;
-    size  -= write;
-    offset = 0;
-    datap  = datap + write;
+    if (err)
+    {
+      free (point->window);
+      free (point);
+    }
   }
 
-  mutex_unlock (&zip->cache.lock);
+  fclose (file);
+
+  if (err)
+    checkpoint_index_free (&zip->read.index);
+  else
+    *size = hdr.zip_size;
+
+  debug (("%s: %s (%u checkpoints)", zip->index_name, strerror (err),
+	  zip->read.index.count));
 
   return err;
 }
 
-/* Set STORE's size to SIZE (in bytes), i.e. adjust its cache size.  */
+/* Saves INDEX, the checkpoints of a ZIP_SIZE bytes long uncompressed
+   stream, to ZIP's index file.  The index is first written to a temporary
+   file which is then renamed so that no one ever sees a partial index.  */
 static error_t
-ZIP (set_size) (struct store *store, size_t size)
+ZIP (index_save) (struct ZIP (object) *zip,
+		  const struct checkpoint_index *index, size_t zip_size)
 {
   error_t err = 0;
-  struct ZIP (object) *zip = store->misc;
-  size_t *blocks_size;
-  char ***blocks;
-  size_t newsize, oldsize;	/* Size of BLOCKS */
-
-  mutex_lock (&zip->cache.lock);
-  blocks_size = &zip->cache.size;
-  blocks      = &zip->cache.blocks;
-  oldsize     = *blocks_size;
-  newsize     = size ? BLOCK_NUMBER (size - 1) + 1 : 0;
+  FILE *file;
+  char *tmp_name;
+  struct stat st;
+  struct index_header hdr;
+  size_t i;
+  int ok;
+
+  if ((!zip->index_name) || (!zip->source->size))
+    return 0;
 
-  debug (("old/new size = %lli / %u", store->size, size));
+  bzero (&hdr, sizeof (hdr));
+  memcpy (hdr.magic, ZIP_INDEX_MAGIC, sizeof (hdr.magic));
+  strncpy (hdr.type, STRINGIFY (ZIP_TYPE), sizeof (hdr.type));
+  hdr.version  = ZIP_INDEX_VERSION;
+  hdr.zip_size = zip_size;
+  hdr.count    = index->count;
 
-  /* Check whether the cache needs to be grown */
-  if (size > store->size)
-  {
-    if (newsize > oldsize)
-    {
-      /* Enlarge the block vector */
-      char **newblocks;
+  if (stat (zip->file_name, &st))
+    return errno;
+  hdr.file_size  = zip->source->size;
+  hdr.file_mtime = st.st_mtime;
 
-      newblocks = realloc (*blocks, newsize * sizeof (char *));
-      if (!newblocks)
-        err = ENOMEM;
-      else
-      {
-	*blocks = newblocks;
+  err = ZIP (index_hash) (zip, &hdr.file_hash);
+  if (err)
+    return err;
 
-	/* Zero the new blocks but don't actually allocate them */
-	bzero (&(*blocks)[*blocks_size],
-	       (newsize - *blocks_size) * sizeof (char *));
+  if (asprintf (&tmp_name, "%s.new", zip->index_name) < 0)
+    return ENOMEM;
 
-	*blocks_size = newsize;
-      }
-    }
+  file = fopen (tmp_name, "w");
+  if (!file)
+  {
+    err = errno;
+    free (tmp_name);
+    return err;
   }
-  else
+
+  ok = (fwrite (&hdr, sizeof (hdr), 1, file) == 1);
+
+  for (i = 0; ok && (i < index->count); i++)
   {
-    int i;
+    struct checkpoint *point = index->points[i];
+    struct index_checkpoint entry;
 
-    /* Free unused cache blocks */
-    for (i = newsize; i < *blocks_size; i++)
-      free ((*blocks)[i]);
+    bzero (&entry, sizeof (entry));
+    entry.file_offs  = point->file_offs;
+    entry.zip_offs   = point->zip_offs;
+    entry.bits       = point->bits;
+#ifdef ZIP_CRC_UPDATE
+    entry.crc        = point->crc;
+#endif
+    entry.window_len = point->window_len;
 
-    /* Reduce cache vector */
-    *blocks = realloc (*blocks, newsize * sizeof (char *));
-    *blocks_size = newsize;
+    ok = (fwrite (&entry, sizeof (entry), 1, file) == 1);
+    if (ok && point->window_len)
+      ok = (fwrite (point->window, point->window_len, 1, file) == 1);
   }
 
-  if (!err)
-    store->size = store->end = store->wrap_src = store->runs[0].length = size;
+  if (!ok)
+    err = errno ?: EIO;
+  if (fclose (file) && !err)
+    err = errno;
+  if ((!err) && rename (tmp_name, zip->index_name))
+    err = errno;
+  if (err)
+    unlink (tmp_name);
 
-  mutex_unlock (&zip->cache.lock);
+  debug (("%s: %s (%u checkpoints)", zip->index_name, strerror (err),
+	  index->count));
 
-  debug (("newsize is %lli (err = %s)", store->size, strerror (err)));
+  free (tmp_name);
 
   return err;
 }
+
+
 
-/* Modify SOURCE to reflect those runs in RUNS, and return it in STORE.  */
-error_t
-ZIP (remap) (struct store *source,
-	    const struct store_run *runs, size_t num_runs,
-	    struct store **store)
-{
-  return EOPNOTSUPP;
-}
-
-error_t
-ZIP (allocate_encoding) (const struct store *store, struct store_enc *enc)
-{
-  return EOPNOTSUPP;
-}
+/* Parallel compression.  */
 
-error_t
-ZIP (encode) (const struct store *store, struct store_enc *enc)
+#ifdef ZIP_HAS_CHUNKS
+/* Maximum number of cache blocks of a chunk */
+#define ZIP_CHUNK_BLOCKS  BLOCK_NUMBER (ZIP_CHUNK_SIZE + CACHE_BLOCK_SIZE - 1)
+
+/* A chunk of the uncompressed stream, compressed by a worker thread while
+   the previous ones are being written (see ZIP (sync_chunks)).  */
+struct chunk
 {
-  return EOPNOTSUPP;
-}
+  /* The compression work (this must come first) */
+  struct work work;
 
-error_t
-ZIP (decode) (struct store_enc *enc, const struct store_class *const *classes,
-	     struct store **store)
+  /* The cache blocks holding the chunk (ZIP_CHUNK_BLOCKS of them), and
+     the chunk's size */
+  char **blocks;
+  size_t len;
+
+  /* Copy of the data preceding the chunk which it may refer to, if any */
+  char *dict;
+  size_t dict_len;
+
+  /* Non-zero if this is the last chunk of the stream */
+  int last;
+
+  /* The compressed chunk (BITS bits long), the CRC of the uncompressed
+     chunk, or an error */
+  uchar *data;
+  size_t bits;
+  uint32_t crc;
+  error_t err;
+};
+
+/* Compresses the chunk WORK.  This is called by a worker thread.  */
+static void
+ZIP (chunk_compress) (struct work *work)
 {
-  return EOPNOTSUPP;
+  struct chunk *chunk = (struct chunk *) work;
+
+  chunk->err = ZIP_CHUNK_COMPRESS (chunk);
 }
-
+
+/* Prepares CHUNK to be chunk number NUMBER out of COUNT of ZIP's SIZE bytes
+   long uncompressed stream, and queues it.  The blocks it is made of are
+   cached first.  This assumes that ZIP's cache is locked.  */
 static error_t
-ZIP (validate_name) (const char *name, const struct store_class *const *classes)
+ZIP (chunk_queue) (struct ZIP (object) *zip, struct chunk *chunk,
+		   size_t number, size_t count, size_t size)
 {
+  store_offset_t offs = (store_offset_t) number * ZIP_CHUNK_SIZE;
+  size_t block, first = BLOCK_NUMBER (offs);
+  error_t err;
+
+  chunk->len    = MIN (ZIP_CHUNK_SIZE, size - offs);
+  chunk->last   = (number == count - 1);
+  chunk->dict   = chunk->data = NULL;
+  chunk->dict_len = chunk->bits = 0;
+  chunk->crc    = 0;
+  chunk->err    = 0;
+
+  /* Make sure we do have the chunk's blocks */
+  for (block = first; block < first + BLOCK_NUMBER (chunk->len
+						     + CACHE_BLOCK_SIZE - 1);
+       block++)
+  {
+    char **b = &chunk->blocks[block - first];
+
+    if (block < zip->zip_orig_blocks_size)
+    {
+      err = fetch_block (zip, block, b);
+      if (err)
+	return err;
+    }
+    else if (!(*b = radix_lookup (&zip->cache.blocks, block)))
+    {
+      /* Allocate a new (zeroed) block */
+      *b = slab_alloc (&blocks_slab);
+      if (!*b)
+	return ENOMEM;
+      bzero (*b, CACHE_BLOCK_SIZE);
+
+      err = radix_insert (&zip->cache.blocks, block, *b);
+      if (err)
+      {
+	slab_free (&blocks_slab, *b);
+	return err;
+      }
+    }
+  }
+
+#if ZIP_CHUNK_DICT > 0
+  /* Let the chunk refer to the data preceding it, except at the beginning
+     of each checkpoint span so that decompression can resume there.  */
+  if (offs
+# ifdef ZIP_HAS_CHECKPOINTS
+      && (offs % ZIP_CHECKPOINT_SPAN)
+# endif
+      )
+  {
+    store_offset_t from;
+    size_t len;
+
+    chunk->dict_len = MIN (ZIP_CHUNK_DICT, offs);
+    chunk->dict = malloc (chunk->dict_len);
+    if (!chunk->dict)
+      return ENOMEM;
+
+    /* The previous chunk's blocks are still there */
+    for (from = offs - chunk->dict_len; from < offs; from += len)
+    {
+      len = MIN (CACHE_BLOCK_SIZE - BLOCK_RELATIVE_OFFSET (from), offs - from);
+      memcpy (&chunk->dict[from - (offs - chunk->dict_len)],
+	      (char *) radix_lookup (&zip->cache.blocks, BLOCK_NUMBER (from))
+	      + BLOCK_RELATIVE_OFFSET (from), len);
+    }
+  }
+#endif
+
+  chunk->work.fn = ZIP (chunk_compress);
+  work_queue (&chunk->work);
+
   return 0;
 }
 
-static error_t
-ZIP (map) (const struct store *store, vm_prot_t prot, mach_port_t *memobj)
+/* Records a checkpoint of ZIP's write stream at bit offset BIT of the
+   underlying store, corresponding to offset OFFS of the uncompressed stream
+   whose running CRC there is CRC.  */
+static void
+ZIP (chunk_checkpoint) (struct ZIP (object) *zip, store_offset_t bit,
+			store_offset_t offs, uint32_t crc)
 {
-  *memobj = MACH_PORT_NULL;
-  return EOPNOTSUPP;
+  struct checkpoint *point = calloc (1, sizeof (struct checkpoint));
+  if (!point)
+    /* Just do without */
+    return;
+
+  point->file_offs = (bit + 7) >> 3;
+  point->bits      = (point->file_offs << 3) - bit;
+  point->zip_offs  = offs;
+#ifdef ZIP_CRC_UPDATE
+  point->crc = crc;
+#endif
+
+  if (checkpoint_append (&zip->write.index, point))
+    free (point);
 }
 
-
-/* Traverses the whole zip store STORE and allocate its cache.
-   Returns STORE's size (the uncompressed stream size) in SIZE.
-   This should be called *only once* when initializing STORE.  */
-static inline error_t
-traverse (struct store *const store, size_t *const size)
+/* Compresses the SIZE first bytes of ZIP's cache into its underlying store.
+   The uncompressed stream is split into chunks which are compressed in
+   parallel by the worker threads, and then written in sequence as a single
+   compressed stream.  ADVERTISE is called before writing to the underlying
+   store, like with ZIP (stream_write).  The cache blocks are freed once
+   written.  This assumes that ZIP's cache is locked and that its write
+   stream has been initialized, which this terminates.  */
+static error_t
+ZIP (sync_chunks) (struct ZIP (object) *zip, size_t size,
+		   error_t (* advertise)
+		     (struct ZIP (object) *zip,
+		      store_offset_t offs, size_t amount))
 {
-  error_t err;
-  struct ZIP (object) *zip = store->misc;
-  size_t cache_size, total_size = 0, block = 0;
-  char buf[ZIP_BUFSIZE];
+  error_t err = 0;
+  int zerr;
+  char *buf = zip->write.buf;
+  store_offset_t *file_offs = &zip->write.file_offs;
+  size_t count = size ? (size - 1) / ZIP_CHUNK_SIZE + 1 : 1;
+  size_t slots = workers_count () << 1, queued = 0, written, out = 0, i;
+  struct chunk *chunks;
+  char **blocks;
+  uint32_t crc = 0;
 
-  /* No need to lock the cache here since this is called from
-     the open method.  */
+  /* Bits of the compressed stream which do not make a whole byte yet */
+  uchar pending = 0;
+  int pending_bits = 0;
 
-  /* Create an arbitrary size cache for the uncompressed stream */
-  cache_size = (BLOCK_NUMBER (zip->source->size) + 1) << 1;
-  zip->cache.blocks = calloc (cache_size, sizeof (char *));
-  if (!zip->cache.blocks)
-    return ENOMEM;
+  /* Write the OUT bytes of BUF to the underlying store.  */
+  error_t
+  flush (void)
+  {
+    error_t err;
+    size_t len;
+
+    err = advertise (zip, *file_offs, out);
+    if (!err)
+      err = store_simple_write (zip->source, *file_offs, buf, out, &len);
+    if (!err && (len != out))
+      err = EIO;
 
-  zip->cache.size = cache_size;
+    *file_offs += out;
+    out = 0;
 
-  /* We could cache the whole file but we don't, in order to minimize memory
-     usage.  */
-  while (zip->read.zip_status != STATUS_EOF)
+    return err;
+  }
+
+  /* Append the first BITS bits of DATA to the compressed stream.  */
+  error_t
+  put (const void *data, size_t bits)
   {
-    size_t len;
+    error_t err = 0;
+    const uchar *byte = data;
 
-    err = ZIP (stream_read) (zip, ZIP_BUFSIZE, buf, &len);
-    if (err || !len)
-      break;
+    for (; (!err) && (bits >= 8); bits -= 8, byte++)
+    {
+      if (out == ZIP_BUFSIZE)
+	err = flush ();
 
-    total_size += len;
+      buf[out++] = pending | (*byte >> pending_bits);
+      pending = *byte << (8 - pending_bits);
+    }
 
-    if (++block >= cache_size)
+    if ((!err) && bits)
     {
-      /* Grow the cache block vector */
-      char **blocks;
-      cache_size <<= 1;
-      blocks = realloc (zip->cache.blocks,
-			cache_size * sizeof (char *));
-      if (!blocks)
+      uchar last = *byte & (0xff << (8 - bits));
+
+      pending |= last >> pending_bits;
+      pending_bits += bits;
+
+      if (pending_bits >= 8)
       {
-	err = ENOMEM;
-	break;
+	if (out == ZIP_BUFSIZE)
+	  err = flush ();
+
+	buf[out++] = pending;
+	pending_bits -= 8;
+	pending = last << (bits - pending_bits);
       }
+    }
 
-      bzero (&blocks[zip->cache.size],
-             (cache_size - zip->cache.size) * sizeof (char *));
+    return err;
+  }
 
-      zip->cache.size = cache_size;
-      zip->cache.blocks = blocks;
-    }
+
+  chunks = calloc (slots, sizeof (struct chunk));
+  blocks = calloc (slots * ZIP_CHUNK_BLOCKS, sizeof (char *));
+  if (!chunks || !blocks)
+  {
+    free (chunks);
+    free (blocks);
+    return ENOMEM;
   }
 
-  if (err)
+  for (i = 0; i < slots; i++)
+    chunks[i].blocks = &blocks[i * ZIP_CHUNK_BLOCKS];
+
+  err = ZIP_CHUNK_BEGIN (put);
+
+  for (written = 0; (!err) && (written < count); written++)
   {
-    debug (("error = %s", strerror (err)));
-    return err;
+    struct chunk *chunk = &chunks[written % slots];
+    store_offset_t offs = (store_offset_t) written * ZIP_CHUNK_SIZE;
+
+    /* Keep the workers busy */
+    for (; (!err) && (queued < count) && (queued < written + slots);
+	 queued++)
+      err = ZIP (chunk_queue) (zip, &chunks[queued % slots], queued,
+			       count, size);
+    if (err)
+      break;
+
+    work_wait (&chunk->work);
+    err = chunk->err;
+    if (err)
+      break;
+
+    if ((!chunk->dict_len) && chunk->bits)
+      /* Decompression may resume here */
+      ZIP (chunk_checkpoint) (zip, ((*file_offs + out) << 3) + pending_bits,
+			      offs, crc);
+
+    err = put (chunk->data, chunk->bits);
+    crc = ZIP_CHUNK_CRC_COMBINE (crc, chunk->crc, chunk->len);
+
+    /* We are done with this chunk */
+    for (i = 0; i < BLOCK_NUMBER (chunk->len + CACHE_BLOCK_SIZE - 1); i++)
+      slab_free (&blocks_slab,
+		 radix_remove (&zip->cache.blocks, BLOCK_NUMBER (offs) + i));
+
+    free (chunk->data);
+    free (chunk->dict);
+    chunk->data = NULL;
+    chunk->dict = NULL;
   }
 
-  debug (("file traversed (offset file/zip = %llu / %llu)",
-          zip->read.file_offs, zip->read.zip_offs));
+#ifdef ZIP_HAS_BLOCKS
+  if ((!err) && zip->write.index.count)
+    /* Mark the end of the last block */
+    ZIP (chunk_checkpoint) (zip, ((*file_offs + out) << 3) + pending_bits,
+			    size, crc);
+#endif
 
-  *size = total_size;
+  if (!err)
+    err = ZIP_CHUNK_END (crc, size, put);
+
+  if ((!err) && pending_bits)
+  {
+    /* Pad the last byte */
+    if (out == ZIP_BUFSIZE)
+      err = flush ();
+    buf[out++] = pending;
+  }
+
+  if (!err)
+    err = flush ();
+
+  /* Wait for the chunks still being compressed */
+  for (i = 0; i < slots; i++)
+  {
+    work_wait (&chunks[i].work);
+    free (chunks[i].data);
+    free (chunks[i].dict);
+  }
+  free (chunks);
+  free (blocks);
+
+  /* The write stream was not used */
+  zerr = ZIP_COMPRESS_END (&zip->write.stream);
+  if (!err)
+    err = ZIP (error) (&zip->write.stream, zerr);
+
+  debug (("%u chunks written (file/zip: %lli / %u)", count, *file_offs, size));
 
   return err;
 }
+#endif
+
 
 
 /* Synchronizes STORE if it's opened read-write and if there are dirty pages.
@@ -1015,7 +2733,6 @@ ZIP (sync) (struct store *store)
   int dirty = 0, zerr;
   struct ZIP (object) *zip = store->misc;
   ZIP_STREAM *stream = &zip->write.stream;
-  char **blocks;
   size_t block;
 
   /* This is our ZIP (stream_write) callback. All it does is cache
@@ -1024,11 +2741,11 @@ ZIP (sync) (struct store *store)
   error_t
   cache_ahead (struct ZIP (object) *zip, store_offset_t offs, size_t amount)
   {
-    char lostbuf[CACHE_BLOCK_SIZE];
+    char *lostbuf = NULL;
     store_offset_t *read_foffs = &zip->read.file_offs,
                    *read_zoffs = &zip->read.zip_offs;
     enum status *read_fstatus = &zip->read.file_status;
-    size_t block = BLOCK_NUMBER (*read_zoffs);
+    size_t block;
     size_t read;
 
     debug (("Region offs=%lli amount=%u", offs, amount));
@@ -1040,24 +2757,44 @@ ZIP (sync) (struct store *store)
     {
       /* Assume the read stream is at the beginning of a block */
       assert (BLOCK_RELATIVE_OFFSET (*read_zoffs) == 0);
+      block = BLOCK_NUMBER (*read_zoffs);
 
       debug (("At block %i (offset %lli)", block, *read_zoffs));
 
-      if (!blocks[block])
+      if (!radix_lookup (&zip->cache.blocks, block))
+      {
         /* Cache this block */
-        err = fetch_block (zip, block);
+	char *data;
+        err = fetch_block (zip, block, &data);
+      }
       else
+      {
         /* Just skip this block */
-        err = ZIP (stream_read) (zip, CACHE_BLOCK_SIZE, lostbuf, &read);
+        if (!lostbuf)
+          lostbuf = slab_alloc (&blocks_slab);
+        err = lostbuf
+	      ? ZIP (stream_read) (zip, CACHE_BLOCK_SIZE, lostbuf, &read)
+	      : ENOMEM;
+      }
 
       if (err)
         break;
     }
 
+    slab_free (&blocks_slab, lostbuf);
+
     return err;
   }
 
 
+#ifdef ZIP_HAS_BLOCKS
+  /* Make sure no worker is still reading the underlying store */
+  ZIP (block_slots_free) (zip);
+#endif
+
+  /* Clean blocks won't be used anymore */
+  clean_free (zip);
+
   if ((store->flags && STORE_READONLY) ||
       (store->flags && STORE_HARD_READONLY))
     /* Store opened read-only */
@@ -1066,7 +2803,15 @@ ZIP (sync) (struct store *store)
   /* Hold the cache lock till the end--anyway, no one should try to get
      this lock since we are called from store_free ().  */
   mutex_lock (&zip->cache.lock);
-  blocks = zip->cache.blocks;
+
+  if (zip->append)
+  {
+    /* Compress what is left and terminate the stream */
+    debug (("Terminating appended stream"));
+    err = ZIP (append) (zip, store->size, 1);
+    assert_perror (err);
+    goto written;
+  }
 
   /* Initialize STREAM since this should not have be done before.  */
   err = ZIP (stream_write_init) (zip);
@@ -1077,60 +2822,76 @@ ZIP (sync) (struct store *store)
     dirty = 1;
 
   /* Look for dirty cache pages */
-  for (block = 0;
-       (!dirty) && (block <= BLOCK_NUMBER (store->size - 1));
-       block++)
-    dirty = (blocks[block] != NULL);
+  if (!radix_empty (&zip->cache.blocks))
+    dirty = 1;
 
   if (!dirty)
     /* Nothing to do */
     goto terminate;
 
+  /* The seek index is about to become obsolete */
+  if (zip->index_name)
+    unlink (zip->index_name);
+
   /* Traverse the file and sync it */
   debug (("Syncing!"));
   err = ZIP (stream_read_init) (zip);
   assert_perror (err);
 
+#ifdef ZIP_HAS_CHUNKS
+  if (workers_count () > 1)
+  {
+    /* Have the workers compress chunks of the stream in parallel */
+    err = ZIP (sync_chunks) (zip, store->size, cache_ahead);
+    assert_perror (err);
+  }
+  else
+#endif
   for (block = 0;
        block <= BLOCK_NUMBER (store->size - 1);
        block++)
   {
     int end = (block == BLOCK_NUMBER (store->size - 1));
     size_t amount, len;
+    char *b;
 
-    amount = end ? (store->size % CACHE_BLOCK_SIZE) : CACHE_BLOCK_SIZE;
+    amount = end ? (store->size - (block << CACHE_BLOCK_SIZE_LOG2))
+		 : CACHE_BLOCK_SIZE;
 
     /* Make sure we do have this block */
-    if (!blocks[block])
+    if (block < zip->zip_orig_blocks_size)
+    {
+      /* Fetch this block */
+      err = fetch_block (zip, block, &b);
+      if (err)
+	break;
+    }
+    else if (!(b = radix_lookup (&zip->cache.blocks, block)))
     {
-      if (block < zip->zip_orig_blocks_size)
+      /* Allocate a new (zeroed) block */
+      b = slab_alloc (&blocks_slab);
+      if (!b)
       {
-	/* Fetch this block */
-	err = fetch_block (zip, block);
-	if (err)
-	  break;
+	err = ENOMEM;
+	break;
       }
-      else
+      bzero (b, CACHE_BLOCK_SIZE);
+      err = radix_insert (&zip->cache.blocks, block, b);
+      if (err)
       {
-        /* Allocate a new (zeroed) block */
-        char *b = calloc (CACHE_BLOCK_SIZE, sizeof (char));
-        if (!b)
-        {
-          err = ENOMEM;
-          break;
-        }
-        blocks[block] = b;
+	slab_free (&blocks_slab, b);
+	break;
       }
     }
 
     /* Write the compressed stream for this block */
-    err = ZIP (stream_write) (zip, amount, blocks[block],
-			      &len, end, cache_ahead);
+    err = ZIP (stream_write) (zip, amount, b, &len, end, cache_ahead);
     assert_perror (err);
 
-    free (blocks[block]);
+    slab_free (&blocks_slab, radix_remove (&zip->cache.blocks, block));
   }
 
+written:
   if (zip->source->size > zip->write.file_offs)
   {
     /* Reduce the underlying store */
@@ -1139,6 +2900,9 @@ ZIP (sync) (struct store *store)
       error (0, err, "Unable to reduce store to %lli", zip->write.file_offs);
   }
 
+  /* Save the checkpoints recorded while compressing as the new index */
+  ZIP (index_save) (zip, &zip->write.index, store->size);
+
 terminate:
   debug (("Size file/zip/zip_orig: %lli / %lli / %u",
           zip->source->size, store->size, zip->zip_orig_size));
@@ -1148,7 +2912,11 @@ terminate:
   err  = ZIP (error) (stream, zerr);
   assert_perror (err);
 
-  free (zip->cache.blocks);
+  checkpoint_index_free (&zip->read.index);
+  checkpoint_index_free (&zip->write.index);
+  radix_truncate (&zip->cache.blocks, 0, block_release, NULL);
+  free (zip->index_name);
+  free (zip->file_name);
   free (zip);
   store->misc = NULL;
   store->misc_len = 0;
@@ -1168,6 +2936,29 @@ STORE_ZIP (class) =
   ZIP (map)
 };
 
+/* See zipstores.h */
+error_t
+STORE_ZIP (set_block_size) (size_t size)
+{
+  unsigned log2;
+
+  for (log2 = ZIP_BLOCK_MIN_LOG2;
+       (log2 < ZIP_BLOCK_MAX_LOG2) && (((size_t) 1 << log2) < size);
+       log2++)
+    ;
+
+  if (((size_t) 1 << log2) != size)
+    return EINVAL;
+
+  if (blocks_slab.size && (log2 != block_size_log2))
+    /* Some stores already use the current block size */
+    return EBUSY;
+
+  block_size_log2 = log2;
+
+  return 0;
+}
+
 
 /* Open an existing zip store.  */
 error_t
@@ -1186,6 +2977,10 @@ ZIP (open) (const char *name, int flags,
   assert (sizeof (zip->write.crc) == 4);
 #endif
 
+  /* Stores are opened one at a time (see open_store () in tarfs.c) */
+  if (!blocks_slab.size)
+    slab_cache_init (&blocks_slab, CACHE_BLOCK_SIZE);
+
   /* Get a port to the underlying file (used by store_create ()) */
   source = file_name_lookup (name,
 			     (flags & (STORE_READONLY | STORE_HARD_READONLY))
@@ -1226,12 +3021,23 @@ ZIP (open) (const char *name, int flags,
   
   zip->source = from;
   zip->read.file_status = zip->write.file_status = STATUS_RUNNING;
+#ifdef ZIP_HAS_BLOCKS
+  zip->last_block = -1;
+#endif
+
+  /* If this fails, we'll just do without a seek index */
+  zip->file_name = strdup (name);
+  if (zip->file_name
+      && (asprintf (&zip->index_name, "%s" ZIP_INDEX_SUFFIX, name) < 0))
+    zip->index_name = NULL;
   zip->store = *store;
   stream = &zip->read.stream;
 
   mutex_init (&zip->read.lock);
   mutex_init (&zip->write.lock);
   mutex_init (&zip->cache.lock);
+  radix_init (&zip->cache.blocks);
+  radix_init (&zip->clean.blocks);
 
   (*store)->flags = flags;
   (*store)->block_size = 1;
@@ -1256,11 +3062,23 @@ ZIP (open) (const char *name, int flags,
   err = ZIP (stream_read_init) (zip);
   assert_perror (err);
 
-  /* Traverse the whole file in order to create its offset map
-     and get its size (ie. the uncompressed stream length).  */
-  err = traverse (*store, &zip->zip_orig_size);
+  /* Get the uncompressed stream size and the checkpoints from the seek
+     index if it is up to date.  Otherwise, traverse the whole file in order
+     to create its offset map and get its size (ie. the uncompressed stream
+     length), and save the index for next time.  */
+  if (ZIP (index_load) (zip, &zip->zip_orig_size))
+  {
+    err = traverse (*store, &zip->zip_orig_size);
+    if (!err)
+      ZIP (index_save) (zip, &zip->read.index, zip->zip_orig_size);
+  }
+
   if (err)
   {
+    checkpoint_index_free (&zip->read.index);
+    clean_free (zip);
+    free (zip->index_name);
+    free (zip->file_name);
     free (zip);
     return err;
   }
@@ -31,4 +31,28 @@ extern error_t store_bzip2_open (const char *name,
 extern const struct store_class store_gzip_class;
 extern const struct store_class store_bzip2_class;
 
+/* When set, these hooks are called with each chunk of the uncompressed
+   stream, in order, while a store is being traversed when opened.  This
+   allows the stream to be parsed without decompressing it twice.  Note
+   that stores whose seek index is up to date are not traversed.  */
+extern void (* store_gzip_traverse_hook) (const void *data, size_t len);
+extern void (* store_bzip2_traverse_hook) (const void *data, size_t len);
+
+/* Set the size of the blocks of uncompressed data which the stores cache
+   to SIZE, a power of two between 4 KiB and 64 KiB (8 KiB by default).
+   Larger blocks make large reads cheaper.  This must be done before any
+   store is opened, otherwise EBUSY is returned.  */
+extern error_t store_gzip_set_block_size (size_t size);
+extern error_t store_bzip2_set_block_size (size_t size);
+
+/* Compress the stream of STORE, whose original stream must be empty (e.g.
+   a new archive), up to offset OFFS and free the cache blocks before OFFS,
+   rather than waiting for STORE to be freed.  The stream is then written
+   as it goes, each call carrying on from where the previous one left off.
+   Modifying data before OFFS is allowed but means that the whole stream
+   will be compressed again when STORE is freed.  Returns EOPNOTSUPP if the
+   stream of STORE is not empty.  */
+extern error_t store_gzip_flush (struct store *store, store_offset_t offs);
+extern error_t store_bzip2_flush (struct store *store, store_offset_t offs);
+
 #endif